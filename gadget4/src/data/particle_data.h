@@ -171,6 +171,12 @@ struct particle_data
 #endif
   }
 
+#if defined(GALOTFA_ON) && !defined(LEAN)
+  /* addresses of the private fields, used to describe the particle array to galotfa without copies */
+  inline const MyDouble *getMassAddr(void) const { return &Mass; }
+  inline const unsigned char *getTypeAddr(void) const { return &Type; }
+#endif
+
   inline void setMass(MyDouble mass)
   {
 #ifndef LEAN
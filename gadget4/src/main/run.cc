@@ -41,6 +41,61 @@
 // galotfa
 #ifdef GALOTFA_ON
 #include <galotfa.h>
+#include <vector>
+
+// describe the local particles to galotfa: galotfa reads the fields directly from Sp.P[]
+static void galotfa_view_of( simparticles& Sp, struct galotfa_particle_view* view )
+{
+    const ptrdiff_t stride = sizeof( particle_data );
+    view->particle_number  = Sp.NumPart;
+
+#if defined( IDS_48BIT ) || defined( SUBFIND_ORPHAN_TREATMENT )
+    // the IDs are converted by ID.get() into a heap buffer, which unpacks the 48-bit IDs and masks
+    // out the most significant bit: the flag of the formerly most bound particles
+    static std::vector< long long > ids;
+    ids.resize( Sp.NumPart );
+    for ( int i = 0; i < Sp.NumPart; i++ )
+        ids[ i ] = Sp.P[ i ].ID.get();
+    view->id = galotfa_strided_field( ids.data(), GALOTFA_INT64, sizeof( long long ) );
+#else
+    const int id_type = sizeof( MyIDType ) == 8 ? GALOTFA_UINT64 : GALOTFA_UINT32;
+    view->id          = galotfa_strided_field( &Sp.P->ID, id_type, stride );
+#endif
+
+#if defined( POSITIONS_IN_128BIT ) || defined( RANDOMIZE_DOMAINCENTER )
+    // these layouts can't be described by a strided view: convert them into a heap buffer
+    static std::vector< double > pos;
+    pos.resize( 3 * ( size_t )Sp.NumPart );
+    for ( int i = 0; i < Sp.NumPart; i++ )
+        Sp.intpos_to_pos( Sp.P[ i ].IntPos, &pos[ 3 * i ] );
+    for ( int j = 0; j < 3; j++ )
+        view->pos[ j ] = galotfa_strided_field( &pos[ j ], GALOTFA_DOUBLE, 3 * sizeof( double ) );
+#else
+    const int pos_type = sizeof( MyIntPosType ) == 8 ? GALOTFA_UINT64 : GALOTFA_UINT32;
+    for ( int j = 0; j < 3; j++ )
+    {
+        // pos = IntPos * FacIntToCoord ( + RegionCorner for the non-periodic box )
+        view->pos[ j ]       = galotfa_strided_field( &Sp.P->IntPos[ j ], pos_type, stride );
+        view->pos[ j ].scale = Sp.FacIntToCoord;
+#ifndef PERIODIC
+        view->pos[ j ].offset = Sp.RegionCorner[ j ];
+#endif
+    }
+#endif
+
+    const int vel_type = sizeof( MyFloat ) == sizeof( double ) ? GALOTFA_DOUBLE : GALOTFA_FLOAT;
+    for ( int j = 0; j < 3; j++ )
+        view->vel[ j ] = galotfa_strided_field( &Sp.P->Vel[ j ], vel_type, stride );
+
+#ifdef LEAN
+    view->mass = galotfa_constant_field( All.PartMass );
+    view->type = galotfa_constant_field( 1 );
+#else
+    const int mass_type = sizeof( MyDouble ) == sizeof( double ) ? GALOTFA_DOUBLE : GALOTFA_FLOAT;
+    view->mass          = galotfa_strided_field( Sp.P->getMassAddr(), mass_type, stride );
+    view->type          = galotfa_strided_field( Sp.P->getTypeAddr(), GALOTFA_UINT8, stride );
+#endif
+}
 #endif
 
 /*!
@@ -400,34 +455,16 @@ void sim::run( void )
 #endif
 
 #ifdef GALOTFA_ON
-        // Data collection part, which will be used in galotfa
-        // array of the particles' data
-#ifndef ZERO_MASS_POT_TRACER
-        double        coordinates[ Sp.NumPart ][ 3 ];  // coordinates array
-        static double pos[ 3 ];
-#endif  // use the coordinates and potentials of the potential tracer particles to save memory if
-        // ZERO_MASS_POT_TRACER is defined
-        int    ids[ Sp.NumPart ];
-        double masses[ Sp.NumPart ];
-        double velocities[ Sp.NumPart ][ 3 ];
-        int    types[ Sp.NumPart ];
-        for ( int i = 0; i < Sp.NumPart; i++ )
+        // API of galotfa: galotfa reads the particles' data through the view, without copies, and
+        // only at the steps which need any analysis
+        if ( galotfa_wants_step() )
         {
-            ids[ i ]    = Sp.P[ i ].ID.get();           // collect particle ids
-            masses[ i ] = Sp.P[ i ].getMass();          // collect masses
-            Sp.intpos_to_pos( Sp.P[ i ].IntPos, pos );  // collect coordinates
-            coordinates[ i ][ 0 ] = pos[ 0 ];
-            coordinates[ i ][ 1 ] = pos[ 1 ];
-            coordinates[ i ][ 2 ] = pos[ 2 ];
-            velocities[ i ][ 0 ]  = Sp.P[ i ].Vel[ 0 ];
-            velocities[ i ][ 1 ]  = Sp.P[ i ].Vel[ 1 ];
-            velocities[ i ][ 2 ]  = Sp.P[ i ].Vel[ 2 ];
-            types[ i ]            = ( unsigned int )Sp.P[ i ].getType();
+            struct galotfa_particle_view view;
+            galotfa_view_of( Sp, &view );
+            galotfa_view_without_pot_tracer( &view, All.Time );
         }
-
-        // API of galotfa
-        galotfa_without_pot_tracer( ids, types, masses, coordinates, velocities, All.Time,
-                                    Sp.NumPart );
+        else
+            galotfa_skip_step( All.Time );
 #endif
 
         All.NumCurrentTiStep++;
@@ -564,33 +601,16 @@ void sim::run( void )
 #endif
 
 #ifdef GALOTFA_ON
-    // Data collection part, which will be used in galotfa
-    // array of the particles' data
-#ifndef ZERO_MASS_POT_TRACER
-    double coordinates[ Sp.NumPart ][ 3 ];  // coordinates array
-    double pos[ 3 ];
-#endif  // use the coordinates and potentials of the potential tracer particles to save memory if
-        // ZERO_MASS_POT_TRACER is defined
-    int    ids[ Sp.NumPart ];
-    double masses[ Sp.NumPart ];
-    double velocities[ Sp.NumPart ][ 3 ];
-    int    types[ Sp.NumPart ];
-    for ( int i = 0; i < Sp.NumPart; i++ )
+    // API of galotfa: galotfa reads the particles' data through the view, without copies, and
+    // only at the steps which need any analysis
+    if ( galotfa_wants_step() )
     {
-        ids[ i ]    = Sp.P[ i ].ID.get();           // collect particle ids
-        masses[ i ] = Sp.P[ i ].getMass();          // collect masses
-        Sp.intpos_to_pos( Sp.P[ i ].IntPos, pos );  // collect coordinates
-        coordinates[ i ][ 0 ] = pos[ 0 ];
-        coordinates[ i ][ 1 ] = pos[ 1 ];
-        coordinates[ i ][ 2 ] = pos[ 2 ];
-        velocities[ i ][ 0 ]  = Sp.P[ i ].Vel[ 0 ];
-        velocities[ i ][ 1 ]  = Sp.P[ i ].Vel[ 1 ];
-        velocities[ i ][ 2 ]  = Sp.P[ i ].Vel[ 2 ];
-        types[ i ]            = ( unsigned int )Sp.P[ i ].getType();
+        struct galotfa_particle_view view;
+        galotfa_view_of( Sp, &view );
+        galotfa_view_without_pot_tracer( &view, All.Time );
     }
-
-    // API of galotfa
-    galotfa_without_pot_tracer( ids, types, masses, coordinates, velocities, All.Time, Sp.NumPart );
+    else
+        galotfa_skip_step( All.Time );
 #endif
     restart Restart{ Communicator };
     Restart.write( this ); /* write a restart file at final time - can be used to continue
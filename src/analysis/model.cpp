@@ -1,62 +1,211 @@
 #ifndef GALOTFA_MODEL_CPP
 #define GALOTFA_MODEL_CPP
 #include "model.h"
+#include "../tools/comm.h"
+#include "../tools/id_hash.h"
+#include "../tools/threads.h"
 #include "utils.h"
+#include <algorithm>
 #include <complex>
 #include <math.h>
 #include <mpi.h>
+#include <numeric>
 #include <string.h>
 #include <vector>
 
 using std::complex;
 namespace ana = galotfa::analysis;
 
-complex< double > ana::An( int array_len, double mass[], double x[], double y[],
-                           unsigned int order )
+// the number of particles processed together in the kernel, the inner loops over the lanes have
+// no dependency between iterations, so that the compiler can vectorize them
+#define FOURIER_LANES 8
+
+// the number of the values of a particle added by fourier_chunk()
+static inline unsigned int fourier_stride( unsigned int max_order, bool do_inertia )
 {
-    complex< double > result = 0;
-    complex< double > I( 0, 1 );  // the imaginary unit (0+1i)
-    double            phi = 0;    // the azimuthal angle
+    return 2 * max_order + 4 + ( do_inertia ? 7 : 0 );
+}
 
-    for ( int i = 0; i < array_len; ++i )
+// the particles in [begin, end) of the Fourier kernels, the values of each particle are added into
+// acc: the real parts of A0 ~ A_max_order, then the imaginary parts, the buckling numerator (real,
+// imag), and if do_inertia, the mass and the inertia tensor (xx, yy, zz, xy, xz, yz). If bins is
+// given, they are added into the block of acc of the bin of each particle instead, i.e. acc[ bin *
+// fourier_stride() ], where bins[ i - begin ] is the bin of the i-th particle, negative to skip it
+static void fourier_chunk( long begin, long end, double mass[], double x[], double y[],
+                           unsigned int max_order, double z[], bool do_bkl, bool do_inertia,
+                           const int bins[], double acc[] )
+{
+    const int          lanes  = FOURIER_LANES;
+    const unsigned int stride = fourier_stride( max_order, do_inertia );
+    const unsigned int im     = max_order + 1;      // the offset of the imaginary parts
+    const unsigned int bkl    = 2 * max_order + 2;  // the offset of the buckling numerator
+    const unsigned int extra  = 2 * max_order + 4;  // the offset of the mass and inertia
+    double             c[ FOURIER_LANES ], s[ FOURIER_LANES ];  // cos( phi ), sin( phi )
+    double             w[ FOURIER_LANES ];  // the mass, 0 for the padding and skipped lanes
+    double             xx[ FOURIER_LANES ], yy[ FOURIER_LANES ], zz[ FOURIER_LANES ];
+    int                bin[ FOURIER_LANES ] = { 0 };
+    double             r                    = 0;
+    long               i = 0, idx = 0;  // tmp variables for the loop
+    int                l = 0;
+    unsigned int       m = 0, k = 0;
+
+    // the values of the lanes in a block, and their per-lane sums: [ value ][ lane ]
+    std::vector< double > vals( stride * lanes, 0 ), sums( stride * lanes, 0 );
+    double*               re = vals.data();
+    double*               ii = vals.data() + im * lanes;
+
+    for ( i = begin; i < end; i += lanes )
     {
-        phi = atan2( y[ i ], x[ i ] );
-        result += mass[ i ] * exp( order * phi * I );
+        for ( l = 0; l < lanes; ++l )
+        {
+            // the padding lanes at the tail have zero mass, so they contribute nothing
+            idx      = i + l < end ? i + l : end - 1;
+            bin[ l ] = bins != nullptr && i + l < end ? bins[ idx - begin ] : 0;
+            xx[ l ]  = x[ idx ];
+            yy[ l ]  = y[ idx ];
+            zz[ l ]  = do_bkl || do_inertia ? z[ idx ] : 0;
+            w[ l ]   = i + l < end && bin[ l ] >= 0 ? mass[ idx ] : 0;
+            r        = sqrt( xx[ l ] * xx[ l ] + yy[ l ] * yy[ l ] );
+            c[ l ]   = r > 0 ? xx[ l ] / r : 1;  // the same as atan2( 0, 0 ) = 0
+            s[ l ]   = r > 0 ? yy[ l ] / r : 0;
+            re[ l ]  = w[ l ];
+            ii[ l ]  = 0;
+        }
+        // exp( i m phi ) = exp( i ( m - 1 ) phi ) * exp( i phi )
+        for ( m = 1; m <= max_order; ++m )
+            for ( l = 0; l < lanes; ++l )
+            {
+                re[ m * lanes + l ] = re[ ( m - 1 ) * lanes + l ] * c[ l ]
+                                      - ii[ ( m - 1 ) * lanes + l ] * s[ l ];
+                ii[ m * lanes + l ] = ii[ ( m - 1 ) * lanes + l ] * c[ l ]
+                                      + re[ ( m - 1 ) * lanes + l ] * s[ l ];
+            }
+        if ( do_bkl )
+            for ( l = 0; l < lanes; ++l )
+            {
+                vals[ bkl * lanes + l ]         = zz[ l ] * re[ 2 * lanes + l ];
+                vals[ ( bkl + 1 ) * lanes + l ] = zz[ l ] * ii[ 2 * lanes + l ];
+            }
+        if ( do_inertia )
+            for ( l = 0; l < lanes; ++l )
+            {
+                double* v = &vals[ extra * lanes + l ];  // the values are lanes apart
+                v[ 0 ]         = w[ l ];
+                v[ lanes ]     = w[ l ] * ( yy[ l ] * yy[ l ] + zz[ l ] * zz[ l ] );
+                v[ 2 * lanes ] = w[ l ] * ( xx[ l ] * xx[ l ] + zz[ l ] * zz[ l ] );
+                v[ 3 * lanes ] = w[ l ] * ( xx[ l ] * xx[ l ] + yy[ l ] * yy[ l ] );
+                v[ 4 * lanes ] = -w[ l ] * xx[ l ] * yy[ l ];
+                v[ 5 * lanes ] = -w[ l ] * xx[ l ] * zz[ l ];
+                v[ 6 * lanes ] = -w[ l ] * yy[ l ] * zz[ l ];
+            }
+
+        if ( bins == nullptr )
+            for ( k = 0; k < stride * lanes; ++k )
+                sums[ k ] += vals[ k ];
+        else  // scatter the lanes into their bins
+            for ( l = 0; l < lanes; ++l )
+                if ( w[ l ] != 0 )
+                    for ( k = 0; k < stride; ++k )
+                        acc[ bin[ l ] * stride + k ] += vals[ k * lanes + l ];
     }
 
+    // sum up the lanes
+    for ( k = 0; bins == nullptr && k < stride; ++k )
+        for ( l = 0; l < lanes; ++l )
+            acc[ k ] += sums[ k * lanes + l ];
+}
+
+int ana::fourier_modes( int array_len, double mass[], double x[], double y[],
+                        unsigned int max_order, complex< double > modes[], double z[],
+                        complex< double >* buckle )
+{
+    bool                  do_bkl = z != nullptr && buckle != nullptr && max_order >= 2;
+    std::vector< double > acc( fourier_stride( max_order, false ) );
+    auto kernel = [ & ]( long begin, long end, double partial[] ) {
+        fourier_chunk( begin, end, mass, x, y, max_order, z, do_bkl, false, nullptr, partial );
+    };
+    galotfa::threads::chunked_sum( array_len, acc.size(), acc.data(), kernel );
+    for ( unsigned int m = 0; m <= max_order; ++m )
+        modes[ m ] = complex< double >( acc[ m ], acc[ max_order + 1 + m ] );
+    if ( do_bkl )
+        *buckle = complex< double >( acc[ 2 * max_order + 2 ], acc[ 2 * max_order + 3 ] );
+    return 0;
+}
+
+int ana::fused_moments( int array_len, double mass[], double x[], double y[], double z[],
+                        unsigned int max_order, ana::moments& result )
+{
+    if ( max_order > 6 )
+    {
+        WARN( "The maximal supported order of An is 6, but get %u, ignore the higher orders.",
+              max_order );
+        max_order = 6;
+    }
+    if ( max_order < 2 )
+        max_order = 2;  // A2 is always needed for the bar related quantities
+
+    // all the moments are packed into one buffer of the layout of fourier_chunk(), so that only
+    // one MPI reduction is needed
+    const unsigned int    extra = 2 * max_order + 4;  // the offset of the mass and inertia
+    std::vector< double > buffer( fourier_stride( max_order, true ) );
+    auto kernel = [ & ]( long begin, long end, double acc[] ) {
+        fourier_chunk( begin, end, mass, x, y, max_order, z, true, true, nullptr, acc );
+    };
+    galotfa::threads::chunked_sum( array_len, buffer.size(), buffer.data(), kernel );
+
+    MPI_Allreduce( MPI_IN_PLACE, buffer.data(), ( int )buffer.size(), MPI_DOUBLE, MPI_SUM,
+                   galotfa::comm::current() );
+
+    // unpack the buffer, the orders above max_order are 0
+    for ( unsigned int m = 0; m < 7; ++m )
+        result.An[ m ] = m <= max_order
+                             ? complex< double >( buffer[ m ], buffer[ max_order + 1 + m ] )
+                             : 0;
+    result.buckle       = complex< double >( buffer[ extra - 2 ], buffer[ extra - 1 ] );
+    result.mass         = buffer[ extra ];
+    result.inertia[ 0 ] = buffer[ extra + 1 ];
+    result.inertia[ 4 ] = buffer[ extra + 2 ];
+    result.inertia[ 8 ] = buffer[ extra + 3 ];
+    result.inertia[ 1 ] = result.inertia[ 3 ] = buffer[ extra + 4 ];
+    result.inertia[ 2 ] = result.inertia[ 6 ] = buffer[ extra + 5 ];
+    result.inertia[ 5 ] = result.inertia[ 7 ] = buffer[ extra + 6 ];
+    return 0;
+}
+
+complex< double > ana::An( int array_len, double mass[], double x[], double y[],
+                           unsigned int order )
+{
+    std::vector< complex< double > > modes( order + 1 );
+    fourier_modes( array_len, mass, x, y, order, modes.data() );
+    complex< double > result = modes[ order ];
+
     // MPI reduction
-    MPI_Allreduce( MPI_IN_PLACE, &result, 1, MPI_DOUBLE_COMPLEX, MPI_SUM, MPI_COMM_WORLD );
+    MPI_Allreduce( MPI_IN_PLACE, &result, 1, MPI_DOUBLE_COMPLEX, MPI_SUM,
+                   galotfa::comm::current() );
     return result;
 }
 
 
 double ana::s_bar( int array_len, double mass[], double x[], double y[] )
 {
-    auto A2   = An( array_len, mass, x, y, 2 );
-    auto A0   = An( array_len, mass, x, y, 0 );
-    auto Abar = A2 / A0;
+    complex< double > modes[ 3 ];  // A0 ~ A2 in one pass
+    fourier_modes( array_len, mass, x, y, 2, modes );
+
+    // MPI reduction
+    MPI_Allreduce( MPI_IN_PLACE, modes, 3, MPI_DOUBLE_COMPLEX, MPI_SUM, galotfa::comm::current() );
+    auto Abar = modes[ 2 ] / modes[ 0 ];
     return abs( Abar );
 }
 
 double ana::s_buckle( int array_len, double mass[], double x[], double y[], double z[] )
 {
-    complex< double > numerator   = 0;
-    double            denominator = 0;
-    complex< double > I( 0, 1 );  // the imaginary unit (0+1i)
-    double            phi = 0;    // the azimuthal angle
-
-    for ( int i = 0; i < array_len; ++i )
-    {
-        phi = atan2( y[ i ], x[ i ] );
-        numerator += z[ i ] * mass[ i ] * exp( 2 * phi * I );
-        denominator += mass[ i ];
-    }
+    complex< double > modes[ 4 ];  // A0 ~ A2 and the numerator of the buckling strength
+    fourier_modes( array_len, mass, x, y, 2, modes, z, &modes[ 3 ] );
 
     // MPI reduction
-    MPI_Allreduce( MPI_IN_PLACE, &numerator, 1, MPI_DOUBLE_COMPLEX, MPI_SUM, MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, &denominator, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    MPI_Allreduce( MPI_IN_PLACE, modes, 4, MPI_DOUBLE_COMPLEX, MPI_SUM, galotfa::comm::current() );
 
-    return abs( numerator / denominator );
+    return abs( modes[ 3 ] / modes[ 0 ].real() );
 }
 
 double ana::bar_major_axis( int array_len, double mass[], double x[], double y[] )
@@ -67,45 +216,48 @@ double ana::bar_major_axis( int array_len, double mass[], double x[], double y[]
 
 double ana::bar_radius( int array_len, double mass[], double x[], double y[], double rmin,
                         double rmax, int rbins, double major_axis, double angle_threshold,
-                        double percentage, double* results )
+                        double percentage, double* results, galotfa::arena& scratch,
+                        size_t first_slot )
 {
     // static variables
-    static complex< double > I( 0, 1 );   // the imaginary unit (0+1i)
-    static double            phi    = 0;  // the azimuthal angle
-    static int               index  = 0;  // the array index of the bin
     static int               binnum = rbins;
     static double            min = rmin, max = rmax, range = max - min, bin_size = range / binnum;
     static double            angle = angle_threshold * M_PI / 180, percent = percentage / 100;
 
-    double*            s_bar    = new double[ binnum ]();
-    double*            phis     = new double[ binnum ]();
-    complex< double >* result   = new complex< double >[ binnum ]();
-    double*            mass_sum = new double[ binnum ]();
-    double             r        = 0;
+    // A0 ~ A2 of each bin in the layout of fourier_chunk(), to be reduced in one call
+    const unsigned int stride   = fourier_stride( 2, false );
+    const size_t       sums_len = stride * ( size_t )binnum;
+    double*            sums     = scratch.get< double >( first_slot, sums_len );
+    double*            s_bar    = scratch.get< double >( first_slot + 1, binnum );
+    double*            phis     = scratch.get< double >( first_slot + 2, binnum );
+    int*               bins     = scratch.get< int >( first_slot + 3, array_len );
 
-    for ( int i = 0; i < array_len; ++i )
-    {
-        r = sqrt( x[ i ] * x[ i ] + y[ i ] * y[ i ] );
-        if ( r < min || r > max )
-            continue;
-
-        index = ( int )( r - min ) / bin_size;
-        if ( index == binnum )
-            --index;
-
-        phi = atan2( y[ i ], x[ i ] );
-        result[ index ] += mass[ i ] * exp( 2 * phi * I );
-        mass_sum[ index ] += mass[ i ];
-    }
+    auto kernel = [ & ]( long begin, long end, double acc[] ) {
+        for ( long i = begin; i < end; ++i )
+        {
+            double r = sqrt( x[ i ] * x[ i ] + y[ i ] * y[ i ] );  // the cylindrical radius
+            if ( r < min || r > max )
+            {
+                bins[ i ] = -1;
+                continue;
+            }
+            int index = ( int )( ( r - min ) / bin_size );  // the array index of the bin
+            bins[ i ] = index == binnum ? index - 1 : index;
+        }
+        // the slice of this chunk, as fourier_chunk() indexes the bins from begin
+        fourier_chunk( begin, end, mass, x, y, 2, nullptr, false, false, bins + begin, acc );
+    };
+    galotfa::threads::chunked_sum( array_len, sums_len, sums, kernel );
 
     // MPI reduction
-    MPI_Allreduce( MPI_IN_PLACE, result, binnum, MPI_DOUBLE_COMPLEX, MPI_SUM, MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, mass_sum, binnum, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    MPI_Allreduce( MPI_IN_PLACE, sums, ( int )sums_len, MPI_DOUBLE, MPI_SUM,
+                   galotfa::comm::current() );
 
     for ( int i = 0; i < binnum; ++i )
     {
-        s_bar[ i ] = abs( result[ i ] / mass_sum[ i ] );
-        phis[ i ]  = arg( result[ i ] ) / 2;  // divide by 2, as the argument of A2 is 2*phi
+        complex< double > A2( sums[ i * stride + 2 ], sums[ i * stride + 5 ] );
+        s_bar[ i ] = abs( A2 / sums[ i * stride ] );  // A0 is the mass of the bin
+        phis[ i ]  = arg( A2 ) / 2;  // divide by 2, as the argument of A2 is 2*phi
     }
 
     results[ 0 ] = 0;  // calculate Rbar1
@@ -131,203 +283,562 @@ double ana::bar_radius( int array_len, double mass[], double x[], double y[], do
         }
     }
 
-    // release the memory
-    delete[] s_bar;
-    delete[] phis;
-    delete[] result;
-    delete[] mass_sum;
+    return 0;
+}
 
+int ana::inertia_tensor( int array_len, double mass[], double x[], double y[], double z[],
+                         double* tensor )
+{
+    auto kernel = [ & ]( long begin, long end, double acc[] ) {
+        for ( long i = begin; i < end; ++i )
+        {
+            acc[ 0 * 3 + 0 ] += mass[ i ] * ( y[ i ] * y[ i ] + z[ i ] * z[ i ] );
+            acc[ 0 * 3 + 1 ] -= mass[ i ] * x[ i ] * y[ i ];
+            acc[ 0 * 3 + 2 ] -= mass[ i ] * x[ i ] * z[ i ];
+            acc[ 1 * 3 + 0 ] -= mass[ i ] * y[ i ] * x[ i ];
+            acc[ 1 * 3 + 1 ] += mass[ i ] * ( x[ i ] * x[ i ] + z[ i ] * z[ i ] );
+            acc[ 1 * 3 + 2 ] -= mass[ i ] * y[ i ] * z[ i ];
+            acc[ 2 * 3 + 0 ] -= mass[ i ] * z[ i ] * x[ i ];
+            acc[ 2 * 3 + 1 ] -= mass[ i ] * z[ i ] * y[ i ];
+            acc[ 2 * 3 + 2 ] += mass[ i ] * ( x[ i ] * x[ i ] + y[ i ] * y[ i ] );
+        }
+    };
+    galotfa::threads::chunked_sum( array_len, 9, tensor, kernel );
     return 0;
 }
 
-int ana::dispersion_tensor( int array_len, double x[], double y[], double z[], double vx[],
-                            double vy[], double vz[], double lower_bound_x, double upper_bound_x,
-                            double lower_bound_y, double upper_bound_y, double lower_bound_z,
-                            double upper_bound_z, unsigned int num_bins_x, unsigned int num_bins_y,
-                            unsigned int num_bins_z, double* tensor )
+int ana::rotate_tensor_z( double* tensor, double phi )
 {
-    double bin_size_x = ( upper_bound_x - lower_bound_x ) / num_bins_x;
-    double bin_size_y = ( upper_bound_y - lower_bound_y ) / num_bins_y;
-    double bin_size_z = ( upper_bound_z - lower_bound_z ) / num_bins_z;
-
-    // sigma_ij = < v_i v_j > - < v_i > < v_j >
-    // the cross terms of the dispersion tensor
-    double* v00 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v01 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v02 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v10 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v11 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v12 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v20 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v21 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v22 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    // the second order moments of the velocity
-    double* v0 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v1 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    double* v2 = new double[ num_bins_x * num_bins_y * num_bins_z ]();
-    // the first order moments of the velocity
-    unsigned long* count = new unsigned long[ num_bins_x * num_bins_y * num_bins_z ]();
-
-    // the factor used to represent the index of the bin
-    unsigned int factor1 = num_bins_y * num_bins_z;
-    unsigned int factor2 = num_bins_z;
-
-    unsigned int i, j, k;  // tmp variables for the index of the bin
-
-    unsigned int index_x, index_y, index_z;  // tmp variables for the index of the bin
-    for ( i = 0; i < ( unsigned int )array_len; ++i )
-    {
-        if ( x[ i ] < lower_bound_x || x[ i ] > upper_bound_x || y[ i ] < lower_bound_y
-             || y[ i ] > upper_bound_y || z[ i ] < lower_bound_z || z[ i ] > upper_bound_z )
+    // T' = R T R^T, with the same convention of the coordinate rotation in the calculator:
+    // x' = x cos(phi) - y sin(phi), y' = x sin(phi) + y cos(phi)
+    double rot[ 3 ][ 3 ] = {
+        { cos( phi ), -sin( phi ), 0 }, { sin( phi ), cos( phi ), 0 }, { 0, 0, 1 }
+    };
+    double tmp[ 3 ][ 3 ] = { { 0 } };
+    int    i, j, k;  // tmp variables for the loop
+    for ( i = 0; i < 3; ++i )
+        for ( j = 0; j < 3; ++j )
+            for ( k = 0; k < 3; ++k )
+                tmp[ i ][ j ] += rot[ i ][ k ] * tensor[ k * 3 + j ];
+    for ( i = 0; i < 3; ++i )
+        for ( j = 0; j < 3; ++j )
         {
-            continue;
+            tensor[ i * 3 + j ] = 0;
+            for ( k = 0; k < 3; ++k )
+                tensor[ i * 3 + j ] += tmp[ i ][ k ] * rot[ j ][ k ];
         }
+    return 0;
+}
 
-        // calculate the index of the bin
-        index_x = ( unsigned int )( x[ i ] - lower_bound_x ) / bin_size_x;
-        index_y = ( unsigned int )( y[ i ] - lower_bound_y ) / bin_size_y;
-        index_z = ( unsigned int )( z[ i ] - lower_bound_z ) / bin_size_z;
-
-        // avoid the index out of range at the upper boundary
-        if ( index_x == num_bins_x )
-            --index_x;
-        if ( index_y == num_bins_y )
-            --index_y;
-        if ( index_z == num_bins_z )
-            --index_z;
-
-        v0[ index_x * factor1 + index_y * factor2 + index_z ] += vx[ i ];
-        v1[ index_x * factor1 + index_y * factor2 + index_z ] += vy[ i ];
-        v2[ index_x * factor1 + index_y * factor2 + index_z ] += vz[ i ];
-        v00[ index_x * factor1 + index_y * factor2 + index_z ] += vx[ i ] * vx[ i ];
-        v01[ index_x * factor1 + index_y * factor2 + index_z ] += vx[ i ] * vy[ i ];
-        v02[ index_x * factor1 + index_y * factor2 + index_z ] += vx[ i ] * vz[ i ];
-        v10[ index_x * factor1 + index_y * factor2 + index_z ] += vy[ i ] * vx[ i ];
-        v11[ index_x * factor1 + index_y * factor2 + index_z ] += vy[ i ] * vy[ i ];
-        v12[ index_x * factor1 + index_y * factor2 + index_z ] += vy[ i ] * vz[ i ];
-        v20[ index_x * factor1 + index_y * factor2 + index_z ] += vz[ i ] * vx[ i ];
-        v21[ index_x * factor1 + index_y * factor2 + index_z ] += vz[ i ] * vy[ i ];
-        v22[ index_x * factor1 + index_y * factor2 + index_z ] += vz[ i ] * vz[ i ];
-        count[ index_x * factor1 + index_y * factor2 + index_z ] += 1;
-    }
+// the bin index of a coordinate in [-half, half] with bin_num bins, or -1 if it's out of the range,
+// the same as that of ana::bin2d()
+static inline int image_bin( double coord, double half, unsigned int bin_num )
+{
+    if ( coord < -half || coord > half )
+        return -1;
+    unsigned int index = ( unsigned int )( ( coord + half ) / ( 2 * half ) * bin_num );
+    return index == bin_num ? bin_num - 1 : index;  // avoid the overflow at the upper bound
+}
 
-    // MPI reduction
-    MPI_Allreduce( MPI_IN_PLACE, v0, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v1, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v2, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v00, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v01, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v02, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v10, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v11, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v12, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v20, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v21, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, v22, num_bins_x * num_bins_y * num_bins_z, MPI_DOUBLE, MPI_SUM,
-                   MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, count, num_bins_x * num_bins_y * num_bins_z, MPI_UNSIGNED_LONG,
-                   MPI_SUM, MPI_COMM_WORLD );
-
-    // the factor used to represent the index of the bin
-    unsigned int factor3 = num_bins_y * num_bins_z * 9;
-    unsigned int factor4 = num_bins_z * 9;
-
-    for ( i = 0; i < num_bins_x; ++i )
-        for ( j = 0; j < num_bins_y; ++j )
-            for ( k = 0; k < num_bins_z; ++k )
+// the flat index of the voxel of a particle in the row-major ( x, y, z ) grid, or -1 if it's out of
+// the grid, with the same binning as the images
+static inline long long voxel_of( double x, double y, double z, double size, double third_size,
+                                  unsigned int base_binnum, unsigned int third_binnum )
+{
+    int bin_x = image_bin( x, size, base_binnum ), bin_y = image_bin( y, size, base_binnum ),
+        bin_z = image_bin( z, third_size, third_binnum );
+    if ( bin_x < 0 || bin_y < 0 || bin_z < 0 )
+        return -1;
+    return ( ( long long )bin_x * base_binnum + bin_y ) * third_binnum + bin_z;
+}
+
+int ana::image_moments( int array_len, double mass[], double x[], double y[], double z[],
+                        double* vels[ 3 ], double size, double third_size,
+                        unsigned int base_binnum, unsigned int third_binnum, int moment_num,
+                        double moments[], int root )
+{
+    size_t pixel_xy = ( size_t )base_binnum * base_binnum;
+    size_t pixel_xz = ( size_t )base_binnum * third_binnum;
+    size_t total    = ( size_t )moment_num * ( pixel_xy + 2 * pixel_xz );
+    // the offset of the first pixel of each projection, and the number of bins of its second axis
+    size_t       offsets[ 3 ] = { 0, moment_num * pixel_xy, moment_num * ( pixel_xy + pixel_xz ) };
+    unsigned int columns[ 3 ] = { base_binnum, third_binnum, third_binnum };
+    int          pairs[ 3 ][ 2 ] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };  // the axes of the projections
+
+    auto kernel = [ & ]( long begin, long end, double acc[] ) {
+        int     bins[ 3 ];  // the bin indexes along x, y and z
+        double* pixel = nullptr;
+        for ( long i = begin; i < end; ++i )
+        {
+            bins[ 0 ] = image_bin( x[ i ], size, base_binnum );
+            bins[ 1 ] = image_bin( y[ i ], size, base_binnum );
+            bins[ 2 ] = image_bin( z[ i ], third_size, third_binnum );
+            for ( int p = 0; p < 3; ++p )
             {
-                tensor[ i * factor3 + j * factor4 + k * 9 + 0 * 3 + 0 ] =
-                    v00[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v0[ i * factor1 + j * factor2 + k ] * v0[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 0 * 3 + 1 ] =
-                    v01[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v0[ i * factor1 + j * factor2 + k ] * v1[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 0 * 3 + 2 ] =
-                    v02[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v0[ i * factor1 + j * factor2 + k ] * v2[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 1 * 3 + 0 ] =
-                    v10[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v1[ i * factor1 + j * factor2 + k ] * v0[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 1 * 3 + 1 ] =
-                    v11[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v1[ i * factor1 + j * factor2 + k ] * v1[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 1 * 3 + 2 ] =
-                    v12[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v1[ i * factor1 + j * factor2 + k ] * v2[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 2 * 3 + 0 ] =
-                    v20[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v2[ i * factor1 + j * factor2 + k ] * v0[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 2 * 3 + 1 ] =
-                    v21[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v2[ i * factor1 + j * factor2 + k ] * v1[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
-                tensor[ i * factor3 + j * factor4 + k * 9 + 2 * 3 + 2 ] =
-                    v22[ i * factor1 + j * factor2 + k ] / count[ i * factor1 + j * factor2 + k ]
-                    - v2[ i * factor1 + j * factor2 + k ] * v2[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ]
-                          / count[ i * factor1 + j * factor2 + k ];
+                int row = bins[ pairs[ p ][ 0 ] ], column = bins[ pairs[ p ][ 1 ] ];
+                if ( row < 0 || column < 0 )
+                    continue;
+                pixel = acc + offsets[ p ] + moment_num * ( ( size_t )row * columns[ p ] + column );
+                pixel[ 0 ] += 1;
+                pixel[ 1 ] += mass[ i ];
+                if ( moment_num < 5 )
+                    continue;
+                for ( int n = 0; n < 3; ++n )
+                {
+                    pixel[ 2 + n ] += vels[ n ][ i ];
+                    if ( moment_num == 8 )
+                        pixel[ 5 + n ] += vels[ n ][ i ] * vels[ n ][ i ];
+                }
             }
+        }
+    };
+    galotfa::threads::chunked_sum( array_len, total, moments, kernel );
+
+    // all the images in one reduction
+    int rank;
+    MPI_Comm_rank( galotfa::comm::current(), &rank );
+    MPI_Reduce( rank == root ? MPI_IN_PLACE : moments, moments, ( int )total, MPI_DOUBLE, MPI_SUM,
+                root, galotfa::comm::current() );
+    return 0;
+}
 
-    // release the memory
-    delete[] v00;
-    delete[] v01;
-    delete[] v02;
-    delete[] v10;
-    delete[] v11;
-    delete[] v12;
-    delete[] v20;
-    delete[] v21;
-    delete[] v22;
-    delete[] v0;
-    delete[] v1;
-    delete[] v2;
-    delete[] count;
+// accumulate the velocity of a particle into the 10 moments of its voxel
+static inline void add_voxel_moments( double moments[], double vx, double vy, double vz )
+{
+    moments[ 0 ] += 1;
+    moments[ 1 ] += vx;
+    moments[ 2 ] += vy;
+    moments[ 3 ] += vz;
+    moments[ 4 ] += vx * vx;
+    moments[ 5 ] += vx * vy;
+    moments[ 6 ] += vx * vz;
+    moments[ 7 ] += vy * vy;
+    moments[ 8 ] += vy * vz;
+    moments[ 9 ] += vz * vz;
+}
 
+int ana::dispersion_moments( int array_len, double x[], double y[], double z[], double* vels[ 3 ],
+                             double size, double third_size, unsigned int base_binnum,
+                             unsigned int third_binnum, double moments[], int root )
+{
+    // the dense grid is too large to have a private copy per thread, so each thread owns a slab of
+    // the x bins, i.e. a contiguous range of the grid, and scans all the particles for its voxels,
+    // so the sums don't depend on the number of threads either
+    size_t total    = voxel_moment_num * ( size_t )base_binnum * base_binnum * third_binnum;
+    int    slab_num = std::min( galotfa::threads::chunks( array_len ), ( int )base_binnum );
+    auto   kernel   = [ & ]( int, long slab_begin, long slab_end ) {
+        for ( long i = 0; i < array_len; ++i )
+        {
+            int bin_x = image_bin( x[ i ], size, base_binnum );
+            if ( bin_x < slab_begin || bin_x >= slab_end )
+                continue;
+            long long voxel = voxel_of( x[ i ], y[ i ], z[ i ], size, third_size, base_binnum,
+                                        third_binnum );
+            if ( voxel >= 0 )
+                add_voxel_moments( moments + voxel_moment_num * voxel, vels[ 0 ][ i ],
+                                   vels[ 1 ][ i ], vels[ 2 ][ i ] );
+        }
+    };
+    std::fill( moments, moments + total, 0.0 );
+    galotfa::threads::for_chunks( base_binnum, slab_num, kernel );
+
+    // all the moments in one reduction
+    int rank;
+    MPI_Comm_rank( galotfa::comm::current(), &rank );
+    MPI_Reduce( rank == root ? MPI_IN_PLACE : moments, moments, ( int )total, MPI_DOUBLE, MPI_SUM,
+                root, galotfa::comm::current() );
     return 0;
 }
 
-int ana::inertia_tensor( int array_len, double mass[], double x[], double y[], double z[],
-                         double* tensor )
+int ana::sparse_dispersion_moments( int array_len, double x[], double y[], double z[],
+                                    double* vels[ 3 ], double size, double third_size,
+                                    unsigned int base_binnum, unsigned int third_binnum,
+                                    galotfa::arena& scratch, size_t first_slot,
+                                    galotfa::id_hash& rows, const long long*& voxels,
+                                    const double*& moments, size_t& voxel_num, int root )
 {
-    memset( tensor, 0, sizeof( double ) * 9 );
+    const int m = voxel_moment_num;
+    int       rank, size_of_comm;
+    MPI_Comm_rank( galotfa::comm::current(), &rank );
+    MPI_Comm_size( galotfa::comm::current(), &size_of_comm );
+
+    // the slots of the buffers, the local voxels and moments are replaced by the merged results
+    const size_t slot_row = first_slot, slot_voxels = first_slot + 1,
+                 slot_moments = first_slot + 2, slot_recv_voxels = first_slot + 3,
+                 slot_recv_moments = first_slot + 4, slot_counts = first_slot + 5,
+                 slot_order = first_slot + 6;
+
+    // the row of each particle in the local lists, -1 for the ones out of the voxels, so that the
+    // moments are allocated once with the number of the occupied voxels
+    int*       row_of       = scratch.get< int >( slot_row, array_len );
+    long long* local_voxels = scratch.get< long long >( slot_voxels, array_len );
+    int        local_num    = 0;
+    rows.clear();
+    for ( int i = 0; i < array_len; ++i )
+    {
+        long long voxel = voxel_of( x[ i ], y[ i ], z[ i ], size, third_size, base_binnum,
+                                    third_binnum );
+        row_of[ i ] = voxel < 0 ? -1 : rows.find( voxel );
+        if ( voxel >= 0 && row_of[ i ] < 0 )
+        {
+            row_of[ i ] = local_num;
+            rows.insert( voxel, local_num );
+            local_voxels[ local_num++ ] = voxel;
+        }
+    }
+    double* local_moments = scratch.get< double >( slot_moments, ( size_t )m * local_num );
+    std::fill( local_moments, local_moments + ( size_t )m * local_num, 0.0 );
     for ( int i = 0; i < array_len; ++i )
+        if ( row_of[ i ] >= 0 )
+            add_voxel_moments( local_moments + ( size_t )m * row_of[ i ], vels[ 0 ][ i ],
+                               vels[ 1 ][ i ], vels[ 2 ][ i ] );
+
+    // gather the occupied voxels to the process root
+    int  total  = 0;
+    int* counts = scratch.get< int >( slot_counts, 2 * ( size_t )size_of_comm );
+    int* displs = counts + size_of_comm;
+    MPI_Gather( &local_num, 1, MPI_INT, counts, 1, MPI_INT, root, galotfa::comm::current() );
+    for ( int r = 0; rank == root && r < size_of_comm; ++r )
+    {
+        displs[ r ] = total;
+        total += counts[ r ];
+    }
+    long long* recv_voxels  = scratch.get< long long >( slot_recv_voxels, total );
+    double*    recv_moments = scratch.get< double >( slot_recv_moments, ( size_t )m * total );
+    MPI_Gatherv( local_voxels, local_num, MPI_LONG_LONG, recv_voxels, counts, displs,
+                 MPI_LONG_LONG, root, galotfa::comm::current() );
+    for ( int r = 0; rank == root && r < size_of_comm; ++r )
     {
-        tensor[ 0 * 3 + 0 ] += mass[ i ] * ( y[ i ] * y[ i ] + z[ i ] * z[ i ] );
-        tensor[ 0 * 3 + 1 ] -= mass[ i ] * x[ i ] * y[ i ];
-        tensor[ 0 * 3 + 2 ] -= mass[ i ] * x[ i ] * z[ i ];
-        tensor[ 1 * 3 + 0 ] -= mass[ i ] * y[ i ] * x[ i ];
-        tensor[ 1 * 3 + 1 ] += mass[ i ] * ( x[ i ] * x[ i ] + z[ i ] * z[ i ] );
-        tensor[ 1 * 3 + 2 ] -= mass[ i ] * y[ i ] * z[ i ];
-        tensor[ 2 * 3 + 0 ] -= mass[ i ] * z[ i ] * x[ i ];
-        tensor[ 2 * 3 + 1 ] -= mass[ i ] * z[ i ] * y[ i ];
-        tensor[ 2 * 3 + 2 ] += mass[ i ] * ( x[ i ] * x[ i ] + y[ i ] * y[ i ] );
+        counts[ r ] *= m;
+        displs[ r ] *= m;
+    }
+    MPI_Gatherv( local_moments, m * local_num, MPI_DOUBLE, recv_moments, counts, displs,
+                 MPI_DOUBLE, root, galotfa::comm::current() );
+    voxel_num = 0;
+    voxels    = nullptr;
+    moments   = nullptr;
+    if ( rank != root )
+        return 0;
+
+    // sort the gathered voxels, and merge the ones from different processes
+    int* order = scratch.get< int >( slot_order, total );
+    std::iota( order, order + total, 0 );
+    std::sort( order, order + total,
+               [ recv_voxels ]( int a, int b ) { return recv_voxels[ a ] < recv_voxels[ b ]; } );
+    long long* merged_voxels  = scratch.get< long long >( slot_voxels, total );
+    double*    merged_moments = scratch.get< double >( slot_moments, ( size_t )m * total );
+    for ( int j = 0; j < total; ++j )
+    {
+        const double* from = recv_moments + ( size_t )m * order[ j ];
+        if ( voxel_num == 0 || merged_voxels[ voxel_num - 1 ] != recv_voxels[ order[ j ] ] )
+        {
+            merged_voxels[ voxel_num ] = recv_voxels[ order[ j ] ];
+            std::copy( from, from + m, merged_moments + ( size_t )m * voxel_num );
+            ++voxel_num;
+        }
+        else
+            for ( int k = 0; k < m; ++k )
+                merged_moments[ ( size_t )m * ( voxel_num - 1 ) + k ] += from[ k ];
     }
+    voxels  = merged_voxels;
+    moments = merged_moments;
     return 0;
 }
+
+void ana::voxel_dispersion( const double moments[], double tensor[ 6 ] )
+{
+    // sigma_ij = < v_i v_j > - < v_i > < v_j >, NaN for the empty voxels
+    static const int pairs[ 6 ][ 2 ] = { { 0, 0 }, { 0, 1 }, { 0, 2 },
+                                         { 1, 1 }, { 1, 2 }, { 2, 2 } };
+    double           count           = moments[ 0 ];
+    for ( int k = 0; k < 6; ++k )
+        tensor[ k ] = moments[ 4 + k ] / count
+                      - moments[ 1 + pairs[ k ][ 0 ] ] * moments[ 1 + pairs[ k ][ 1 ] ] / count
+                            / count;
+}
+
+#ifdef debug_model
+#include "../tools/prompt.h"
+namespace unit_test {
+int test_fused_moments()
+{
+    println( "Testing the fused kernel of the model moments ..." );
+    const int part_num = 1000;
+    double    mass[ part_num ], x[ part_num ], y[ part_num ], z[ part_num ];
+    double    eps = 1e-8;  // the numerical error
+    for ( int i = 0; i < part_num; ++i )
+    {
+        mass[ i ] = 1.0 + 0.5 * sin( i );
+        x[ i ]    = 3 * cos( 0.37 * i ) + 0.1 * i / part_num;
+        y[ i ]    = 1.5 * sin( 0.37 * i );
+        z[ i ]    = 0.2 * cos( 1.3 * i );
+    }
+
+    ana::moments res;
+    ana::fused_moments( part_num, mass, x, y, z, 6, res );
+
+    for ( unsigned int m = 0; m < 7; ++m )
+        if ( abs( res.An[ m ] - ana::An( part_num, mass, x, y, m ) ) > eps )
+        {
+            INFO( "Wrong A%u: get (%lf, %lf)", m, res.An[ m ].real(), res.An[ m ].imag() );
+            CHECK_RETURN( false );
+        }
+    if ( fabs( abs( res.buckle / res.mass ) - ana::s_buckle( part_num, mass, x, y, z ) ) > eps )
+        CHECK_RETURN( false );
+    if ( fabs( abs( res.An[ 2 ] / res.An[ 0 ] ) - ana::s_bar( part_num, mass, x, y ) ) > eps )
+        CHECK_RETURN( false );
+
+    // ana::inertia_tensor() is a local function, reduce it manually
+    double tensor[ 9 ] = { 0 };
+    ana::inertia_tensor( part_num, mass, x, y, z, tensor );
+    MPI_Allreduce( MPI_IN_PLACE, tensor, 9, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    for ( int i = 0; i < 9; ++i )
+        if ( fabs( res.inertia[ i ] - tensor[ i ] ) > eps * fabs( tensor[ i ] ) + eps )
+            CHECK_RETURN( false );
+
+    // the rotated tensor should be the same as the tensor of the rotated coordinates
+    double phi = 0.7, _x = 0;
+    for ( int i = 0; i < part_num; ++i )
+    {
+        _x     = x[ i ];
+        x[ i ] = _x * cos( phi ) - y[ i ] * sin( phi );
+        y[ i ] = _x * sin( phi ) + y[ i ] * cos( phi );
+    }
+    ana::rotate_tensor_z( res.inertia, phi );
+    ana::inertia_tensor( part_num, mass, x, y, z, tensor );
+    MPI_Allreduce( MPI_IN_PLACE, tensor, 9, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    for ( int i = 0; i < 9; ++i )
+        if ( fabs( res.inertia[ i ] - tensor[ i ] ) > eps * fabs( tensor[ i ] ) + eps )
+            CHECK_RETURN( false );
+
+    CHECK_RETURN( true );
+}
+
+int test_fourier_modes()
+{
+    println( "Testing the trig-free kernel of the Fourier modes ..." );
+    const int         part_num = 1 << 20;
+    const int         order    = 6;
+    double*           mass     = new double[ part_num ];
+    double*           x        = new double[ part_num ];
+    double*           y        = new double[ part_num ];
+    double*           z        = new double[ part_num ];
+    double            eps      = 1e-10;  // the relative numerical error
+    double            phi      = 0;
+    complex< double > I( 0, 1 );
+    complex< double > modes[ order + 1 ], ref[ order + 1 ], buckle = 0, ref_buckle = 0;
+    for ( int i = 0; i < part_num; ++i )
+    {
+        mass[ i ] = 1.0 + 0.5 * sin( i );
+        x[ i ]    = 3 * cos( 0.37 * i ) + 0.1 * i / part_num;
+        y[ i ]    = 1.5 * sin( 0.37 * i );
+        z[ i ]    = 0.2 * cos( 1.3 * i );
+    }
+    x[ 0 ] = y[ 0 ] = 0;  // a particle at the center
+
+    // the reference: the original path based on atan2 and exp
+    double start = MPI_Wtime();
+    for ( int i = 0; i < part_num; ++i )
+    {
+        phi = atan2( y[ i ], x[ i ] );
+        for ( int m = 0; m <= order; ++m )
+            ref[ m ] += mass[ i ] * exp( m * phi * I );
+        ref_buckle += z[ i ] * mass[ i ] * exp( 2 * phi * I );
+    }
+    double ref_time = MPI_Wtime() - start;
+
+    start = MPI_Wtime();
+    ana::fourier_modes( part_num, mass, x, y, order, modes, z, &buckle );
+    double new_time = MPI_Wtime() - start;
+    INFO( "A0 ~ A%d of %d particles: %.3lf ms with atan2/exp, %.3lf ms with the recurrence.", order,
+          part_num, ref_time * 1e3, new_time * 1e3 );
+
+    bool pass = abs( buckle - ref_buckle ) <= eps * abs( ref[ 0 ] );
+    for ( int m = 0; m <= order; ++m )
+        pass = pass && abs( modes[ m ] - ref[ m ] ) <= eps * abs( ref[ 0 ] );
+
+    // the tail of the lanes
+    ana::fourier_modes( 13, mass, x, y, order, modes );
+    for ( int m = 0; m <= order; ++m )
+    {
+        ref[ m ] = 0;
+        for ( int i = 0; i < 13; ++i )
+            ref[ m ] += mass[ i ] * exp( m * atan2( y[ i ], x[ i ] ) * I );
+        pass = pass && abs( modes[ m ] - ref[ m ] ) <= eps * abs( ref[ 0 ] );
+    }
+
+    delete[] mass;
+    delete[] x;
+    delete[] y;
+    delete[] z;
+    CHECK_RETURN( pass );
+}
+
+int test_image_moments()
+{
+    println( "Testing the pixel moments of the images ..." );
+    int rank;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    const int    part_num = 500;
+    const double size = 2.0, third_size = 1.0;
+    unsigned int base_binnum = 8, third_binnum = 4;
+    double       mass[ part_num ], x[ part_num ], y[ part_num ], z[ part_num ];
+    double       vx[ part_num ], vy[ part_num ], vz[ part_num ];
+    double*      vels[ 3 ] = { vx, vy, vz };
+    for ( int i = 0; i < part_num; ++i )
+    {
+        mass[ i ] = 1.0 + 0.5 * sin( i + rank );
+        x[ i ]    = 2.5 * sin( 0.37 * i + rank );
+        y[ i ]    = 2.5 * cos( 0.91 * i );
+        z[ i ]    = 1.2 * sin( 1.3 * i );
+        vx[ i ]   = cos( i );
+        vy[ i ]   = sin( 0.5 * i );
+        vz[ i ]   = 0.1 * i / part_num;
+    }
+    // a particle at the upper bounds is in the last pixel
+    x[ 0 ] = y[ 0 ] = size;
+    z[ 0 ]          = third_size;
+
+    size_t pixel_xy = base_binnum * base_binnum, pixel_xz = base_binnum * third_binnum;
+    std::vector< double > moments( 8 * ( pixel_xy + 2 * pixel_xz ) );
+    std::vector< double > ref( moments.size(), 0 );
+    ana::image_moments( part_num, mass, x, y, z, vels, size, third_size, base_binnum,
+                        third_binnum, 8, moments.data() );
+
+    // the reference: test each particle against the boundaries of each pixel
+    double* coords[ 3 ] = { x, y, z };
+    double  halves[ 3 ] = { size, size, third_size };
+    int     pairs[ 3 ][ 2 ] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };
+    size_t  offset          = 0;
+    for ( int p = 0; p < 3; ++p )
+    {
+        int          a = pairs[ p ][ 0 ], b = pairs[ p ][ 1 ];
+        unsigned int rows = base_binnum, columns = p == 0 ? base_binnum : third_binnum;
+        double       width_a = 2 * halves[ a ] / rows, width_b = 2 * halves[ b ] / columns;
+        for ( unsigned int r = 0; r < rows; ++r )
+            for ( unsigned int c = 0; c < columns; ++c )
+            {
+                double* pixel = &ref[ offset + 8 * ( r * columns + c ) ];
+                for ( int i = 0; i < part_num; ++i )
+                {
+                    double ca   = coords[ a ][ i ] + halves[ a ];
+                    double cb   = coords[ b ][ i ] + halves[ b ];
+                    bool   in_a = ca >= r * width_a
+                                && ( ca < ( r + 1 ) * width_a
+                                     || ( r == rows - 1 && ca <= 2 * halves[ a ] ) );
+                    bool   in_b = cb >= c * width_b
+                                && ( cb < ( c + 1 ) * width_b
+                                     || ( c == columns - 1 && cb <= 2 * halves[ b ] ) );
+                    if ( !in_a || !in_b )
+                        continue;
+                    pixel[ 0 ] += 1;
+                    pixel[ 1 ] += mass[ i ];
+                    for ( int n = 0; n < 3; ++n )
+                    {
+                        pixel[ 2 + n ] += vels[ n ][ i ];
+                        pixel[ 5 + n ] += vels[ n ][ i ] * vels[ n ][ i ];
+                    }
+                }
+            }
+        offset += 8 * rows * columns;
+    }
+    MPI_Allreduce( MPI_IN_PLACE, ref.data(), ref.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+
+    // only the root process has the reduced moments
+    if ( rank != 0 )
+        CHECK_RETURN( true );
+    double total = 0;
+    for ( size_t k = 0; k < moments.size(); ++k )
+    {
+        if ( fabs( moments[ k ] - ref[ k ] ) > 1e-10 * ( 1 + fabs( ref[ k ] ) ) )
+        {
+            INFO( "Wrong moment at %lu: get %lf, expect %lf", k, moments[ k ], ref[ k ] );
+            CHECK_RETURN( false );
+        }
+        total += k % 8 == 0 ? moments[ k ] : 0;
+    }
+    CHECK_RETURN( total > 0 && moments[ 8 * ( pixel_xy - 1 ) ] >= 1 );
+}
+
+int test_dispersion_moments()
+{
+    println( "Testing the dense and sparse moments of the dispersion tensor ..." );
+    int rank, size_of_comm;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &size_of_comm );
+    int root = size_of_comm - 1;  // the moments are reduced to the last process
+    const int    part_num = 400;
+    const double size = 2.0, third_size = 1.0;
+    unsigned int base_binnum = 6, third_binnum = 3;
+    double       x[ part_num ], y[ part_num ], z[ part_num ];
+    double       vx[ part_num ], vy[ part_num ], vz[ part_num ];
+    double*      vels[ 3 ] = { vx, vy, vz };
+    for ( int i = 0; i < part_num; ++i )
+    {
+        x[ i ]  = 2.5 * sin( 0.37 * i + rank );
+        y[ i ]  = 2.5 * cos( 0.91 * i );
+        z[ i ]  = 1.2 * sin( 1.3 * i );
+        vx[ i ] = cos( i );
+        vy[ i ] = sin( 0.5 * i );
+        vz[ i ] = 0.1 * i / part_num;
+    }
+    // the first 4 particles of each rank are in one voxel with a known dispersion:
+    // < v > = ( 0, 2, 0 ), sigma_xx = sigma_zz = 0.5 and the others are 0
+    double known[ 4 ][ 3 ] = { { 1, 2, 0 }, { -1, 2, 0 }, { 0, 2, 1 }, { 0, 2, -1 } };
+    for ( int i = 0; i < 4; ++i )
+    {
+        x[ i ] = y[ i ] = z[ i ] = 0.1;
+        for ( int n = 0; n < 3; ++n )
+            vels[ n ][ i ] = known[ i ][ n ];
+    }
+    // keep other particles out of that voxel
+    for ( int i = 4; i < part_num; ++i )
+        if ( x[ i ] >= 0 && x[ i ] < 2.0 / 3 && y[ i ] >= 0 && y[ i ] < 2.0 / 3 && z[ i ] >= 0
+             && z[ i ] < 2.0 / 3 )
+            x[ i ] = -x[ i ];
+
+    size_t voxel_num = ( size_t )base_binnum * base_binnum * third_binnum;
+    std::vector< double > dense( ana::voxel_moment_num * voxel_num );
+    ana::dispersion_moments( part_num, x, y, z, vels, size, third_size, base_binnum, third_binnum,
+                             dense.data(), root );
+    galotfa::arena   scratch;
+    galotfa::id_hash rows;
+    const long long* voxels   = nullptr;
+    const double*    sparse   = nullptr;
+    size_t           occupied = 0;
+    ana::sparse_dispersion_moments( part_num, x, y, z, vels, size, third_size, base_binnum,
+                                    third_binnum, scratch, 0, rows, voxels, sparse, occupied,
+                                    root );
+    if ( rank != root )
+        CHECK_RETURN( occupied == 0 && voxels == nullptr && sparse == nullptr );
+
+    // the sparse voxels are exactly the occupied dense voxels, with the same moments
+    size_t row = 0;
+    for ( size_t v = 0; v < voxel_num; ++v )
+    {
+        const double* moments = &dense[ ana::voxel_moment_num * v ];
+        if ( moments[ 0 ] == 0 )
+            continue;
+        if ( row >= occupied || voxels[ row ] != ( long long )v )
+            CHECK_RETURN( false );
+        for ( int k = 0; k < ana::voxel_moment_num; ++k )
+            if ( fabs( sparse[ ana::voxel_moment_num * row + k ] - moments[ k ] )
+                 > 1e-12 * ( 1 + fabs( moments[ k ] ) ) )
+                CHECK_RETURN( false );
+        ++row;
+    }
+    if ( row != occupied || row == 0 )
+        CHECK_RETURN( false );
+
+    // the voxel of the known particles: ( 3, 3, 1 ) for the bins of [ -2, 2 ]^2 * [ -1, 1 ]
+    double tensor[ 6 ], expected[ 6 ] = { 0.5, 0, 0, 0, 0, 0.5 };
+    ana::voxel_dispersion( &dense[ ana::voxel_moment_num * ( ( 3 * 6 + 3 ) * 3 + 1 ) ], tensor );
+    for ( int k = 0; k < 6; ++k )
+        if ( fabs( tensor[ k ] - expected[ k ] ) > 1e-12 )
+            CHECK_RETURN( false );
+    ana::voxel_dispersion( &dense[ 0 ], tensor );  // an empty corner voxel
+    CHECK_RETURN( dense[ 0 ] > 0 || std::isnan( tensor[ 0 ] ) );
+}
+}  // namespace unit_test
+#endif
 #endif
@@ -1,13 +1,38 @@
 // The model level analysis part
 #ifndef GALOTFA_ANALYSIS_MODEL_H
 #define GALOTFA_ANALYSIS_MODEL_H
+#include "../tools/arena.h"
+#include "../tools/id_hash.h"
 #include "utils.h"
 #include <complex>
 #include <math.h>
 #include <string>
+#include <vector>
 using std::complex;
 namespace galotfa {
 namespace analysis {
+    // the container of the azimuthal moments of a target set, accumulated in a single pass
+    struct moments
+    {
+        complex< double > An[ 7 ];            // sum of mass * exp( i * m * phi ), m = 0, 1, ..., 6
+        complex< double > buckle       = 0;   // sum of z * mass * exp( 2i * phi )
+        double            mass         = 0;   // sum of mass, the same as A0 but in real number
+        double            inertia[ 9 ] = { 0 };  // the inertia tensor
+    };
+
+    // the trig-free kernel of the Fourier modes: sum of mass * exp( i * m * phi ) for m = 0, 1,
+    // ..., max_order, where exp( i * m * phi ) = ( ( x + i * y ) / R )^m is evaluated by recurrence.
+    // If z and buckle are given, the buckling numerator sum of z * mass * exp( 2i * phi ) is also
+    // accumulated into buckle. NOTE: this is a local function, the caller should do the reduction.
+    int fourier_modes( int array_len, double mass[], double x[], double y[], unsigned int max_order,
+                       complex< double > modes[], double z[] = nullptr,
+                       complex< double >* buckle = nullptr );
+
+    // the fused kernel: calculate all the azimuthal Fourier quantities, the buckling numerator, the
+    // mass summation and the inertia tensor in one sweep, then reduce them with one MPI call
+    int fused_moments( int array_len, double mass[], double x[], double y[], double z[],
+                       unsigned int max_order, moments& result );
+
     complex< double > An( int array_len, double mass[], double x[], double y[],
                           unsigned int order );
 
@@ -17,18 +42,70 @@ namespace analysis {
 
     double bar_major_axis( int array_len, double mass[], double x[], double y[] );
 
-    double bar_radius( int array_len, double mass[], double x[], double y[], double rmin,
-                       double rmax, int rbins, double major_axis, double angle_threshold,
-                       double percentage, double* results );
-
-    int dispersion_tensor( int array_len, double x[], double y[], double z[], double vx[],
-                           double vy[], double vz[], double lower_bound_x, double upper_bound_x,
-                           double lower_bound_y, double upper_bound_y, double lower_bound_z,
-                           double upper_bound_z, unsigned int num_bins_x, unsigned int num_bins_y,
-                           unsigned int num_bins_z, double* tensor );
+    // the bar radius Rbar1 ~ Rbar3 in results, where the buffers of the radial bins are the slots
+    // [ first_slot, first_slot + bar_slot_num ) of scratch, to be reused across the calls
+    const size_t bar_slot_num = 4;
+    double       bar_radius( int array_len, double mass[], double x[], double y[], double rmin,
+                             double rmax, int rbins, double major_axis, double angle_threshold,
+                             double percentage, double* results, galotfa::arena& scratch,
+                             size_t first_slot );
 
     int inertia_tensor( int array_len, double mass[], double x[], double y[], double z[],
                         double* tensor );
+
+    // passively rotate a 3x3 tensor around the z axis by angle phi
+    int rotate_tensor_z( double* tensor, double phi );
+
+    // the pixel moments of the images in the x-y, x-z and y-z projections, accumulated in one
+    // sweep: each pixel has moment_num consecutive values, which are the count, the mass sum, and
+    // optionally the sums of v_n (moment_num >= 5) and v_n^2 (moment_num == 8), n = 1, 2, 3.
+    // The x-y image has base_binnum * base_binnum pixels in [-size, size]^2, the x-z and y-z
+    // images have base_binnum * third_binnum pixels in [-size, size] * [-third_size, third_size],
+    // and the three images are stored one by one in moments, whose pixels are in row-major order.
+    // The moments of all processes are summed to the process root with one MPI call.
+    int image_moments( int array_len, double mass[], double x[], double y[], double z[],
+                       double* vels[ 3 ], double size, double third_size, unsigned int base_binnum,
+                       unsigned int third_binnum, int moment_num, double moments[],
+                       int root = 0 );
+
+    // the velocity moments of the voxels for the dispersion tensor: each voxel has
+    // voxel_moment_num consecutive values, which are the count, the sums of v_i, and the sums of
+    // v_i * v_j for ij = xx, xy, xz, yy, yz, zz, as the tensor is symmetric. The voxels of
+    // base_binnum * base_binnum * third_binnum are in row-major order of ( x, y, z ), with the same
+    // bins as the images. The moments of all processes are summed to the process root with one
+    // MPI call.
+    const int voxel_moment_num = 10;
+    int dispersion_moments( int array_len, double x[], double y[], double z[], double* vels[ 3 ],
+                            double size, double third_size, unsigned int base_binnum,
+                            unsigned int third_binnum, double moments[], int root = 0 );
+
+    // the sparse version of dispersion_moments(): only the occupied voxels are accumulated, by a
+    // hash table on each process, then they are gathered and merged on the process root, where
+    // voxels are the ascending flat indexes of the voxel_num occupied voxels with their moments in
+    // order, and voxel_num is 0 on the other processes. The buffers are provided by the caller to
+    // be reused across the calls: rows is the hash table of the local voxels, and the others are
+    // the slots [ first_slot, first_slot + sparse_slot_num ) of scratch, where voxels and moments
+    // are, so they are valid until the next call with the same slots
+    const size_t sparse_slot_num = 7;
+    int sparse_dispersion_moments( int array_len, double x[], double y[], double z[],
+                                   double* vels[ 3 ], double size, double third_size,
+                                   unsigned int base_binnum, unsigned int third_binnum,
+                                   galotfa::arena& scratch, size_t first_slot,
+                                   galotfa::id_hash& rows, const long long*& voxels,
+                                   const double*& moments, size_t& voxel_num, int root = 0 );
+
+    // the independent components xx, xy, xz, yy, yz and zz of the dispersion tensor of a voxel
+    // from its moments, NaN for an empty voxel
+    void voxel_dispersion( const double moments[], double tensor[ 6 ] );
 }  // namespace analysis
 }  // namespace galotfa
+
+#ifdef debug_model
+namespace unit_test {
+int test_fused_moments();
+int test_fourier_modes();
+int test_image_moments();
+int test_dispersion_moments();
+}  // namespace unit_test
+#endif
 #endif
@@ -0,0 +1,106 @@
+#ifndef GALOTFA_ORBIT_CURVE_CPP
+#define GALOTFA_ORBIT_CURVE_CPP
+#include "orbit_curve.h"
+#include "../tools/comm.h"
+#include <algorithm>
+#include <mpi.h>
+#include <numeric>
+#include <string.h>
+namespace ana = galotfa::analysis;
+
+int ana::gather_orbits( int local_num, const long long ids[], const double data[],
+                        std::vector< long long >& all_ids, std::vector< double >& all_data )
+{
+    int rank, size;
+    MPI_Comm_rank( galotfa::comm::current(), &rank );
+    MPI_Comm_size( galotfa::comm::current(), &size );
+
+    // the buffers are reused across the calls, and only the root process needs them
+    static std::vector< int >       counts, displs, order;
+    static std::vector< long long > recv_ids;
+    static std::vector< double >    recv_data;
+
+    int total = 0;
+    if ( rank == 0 )
+    {
+        counts.resize( size );
+        displs.resize( size );
+    }
+    MPI_Gather( &local_num, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, galotfa::comm::current() );
+    for ( int r = 0; rank == 0 && r < size; ++r )
+    {
+        displs[ r ] = total;
+        total += counts[ r ];
+    }
+    recv_ids.resize( total );
+    recv_data.resize( 6 * ( size_t )total );
+    MPI_Gatherv( ids, local_num, MPI_LONG_LONG, recv_ids.data(), counts.data(), displs.data(),
+                 MPI_LONG_LONG, 0, galotfa::comm::current() );
+    for ( int r = 0; rank == 0 && r < size; ++r )
+    {
+        counts[ r ] *= 6;
+        displs[ r ] *= 6;
+    }
+    MPI_Gatherv( data, 6 * local_num, MPI_DOUBLE, recv_data.data(), counts.data(), displs.data(),
+                 MPI_DOUBLE, 0, galotfa::comm::current() );
+    if ( rank != 0 )
+        return 0;
+
+    // sort the gathered particles by the id
+    order.resize( total );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(),
+               []( int a, int b ) { return recv_ids[ a ] < recv_ids[ b ]; } );
+    all_ids.resize( total );
+    all_data.resize( 6 * ( size_t )total );
+    for ( int j = 0; j < total; ++j )
+    {
+        all_ids[ j ] = recv_ids[ order[ j ] ];
+        memcpy( &all_data[ 6 * ( size_t )j ], &recv_data[ 6 * ( size_t )order[ j ] ],
+                6 * sizeof( double ) );
+    }
+    return 0;
+}
+
+#ifdef debug_orbit
+#include "../tools/prompt.h"
+namespace unit_test {
+int test_gather_orbits()
+{
+    println( "Testing the gather of the tracked particles ..." );
+    int rank, size;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &size );
+
+    // rank r holds r + 1 particles, with ids interleaved across the ranks in descending order
+    int                      local_num = rank + 1;
+    std::vector< long long > ids( local_num );
+    std::vector< double >    data( 6 * local_num );
+    for ( int j = 0; j < local_num; ++j )
+    {
+        ids[ j ] = 1000 - ( j * size + rank );
+        for ( int k = 0; k < 6; ++k )
+            data[ 6 * j + k ] = ( double )ids[ j ] + 0.1 * k;
+    }
+    std::vector< long long > all_ids;
+    std::vector< double >    all_data;
+    ana::gather_orbits( local_num, ids.data(), data.data(), all_ids, all_data );
+    if ( rank != 0 )
+        CHECK_RETURN( all_ids.size() == 0 && all_data.size() == 0 );
+
+    if ( all_ids.size() != ( size_t )size * ( size + 1 ) / 2
+         || all_data.size() != 6 * all_ids.size() )
+        CHECK_RETURN( false );
+    for ( size_t j = 0; j < all_ids.size(); ++j )
+    {
+        if ( j > 0 && all_ids[ j ] <= all_ids[ j - 1 ] )
+            CHECK_RETURN( false );
+        for ( int k = 0; k < 6; ++k )
+            if ( all_data[ 6 * j + k ] != ( double )all_ids[ j ] + 0.1 * k )
+                CHECK_RETURN( false );
+    }
+    CHECK_RETURN( true );
+}
+}  // namespace unit_test
+#endif
+#endif
@@ -1,5 +1,21 @@
 // The orbit curve log part
 #ifndef GALOTFA_ANALYSIS_ORBIT_CURVE_H
 #define GALOTFA_ANALYSIS_ORBIT_CURVE_H
+#include <vector>
+namespace galotfa {
+namespace analysis {
+    // gather the tracked particles of all processes to the root process: each particle is an id and
+    // 6 values, e.g. (x, y, z, vx, vy, vz). On root, all_ids and all_data are sorted by the id, and
+    // they are untouched on the other processes. The communication is proportional to the number
+    // of the tracked particles, instead of the total particle number.
+    int gather_orbits( int local_num, const long long ids[], const double data[],
+                       std::vector< long long >& all_ids, std::vector< double >& all_data );
+}  // namespace analysis
+}  // namespace galotfa
 
+#ifdef debug_orbit
+namespace unit_test {
+int test_gather_orbits();
+}  // namespace unit_test
+#endif
 #endif
@@ -2,6 +2,7 @@
 #define GALOTFA_PARTICLE_CPP
 #include "particle.h"
 #include "../analysis/utils.h"
+#include "../tools/threads.h"
 #ifdef debug_particle
 #include "../analysis/utils.cpp"
 #endif
@@ -18,8 +19,7 @@ int ana::angular_momentum( int part_num, double masses[], double coords[][ 3 ],
         return 1;
     }
 
-    for ( int i = 0; i < part_num; ++i )
-    {
+    galotfa::threads::for_each( part_num, [ & ]( long i ) {
         angular_momentum[ i ][ 0 ] = masses[ i ]
                                      * ( ( coords[ i ][ 1 ] - center[ 1 ] ) * vels[ i ][ 2 ]
                                          - ( coords[ i ][ 2 ] - center[ 2 ] ) * vels[ i ][ 1 ] );
@@ -29,7 +29,7 @@ int ana::angular_momentum( int part_num, double masses[], double coords[][ 3 ],
         angular_momentum[ i ][ 2 ] = masses[ i ]
                                      * ( ( coords[ i ][ 0 ] - center[ 0 ] ) * vels[ i ][ 1 ]
                                          - ( coords[ i ][ 1 ] - center[ 1 ] ) * vels[ i ][ 0 ] );
-    }
+    } );
 
     return 0;
 }
@@ -37,8 +37,7 @@ int ana::angular_momentum( int part_num, double masses[], double coords[][ 3 ],
 int ana::circularity( int part_num, double coords[][ 3 ], double vels[][ 3 ],
                       double ( &center )[ 3 ], double circularity[] )
 {
-    for ( int i = 0; i < part_num; ++i )
-    {
+    galotfa::threads::for_each( part_num, [ & ]( long i ) {
         circularity[ i ] =
             ( ( coords[ i ][ 0 ] - center[ 0 ] ) * vels[ i ][ 1 ]
               - ( coords[ i ][ 1 ] - center[ 1 ] ) * vels[ i ][ 0 ] )
@@ -47,45 +46,26 @@ int ana::circularity( int part_num, double coords[][ 3 ], double vels[][ 3 ],
                       + ( coords[ i ][ 2 ] - center[ 2 ] ) * ( coords[ i ][ 2 ] - center[ 2 ] ) )
                 * sqrt( vels[ i ][ 0 ] * vels[ i ][ 0 ] + vels[ i ][ 1 ] * vels[ i ][ 1 ]
                         + vels[ i ][ 2 ] * vels[ i ][ 2 ] ) );
-    }
+    } );
     return 0;
 }
 
 int ana::circularity_3d( int part_num, double coords[][ 3 ], double vels[][ 3 ],
                          double ( &center )[ 3 ], double circularity_3d[] )
 {
-    double** angular_momentum = new double*[ part_num ];
-    for ( int i = 0; i < part_num; ++i )
-    {
-        angular_momentum[ i ] = new double[ 3 ];
-    }
-    double* masses = new double[ part_num ];  // unit mass
-    for ( int i = 0; i < part_num; ++i )
-    {
-        masses[ i ] = 1;
-    }
-    ana::angular_momentum( part_num, masses, coords, vels, center, angular_momentum );
-
-    for ( int i = 0; i < part_num; ++i )
-    {
+    galotfa::threads::for_each( part_num, [ & ]( long i ) {
+        double dx = coords[ i ][ 0 ] - center[ 0 ], dy = coords[ i ][ 1 ] - center[ 1 ],
+               dz = coords[ i ][ 2 ] - center[ 2 ];
+        // the specific angular momentum r x v
+        double lx = dy * vels[ i ][ 2 ] - dz * vels[ i ][ 1 ];
+        double ly = dz * vels[ i ][ 0 ] - dx * vels[ i ][ 2 ];
+        double lz = dx * vels[ i ][ 1 ] - dy * vels[ i ][ 0 ];
         circularity_3d[ i ] =
-            ( sqrt( angular_momentum[ i ][ 0 ] * angular_momentum[ i ][ 0 ]
-                    + angular_momentum[ i ][ 1 ] * angular_momentum[ i ][ 1 ]
-                    + angular_momentum[ i ][ 2 ] * angular_momentum[ i ][ 2 ] ) )
-            / ( sqrt( ( coords[ i ][ 0 ] - center[ 0 ] ) * ( coords[ i ][ 0 ] - center[ 0 ] )
-                      + ( coords[ i ][ 1 ] - center[ 1 ] ) * ( coords[ i ][ 1 ] - center[ 1 ] )
-                      + ( coords[ i ][ 2 ] - center[ 2 ] ) * ( coords[ i ][ 2 ] - center[ 2 ] ) )
+            sqrt( lx * lx + ly * ly + lz * lz )
+            / ( sqrt( dx * dx + dy * dy + dz * dz )
                 * sqrt( vels[ i ][ 0 ] * vels[ i ][ 0 ] + vels[ i ][ 1 ] * vels[ i ][ 1 ]
                         + vels[ i ][ 2 ] * vels[ i ][ 2 ] ) );
-    }
-
-    // release the memory
-    for ( int i = 0; i < part_num; ++i )
-    {
-        delete[] angular_momentum[ i ];
-    }
-    delete[] angular_momentum;
-    delete[] masses;
+    } );
     return 0;
 }
 
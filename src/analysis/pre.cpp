@@ -1,106 +1,223 @@
 #ifndef GALOTFA_PRE_CPP
 #define GALOTFA_PRE_CPP
 #include "pre.h"
-#include "../analysis/utils.h"
-#ifdef debug_pre
-#include "../analysis/utils.cpp"
-#endif
+#include "../tools/comm.h"
+#include "../tools/threads.h"
+#include <algorithm>
 #include <mpi.h>
+#include <stdlib.h>
 #include <string.h>
+#include <vector>
 namespace ana = galotfa::analysis;
 int ana::center_of_mass( unsigned long part_num, double masses[], double coords[][ 3 ],
                          double ( &center )[ 3 ] )
 {
     // calculate the center of mass of the given array of particles
-    double mass_sum = 0;
-    memset( center, 0, sizeof( double ) * 3 );
-    for ( unsigned long i = 0; i < part_num; ++i )
-    {
-        mass_sum += masses[ i ];
-        // summation only for the numerator
-        center[ 0 ] += masses[ i ] * coords[ i ][ 0 ];
-        center[ 1 ] += masses[ i ] * coords[ i ][ 1 ];
-        center[ 2 ] += masses[ i ] * coords[ i ][ 2 ];
-    }
-    MPI_Allreduce( MPI_IN_PLACE, center, 3, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
-    MPI_Allreduce( MPI_IN_PLACE, &mass_sum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+    double sums[ 4 ] = { 0 };  // the numerators, and the total mass
+    auto   kernel    = [ & ]( long begin, long end, double acc[] ) {
+        for ( long i = begin; i < end; ++i )
+        {
+            acc[ 3 ] += masses[ i ];
+            // summation only for the numerator
+            acc[ 0 ] += masses[ i ] * coords[ i ][ 0 ];
+            acc[ 1 ] += masses[ i ] * coords[ i ][ 1 ];
+            acc[ 2 ] += masses[ i ] * coords[ i ][ 2 ];
+        }
+    };
+    galotfa::threads::chunked_sum( ( long )part_num, 4, sums, kernel );
+    MPI_Allreduce( MPI_IN_PLACE, sums, 4, MPI_DOUBLE, MPI_SUM, galotfa::comm::current() );
 
     // divide by the denominator
-    if ( mass_sum > 0 )  // if there are particles
+    memset( center, 0, sizeof( double ) * 3 );
+    if ( sums[ 3 ] > 0 )  // if there are particles
     {
-        center[ 0 ] /= mass_sum;
-        center[ 1 ] /= mass_sum;
-        center[ 2 ] /= mass_sum;
+        center[ 0 ] = sums[ 0 ] / sums[ 3 ];
+        center[ 1 ] = sums[ 1 ] / sums[ 3 ];
+        center[ 2 ] = sums[ 2 ] / sums[ 3 ];
     }
     return 0;
 }  // namespace galotfa::analysis
 
-int ana::most_dense_pixel( unsigned long part_num, double coords[][ 3 ], double lower_bound_x,
-                           double upper_bound_x, double lower_bound_y, double upper_bound_y,
-                           double lower_bound_z, double upper_bound_z, unsigned int bin_num_x,
-                           unsigned int bin_num_y, unsigned int bin_num_z, double ( &center )[ 3 ] )
+// the number of cells along each axis in each level of the density peak search
+static const int peak_cells = 16;
+
+// the parabolic vertex of the [1,2,1]-smoothed counts around the peak cell along an axis, in
+// units of the cell size and within [-0.5, 0.5]
+static double subpixel_offset( const double counts[], const int peak[ 3 ], int axis,
+                               const int stride[ 3 ] )
 {
-    double* x = new double[ part_num ]();
-    double* y = new double[ part_num ]();
-    double* z = new double[ part_num ]();
-    for ( unsigned long i = 0; i < part_num; ++i )
+    int    idx = peak[ 0 ] * stride[ 0 ] + peak[ 1 ] * stride[ 1 ] + peak[ 2 ] * stride[ 2 ];
+    double smoothed[ 3 ] = { 0 };  // at peak - 1, peak, peak + 1
+    for ( int k = -1; k <= 1; ++k )
     {
-        x[ i ] = coords[ i ][ 0 ];
-        y[ i ] = coords[ i ][ 1 ];
-        z[ i ] = coords[ i ][ 2 ];
+        double weight = 0;
+        for ( int l = -1; l <= 1; ++l )
+        {
+            int cell = peak[ axis ] + k + l;
+            if ( cell < 0 || cell >= peak_cells )
+                continue;
+            smoothed[ k + 1 ] += ( l == 0 ? 2 : 1 ) * counts[ idx + ( k + l ) * stride[ axis ] ];
+            weight += ( l == 0 ? 2 : 1 );
+        }
+        smoothed[ k + 1 ] /= weight;
     }
-    // calculate the most dense pixel of the given array of particles
-    vector< vector< double > > image_xy =
-        ana::bin2d( part_num, x, y, x, lower_bound_x, upper_bound_x, lower_bound_y, upper_bound_y,
-                    bin_num_x, bin_num_y, ana::stats_method::count );
-
-    vector< vector< double > > image_xz =
-        ana::bin2d( part_num, x, z, x, lower_bound_x, upper_bound_x, lower_bound_z, upper_bound_z,
-                    bin_num_x, bin_num_z, ana::stats_method::count );
+    double curvature = smoothed[ 0 ] - 2 * smoothed[ 1 ] + smoothed[ 2 ];
+    if ( curvature >= 0 )  // not a maximum
+        return 0;
+    double offset = 0.5 * ( smoothed[ 0 ] - smoothed[ 2 ] ) / curvature;
+    return offset < -0.5 ? -0.5 : ( offset > 0.5 ? 0.5 : offset );
+}
 
-    // MPI Reduce
-    for ( size_t i = 0; i < bin_num_x; ++i )
+int ana::most_dense_pixel( unsigned long part_num, double coords[][ 3 ], double lower_bound_x,
+                           double upper_bound_x, double lower_bound_y, double upper_bound_y,
+                           double lower_bound_z, double upper_bound_z, unsigned int bin_num_x,
+                           unsigned int bin_num_y, unsigned int bin_num_z, double ( &center )[ 3 ],
+                           bool subpixel )
+{
+    // a coarse-to-fine search: bin the whole box into a coarse grid, then repeatedly bin the
+    // neighborhood of the densest cell into a finer grid, until the cells are not larger than the
+    // target pixels. Each level costs one contiguous reduction.
+    const double bounds[ 3 ][ 2 ] = { { lower_bound_x, upper_bound_x },
+                                      { lower_bound_y, upper_bound_y },
+                                      { lower_bound_z, upper_bound_z } };
+    const double target[ 3 ]      = { ( upper_bound_x - lower_bound_x ) / bin_num_x,
+                                      ( upper_bound_y - lower_bound_y ) / bin_num_y,
+                                      ( upper_bound_z - lower_bound_z ) / bin_num_z };
+    const int    stride[ 3 ]      = { peak_cells * peak_cells, peak_cells, 1 };
+    double       lower[ 3 ], width[ 3 ];
+    for ( int a = 0; a < 3; ++a )
     {
-        MPI_Allreduce( MPI_IN_PLACE, image_xy[ i ].data(), ( int )bin_num_y, MPI_DOUBLE, MPI_SUM,
-                       MPI_COMM_WORLD );
-        MPI_Allreduce( MPI_IN_PLACE, image_xz[ i ].data(), ( int )bin_num_z, MPI_DOUBLE, MPI_SUM,
-                       MPI_COMM_WORLD );
+        lower[ a ]  = bounds[ a ][ 0 ];
+        width[ a ]  = bounds[ a ][ 1 ] - bounds[ a ][ 0 ];
+        center[ a ] = lower[ a ] + 0.5 * width[ a ];
     }
 
-    // find the max pixel's position
-    size_t max_x = 0, max_y = 0, max_z = 0;
-    for ( size_t i = 0; i < ( size_t )bin_num_x; ++i )
+    // the counts of the cells, the particles in the current window and their cells (-1 for outside)
+    static std::vector< double >        counts;
+    static std::vector< unsigned long > active;
+    static std::vector< int >           cells;
+    counts.resize( peak_cells * peak_cells * peak_cells );
+    active.resize( part_num );
+    cells.resize( part_num );
+    for ( unsigned long i = 0; i < part_num; ++i )
+        active[ i ] = i;
+    unsigned long active_num = part_num;
+    int           peak[ 3 ]  = { 0 };
+    for ( int level = 0;; ++level )
     {
-        for ( size_t j = 0; j < ( size_t )bin_num_y; ++j )
+        double cell[ 3 ], inv_cell[ 3 ];
+        for ( int a = 0; a < 3; ++a )
         {
-            if ( image_xy[ i ][ j ] > image_xy[ max_x ][ max_y ] )
+            cell[ a ]     = width[ a ] / peak_cells;
+            inv_cell[ a ] = peak_cells / width[ a ];
+        }
+
+        auto kernel = [ & ]( long begin, long end, double acc[] ) {
+            for ( long k = begin; k < end; ++k )
             {
-                max_x = i;
-                max_y = j;
+                const double* coord = coords[ active[ k ] ];
+                // the same as bin2d: the upper bound is included in the last cell
+                double pos_x = ( coord[ 0 ] - lower[ 0 ] ) * inv_cell[ 0 ];
+                double pos_y = ( coord[ 1 ] - lower[ 1 ] ) * inv_cell[ 1 ];
+                double pos_z = ( coord[ 2 ] - lower[ 2 ] ) * inv_cell[ 2 ];
+                if ( pos_x >= 0 && pos_x <= peak_cells && pos_y >= 0 && pos_y <= peak_cells
+                     && pos_z >= 0 && pos_z <= peak_cells )
+                {
+                    int ix     = pos_x < peak_cells ? ( int )pos_x : peak_cells - 1;
+                    int iy     = pos_y < peak_cells ? ( int )pos_y : peak_cells - 1;
+                    int iz     = pos_z < peak_cells ? ( int )pos_z : peak_cells - 1;
+                    cells[ k ] = ix * stride[ 0 ] + iy * stride[ 1 ] + iz;
+                    acc[ cells[ k ] ] += 1;
+                }
+                else
+                    cells[ k ] = -1;
             }
+        };
+        galotfa::threads::chunked_sum( ( long )active_num, counts.size(), counts.data(), kernel );
+        MPI_Allreduce( MPI_IN_PLACE, counts.data(), ( int )counts.size(), MPI_DOUBLE, MPI_SUM,
+                       galotfa::comm::current() );
+
+        // the first densest cell, the same on all ranks
+        size_t max_idx = std::max_element( counts.begin(), counts.end() ) - counts.begin();
+        if ( counts[ max_idx ] <= 0 )
+            return 0;  // no particle in the window: keep the center of the box
+        peak[ 0 ] = ( int )max_idx / stride[ 0 ];
+        peak[ 1 ] = ( int )max_idx / stride[ 1 ] % peak_cells;
+        peak[ 2 ] = ( int )max_idx % peak_cells;
+        for ( int a = 0; a < 3; ++a )
+        {
+            double offset = subpixel ? subpixel_offset( counts.data(), peak, a, stride ) : 0;
+            center[ a ]   = lower[ a ] + ( peak[ a ] + 0.5 + offset ) * cell[ a ];
         }
-    }
 
-    for ( size_t i = 0; i < ( size_t )bin_num_z; ++i )
-    {
-        if ( image_xz[ max_x ][ i ] > image_xz[ max_x ][ max_z ] )
+        bool finished = true;
+        for ( int a = 0; a < 3; ++a )
+            finished = finished && cell[ a ] <= target[ a ] * ( 1 + 1e-12 );
+        if ( finished || level >= 16 )
+            break;
+
+        // the next window: the peak cell and its neighbors, clipped by the box
+        for ( int a = 0; a < 3; ++a )
         {
-            max_z = i;
+            double low  = lower[ a ] + ( peak[ a ] - 1 ) * cell[ a ];
+            double high = lower[ a ] + ( peak[ a ] + 2 ) * cell[ a ];
+            low         = low < bounds[ a ][ 0 ] ? bounds[ a ][ 0 ] : low;
+            high        = high > bounds[ a ][ 1 ] ? bounds[ a ][ 1 ] : high;
+            lower[ a ]  = low;
+            width[ a ]  = high - low;
         }
+
+        // only the particles in the neighbor cells are binned at the next level
+        unsigned long kept = 0;
+        for ( unsigned long k = 0; k < active_num; ++k )
+        {
+            int idx = cells[ k ];
+            if ( idx >= 0 && abs( idx / stride[ 0 ] - peak[ 0 ] ) <= 1
+                 && abs( idx / stride[ 1 ] % peak_cells - peak[ 1 ] ) <= 1
+                 && abs( idx % peak_cells - peak[ 2 ] ) <= 1 )
+                active[ kept++ ] = active[ k ];
+        }
+        active_num = kept;
     }
-    double pos_x = ( double )max_x + 0.5, pos_y = ( double )max_y + 0.5,
-           pos_z = ( double )max_z + 0.5;
-    center[ 0 ]  = pos_x / ( double )bin_num_x * ( upper_bound_x - lower_bound_x ) + lower_bound_x;
-    center[ 1 ]  = pos_y / ( double )bin_num_y * ( upper_bound_y - lower_bound_y ) + lower_bound_y;
-    center[ 2 ]  = pos_z / ( double )bin_num_z * ( upper_bound_z - lower_bound_z ) + lower_bound_z;
-
-    // release memory
-    delete[] x;
-    delete[] y;
-    delete[] z;
     return 0;
 }
 
+double ana::shrink_sphere( unsigned long& part_num, double x[], double y[], double z[],
+                           double masses[], double radius, double ( &center )[ 3 ] )
+{
+    // one fused pass: the distance test, the mass-weighted offsets and the in-place compaction.
+    // NOTE: a culled particle is never reconsidered, as in Power et al. (2003), so the sphere
+    // should shrink faster than the center moves.
+    const double  r2        = radius * radius;
+    double        sums[ 4 ] = { 0 };  // the mass, and the mass-weighted offsets
+    unsigned long kept      = 0;
+    for ( unsigned long i = 0; i < part_num; ++i )
+    {
+        double dx     = x[ i ] - center[ 0 ];
+        double dy     = y[ i ] - center[ 1 ];
+        double dz     = z[ i ] - center[ 2 ];
+        bool   inside = dx * dx + dy * dy + dz * dz <= r2;
+        double mass   = inside ? masses[ i ] : 0;
+        sums[ 0 ] += mass;
+        sums[ 1 ] += mass * dx;
+        sums[ 2 ] += mass * dy;
+        sums[ 3 ] += mass * dz;
+        // branch-free compaction: always store, only advance for the particles inside
+        x[ kept ]      = x[ i ];
+        y[ kept ]      = y[ i ];
+        z[ kept ]      = z[ i ];
+        masses[ kept ] = masses[ i ];
+        kept += inside;
+    }
+    part_num = kept;
+    MPI_Allreduce( MPI_IN_PLACE, sums, 4, MPI_DOUBLE, MPI_SUM, galotfa::comm::current() );
+
+    if ( sums[ 0 ] > 0 )  // otherwise keep the center
+        for ( int a = 0; a < 3; ++a )
+            center[ a ] += sums[ a + 1 ] / sums[ 0 ];
+    return sums[ 0 ];
+}
+
 
 #ifdef debug_pre
 #include "../tools/prompt.h"
@@ -206,6 +323,95 @@ int test_most_dense_pixel()
 
     CHECK_RETURN( true );
 }
+
+int test_density_peak_refine()
+{
+    println( "Testing the coarse-to-fine density peak search ..." );
+    // a clump on a uniform background, drawn with a simple LCG to be the same on all ranks
+    const int          part_num                = 20000;
+    static double      coords[ part_num ][ 3 ] = { { 0 } };
+    const double       peak[ 3 ]               = { 0.33, -0.21, 0.12 };
+    unsigned long long state                   = 12345;
+    auto               uniform                 = [ &state ]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return ( double )( state >> 11 ) / 9007199254740992.0;
+    };
+    for ( int i = 0; i < part_num; ++i )
+        for ( int a = 0; a < 3; ++a )
+        {
+            if ( i % 4 == 0 )  // the background
+                coords[ i ][ a ] = 4 * uniform() - 2;
+            else  // an approximate gaussian with sigma = 0.1
+                coords[ i ][ a ] = peak[ a ] + 0.2 * ( uniform() + uniform() + uniform() - 1.5 );
+        }
+
+    // 40 bins in [-2, 2]: the target pixel size is 0.1
+    double center[ 3 ] = { 0 };
+    ana::most_dense_pixel( part_num, coords, -2, 2, -2, 2, -2, 2, 40, 40, 40, center );
+    for ( int a = 0; a < 3; ++a )
+        if ( fabs( center[ a ] - peak[ a ] ) > 0.1 )
+            CHECK_RETURN( false );
+
+    double refined[ 3 ] = { 0 };
+    ana::most_dense_pixel( part_num, coords, -2, 2, -2, 2, -2, 2, 40, 40, 40, refined, true );
+    for ( int a = 0; a < 3; ++a )  // within the same pixel as the unrefined center
+        if ( fabs( refined[ a ] - peak[ a ] ) > 0.1 || fabs( refined[ a ] - center[ a ] ) > 0.05 )
+            CHECK_RETURN( false );
+
+    // no particle in the box: keep the center of the box
+    ana::most_dense_pixel( part_num, coords, 5, 7, 5, 7, 5, 7, 40, 40, 40, center );
+    CHECK_RETURN( center[ 0 ] == 6 && center[ 1 ] == 6 && center[ 2 ] == 6 );
+}
+
+int test_shrink_sphere()
+{
+    println( "Testing the shrinking sphere ..." );
+    // a clump on an offset background, which drags the center of mass of the whole region
+    const int          part_num = 20000;
+    static double      x[ part_num ], y[ part_num ], z[ part_num ], masses[ part_num ];
+    const double       peak[ 3 ] = { 1.0, 2.0, -1.0 };
+    unsigned long long state     = 54321;
+    auto               uniform   = [ &state ]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return ( double )( state >> 11 ) / 9007199254740992.0;
+    };
+    for ( int i = 0; i < part_num; ++i )
+    {
+        double* pos[ 3 ] = { x + i, y + i, z + i };
+        for ( int a = 0; a < 3; ++a )
+            if ( i % 2 == 0 )  // the background, shifted to +x
+                *pos[ a ] = 8 * uniform() - 4 + ( a == 0 ? 2 : 0 );
+            else  // the clump with a size of 0.2
+                *pos[ a ] = peak[ a ] + 0.2 * ( uniform() - 0.5 );
+        masses[ i ] = 1.0;
+    }
+
+    double        center[ 3 ] = { 0, 0, 0 };
+    unsigned long num         = part_num;
+    double        radius      = 10;
+    double        mass        = 0;
+    for ( int i = 0; i < 20; ++i, radius *= 0.7 )
+    {
+        unsigned long old_num = num;
+        mass                  = ana::shrink_sphere( num, x, y, z, masses, radius, center );
+        if ( num > old_num || mass <= 0 )
+            CHECK_RETURN( false );
+    }
+    // the local number equals the global mass divided by the ranks, as all ranks are the same
+    int size;
+    MPI_Comm_size( MPI_COMM_WORLD, &size );
+    if ( fabs( mass - ( double )num * size ) > 1e-6 )
+        CHECK_RETURN( false );
+    for ( int a = 0; a < 3; ++a )
+        if ( fabs( center[ a ] - peak[ a ] ) > 0.02 )
+            CHECK_RETURN( false );
+
+    // no particle in the sphere: keep the center
+    for ( int a = 0; a < 3; ++a )
+        center[ a ] = 20;
+    mass = ana::shrink_sphere( num, x, y, z, masses, 1.0, center );
+    CHECK_RETURN( mass == 0 && num == 0 && center[ 0 ] == 20 );
+}
 }  // namespace unit_test
 #endif
 #endif
@@ -11,8 +11,15 @@ namespace analysis {
     int most_dense_pixel( unsigned long part_num, double coords[][ 3 ], double lower_bound_x,
                           double upper_bound_x, double lower_bound_y, double upper_bound_y,
                           double lower_bound_z, double upper_bound_z, unsigned int bin_num_x,
-                          unsigned int bin_num_y, unsigned int bin_num_z, double ( &center )[ 3 ] );
-    // calculate the most dense pixel of the given array of particles
+                          unsigned int bin_num_y, unsigned int bin_num_z, double ( &center )[ 3 ],
+                          bool subpixel = false );
+    // calculate the center of the most dense pixel of the given array of particles, with a
+    // coarse-to-fine search, optionally refined by a parabolic fit of the smoothed counts
+
+    double shrink_sphere( unsigned long& part_num, double x[], double y[], double z[],
+                          double masses[], double radius, double ( &center )[ 3 ] );
+    // one iteration of the shrinking sphere: cull the particles outside the sphere in place, and
+    // move the center to the center of mass of the rest, return the mass in the sphere of all ranks
 }  // namespace analysis
 }  // namespace galotfa
 
@@ -21,6 +28,8 @@ namespace analysis {
 namespace unit_test {
 int test_center_of_mass();
 int test_most_dense_pixel();
+int test_density_peak_refine();
+int test_shrink_sphere();
 }  // namespace unit_test
 #endif
 #endif
@@ -1,8 +1,9 @@
 #ifndef GALOTFA_ANALYSIS_UNTILS_CPP
 #define GALOTFA_ANALYSIS_UNTILS_CPP
 #include "utils.h"
-#include <limits>
+#include "../tools/threads.h"
 #include <math.h>
+#include <mpi.h>
 namespace ana = galotfa::analysis;
 bool ana::in_spheroid( double ( &pos )[ 3 ], double& size, double& ratio )
 {
@@ -25,247 +26,401 @@ double ana::norm( double ( &vec )[ 3 ] )
     return sqrt( vec[ 0 ] * vec[ 0 ] + vec[ 1 ] * vec[ 1 ] + vec[ 2 ] * vec[ 2 ] );
 }
 
-vector< double > ana::bin1d( unsigned long array_len, double coord[], double data[],
-                             double lower_bound, double upper_bound, unsigned int bin_num,
-                             ana::stats_method method )
+void ana::running_moments::merge( const running_moments& other )
 {
-    if ( bin_num == 0 )
+    if ( other.n == 0 )
+        return;
+    double total = this->n + other.n;
+    double delta = other.mean - this->mean;
+    this->mean += delta * other.n / total;
+    this->m2 += other.m2 + delta * delta * this->n * other.n / total;
+    this->n = total;
+}
+
+double ana::p2_quantile::desired( int marker, double total ) const
+{
+    // the desired positions of the markers: the min, prob/2, prob, (1+prob)/2 and the max
+    static const double weights[ 5 ] = { 0, 0.5, 1, 0.5, 0 };
+    static const double offsets[ 5 ] = { 0, 0, 0, 0.5, 1 };
+    return 1 + ( total - 1 ) * ( weights[ marker ] * this->prob + offsets[ marker ] );
+}
+
+void ana::p2_quantile::set_markers( void )
+{
+    // pick the markers from the sorted values at their desired positions
+    for ( int k = 0; k < 5; ++k )
     {
-        ERROR( "The number of bins should be larger than 0." );
+        double target = floor( this->desired( k, this->count ) + 0.5 );
+        if ( k > 0 && target <= this->pos[ k - 1 ] )
+            target = this->pos[ k - 1 ] + 1;
+        if ( target > this->count - ( 4 - k ) )
+            target = this->count - ( 4 - k );
+        this->pos[ k ]    = target;
+        this->height[ k ] = this->values[ ( int )target - 1 ];
     }
-    else if ( array_len == 0 )
+}
+
+void ana::p2_quantile::add( double x )
+{
+    if ( this->count < exact_num )
     {
-        WARN( "The length of array for binning is 0, return a vector of 0." );
-        return vector< double >( bin_num, 0 );
+        // insert into the sorted values
+        int i = ( int )this->count;
+        for ( ; i > 0 && this->values[ i - 1 ] > x; --i )
+            this->values[ i ] = this->values[ i - 1 ];
+        this->values[ i ] = x;
+        if ( ++this->count == exact_num )
+            this->set_markers();
+        return;
     }
 
-    // the final result
-    vector< double > results( bin_num );
-
-    double*                    sum    = nullptr;  // summation of the data points in each bin
-    double*                    min    = nullptr;  // minimum of the data points in each bin
-    double*                    max    = nullptr;  // maximum of the data points in each bin
-    unsigned int*              counts = nullptr;  // the counts of the data points in each bin
-    vector< vector< double > > data_in_each_bin(
-        bin_num );  // the data points in each bin, only used for median and std
-    if ( method == stats_method::count || method == stats_method::mean
-         || method == stats_method::std || method == stats_method::median )
-        counts = new unsigned int[ bin_num ]();
-    if ( method == stats_method::sum || method == stats_method::std
-         || method == stats_method::mean )
-        sum = new double[ bin_num ]();
-    if ( method == stats_method::min )
+    // find the cell of x, and shift the positions of the markers above it
+    int k = 0;
+    if ( x < this->height[ 0 ] )
+        this->height[ 0 ] = x;
+    else if ( x >= this->height[ 4 ] )
     {
-        min = new double[ bin_num ]();
-        for ( unsigned int i = 0; i < bin_num; ++i )
-            min[ i ] = std::numeric_limits< double >::max();
+        this->height[ 4 ] = x;
+        k                 = 3;
     }
-    if ( method == stats_method::max )
+    else
+        while ( k < 3 && x >= this->height[ k + 1 ] )
+            ++k;
+    for ( int i = k + 1; i < 5; ++i )
+        this->pos[ i ] += 1;
+    this->count += 1;
+
+    // adjust the middle markers towards their desired positions
+    double* h = this->height;
+    double* n = this->pos;
+    for ( int i = 1; i < 4; ++i )
     {
-        max = new double[ bin_num ]();
-        for ( unsigned int i = 0; i < bin_num; ++i )
-            max[ i ] = std::numeric_limits< double >::min();
+        double delta = this->desired( i, this->count ) - n[ i ];
+        if ( ( delta >= 1 && n[ i + 1 ] - n[ i ] > 1 )
+             || ( delta <= -1 && n[ i - 1 ] - n[ i ] < -1 ) )
+        {
+            double sign = delta > 0 ? 1 : -1;
+            // the piecewise-parabolic prediction, fall back to the linear one if not monotonic
+            double parabolic =
+                h[ i ]
+                + sign / ( n[ i + 1 ] - n[ i - 1 ] )
+                      * ( ( n[ i ] - n[ i - 1 ] + sign ) * ( h[ i + 1 ] - h[ i ] )
+                              / ( n[ i + 1 ] - n[ i ] )
+                          + ( n[ i + 1 ] - n[ i ] - sign ) * ( h[ i ] - h[ i - 1 ] )
+                                / ( n[ i ] - n[ i - 1 ] ) );
+            if ( h[ i - 1 ] < parabolic && parabolic < h[ i + 1 ] )
+                h[ i ] = parabolic;
+            else
+            {
+                int j  = i + ( int )sign;
+                h[ i ] = h[ i ] + sign * ( h[ j ] - h[ i ] ) / ( n[ j ] - n[ i ] );
+            }
+            n[ i ] += sign;
+        }
     }
+}
 
-    unsigned int i, j;  // array index
-    double       range = upper_bound - lower_bound;
+double ana::p2_quantile::rank( double x ) const
+{
+    // the piecewise linear interpolation of the positions between the markers
+    if ( x < this->height[ 0 ] )
+        return 0;
+    if ( x >= this->height[ 4 ] )
+        return this->count;
+    int k = 0;
+    while ( k < 3 && x >= this->height[ k + 1 ] )
+        ++k;
+    return this->pos[ k ]
+           + ( this->pos[ k + 1 ] - this->pos[ k ] ) * ( x - this->height[ k ] )
+                 / ( this->height[ k + 1 ] - this->height[ k ] );
+}
 
-    // iterate over the data points to find its bin
-    for ( i = 0; i < array_len; ++i )
+void ana::p2_quantile::merge( const p2_quantile& other )
+{
+    if ( other.count == 0 )
+        return;
+    if ( other.count < exact_num )
     {
-        if ( coord[ i ] < lower_bound || coord[ i ] > upper_bound )
-            continue;
-        // the index of the bin
-        unsigned int bin_index = ( unsigned int )( ( coord[ i ] - lower_bound ) / range * bin_num );
-        if ( bin_index == bin_num )
-            bin_index = bin_num - 1;  // avoid the overflow at the upper bound
+        for ( int i = 0; i < ( int )other.count; ++i )
+            this->add( other.values[ i ] );
+        return;
+    }
+    if ( this->count < exact_num )
+    {
+        p2_quantile merged = other;
+        for ( int i = 0; i < ( int )this->count; ++i )
+            merged.add( this->values[ i ] );
+        *this = merged;
+        return;
+    }
 
-        switch ( method )
+    // both are tracked by markers: place the new markers where the summed ranks of the two
+    // estimators reach their desired positions
+    double total           = this->count + other.count;
+    double new_height[ 5 ] = { std::min( this->height[ 0 ], other.height[ 0 ] ), 0, 0, 0,
+                               std::max( this->height[ 4 ], other.height[ 4 ] ) };
+    double new_pos[ 5 ]    = { 1, 0, 0, 0, total };
+    for ( int k = 1; k < 4; ++k )
+    {
+        double target = this->desired( k, total );
+        double lower  = new_height[ k - 1 ];
+        double upper  = new_height[ 4 ];
+        for ( int iter = 0; iter < 64 && lower < upper; ++iter )
         {
-        case stats_method::count: {
-            ++counts[ bin_index ];
-            break;
-        }
-        case stats_method::sum: {
-            sum[ bin_index ] += data[ i ];
-            break;
-        }
-        case stats_method::mean: {
-            sum[ bin_index ] += data[ i ];
-            ++counts[ bin_index ];
-            break;
-        }
-        case stats_method::min: {
-            if ( min[ bin_index ] > data[ i ] )
-                min[ bin_index ] = data[ i ];
-            break;
-        }
-        case stats_method::max: {
-            if ( max[ bin_index ] < data[ i ] )
-                max[ bin_index ] = data[ i ];
-            break;
-        }
-        case stats_method::std: {
-            sum[ bin_index ] += data[ i ];
-            if ( counts[ bin_index ] + 1 > ( unsigned int )data_in_each_bin[ bin_index ].size() )
-                data_in_each_bin[ bin_index ].resize( counts[ bin_index ] + 1 + 20 );
-            data_in_each_bin[ bin_index ][ counts[ bin_index ]++ ] =
-                data[ i ];  // NOTE: test this index carefullly
-            break;
-        }
-        case stats_method::median: {
-            if ( counts[ bin_index ] + 1 > ( unsigned int )data_in_each_bin[ bin_index ].size() )
-                data_in_each_bin[ bin_index ].resize( counts[ bin_index ] + 1 + 20 );
-            data_in_each_bin[ bin_index ][ counts[ bin_index ]++ ] =
-                data[ i ];  // NOTE: test this index carefullly
-            break;
-        }
+            double mid = ( lower + upper ) / 2;
+            if ( this->rank( mid ) + other.rank( mid ) < target )
+                lower = mid;
+            else
+                upper = mid;
         }
+        new_height[ k ] = upper;
+        new_pos[ k ]    = std::max( floor( target + 0.5 ), new_pos[ k - 1 ] + 1 );
+        new_pos[ k ]    = std::min( new_pos[ k ], total - ( 4 - k ) );
+    }
+    this->count = total;
+    for ( int k = 0; k < 5; ++k )
+    {
+        this->height[ k ] = new_height[ k ];
+        this->pos[ k ]    = new_pos[ k ];
+    }
+}
+
+double ana::p2_quantile::value( void ) const
+{
+    if ( this->count == 0 )
+        return nan( "" );
+    if ( this->count >= exact_num )
+        return this->height[ 2 ];
+    // interpolate the sorted values, e.g. the mean of the middle two for the median of even size
+    double       position = ( this->count - 1 ) * this->prob;
+    unsigned int lower    = ( unsigned int )position;
+    double       frac     = position - lower;
+    if ( frac == 0 )
+        return this->values[ lower ];
+    return ( 1 - frac ) * this->values[ lower ] + frac * this->values[ lower + 1 ];
+}
+
+template < typename T > static void merge_op( void* in, void* inout, int* len, MPI_Datatype* )
+{
+    T* from = ( T* )in;
+    T* to   = ( T* )inout;
+    for ( int i = 0; i < *len; ++i )
+    {
+        // inout is of the higher ranks, keep the rank order for the non-commutative merge
+        T merged = from[ i ];
+        merged.merge( to[ i ] );
+        to[ i ] = merged;
     }
+}
+
+template < typename T >
+static void allreduce_merge( T stats[], int len, MPI_Comm comm, bool commutative )
+{
+    MPI_Datatype type;
+    MPI_Op       op;
+    MPI_Type_contiguous( ( int )( sizeof( T ) / sizeof( double ) ), MPI_DOUBLE, &type );
+    MPI_Type_commit( &type );
+    MPI_Op_create( merge_op< T >, commutative ? 1 : 0, &op );
+    MPI_Allreduce( MPI_IN_PLACE, stats, len, type, op, comm );
+    MPI_Op_free( &op );
+    MPI_Type_free( &type );
+}
+
+void ana::merge_across_ranks( running_moments stats[], int len, MPI_Comm comm )
+{
+    allreduce_merge( stats, len, comm, true );
+}
+
+void ana::merge_across_ranks( p2_quantile stats[], int len, MPI_Comm comm )
+{
+    // the merge of two marker sets is only approximately symmetric
+    allreduce_merge( stats, len, comm, false );
+}
+
+// the per-chunk accumulators of the order statistics, merged into the first chunk in the chunk
+// order, so the results are deterministic for a fixed number of threads
+template < typename Stats, typename Binning >
+static vector< Stats > chunked_stats( unsigned long array_len, double data[],
+                                      unsigned int bin_total, Binning bin_of )
+{
+    int                       chunk_num = galotfa::threads::chunks( ( long )array_len );
+    vector< vector< Stats > > stats( chunk_num, vector< Stats >( bin_total ) );
+
+    auto kernel = [ & ]( int c, long begin, long end ) {
+        long bin;
+        for ( long i = begin; i < end; ++i )
+            if ( ( bin = bin_of( i ) ) >= 0 )
+                stats[ c ][ bin ].add( data[ i ] );
+    };
+    galotfa::threads::for_chunks( ( long )array_len, chunk_num, kernel );
+    for ( int c = 1; c < chunk_num; ++c )
+        for ( unsigned int j = 0; j < bin_total; ++j )
+            stats[ 0 ][ j ].merge( stats[ c ][ j ] );
+    return std::move( stats[ 0 ] );
+}
 
-    // erase the extra memory
-    if ( method == stats_method::median || method == stats_method::std )
-        for ( i = 0; i < bin_num; ++i )
-            data_in_each_bin[ i ].resize( counts[ i ] );
+// the statistics of the data in each bin, where bin_of( i ) returns the bin of the i-th data point,
+// or -1 if it's out of the bins, the results are written into the given flat buffer
+template < typename Binning >
+static void binned_stats( unsigned long array_len, double data[], unsigned int bin_total,
+                          Binning bin_of, ana::stats_method method, MPI_Comm comm,
+                          double results[] )
+{
+    bool global = comm != MPI_COMM_NULL;
+    long len    = ( long )array_len;
+    std::fill( results, results + bin_total, 0.0 );
 
     switch ( method )
     {
-    case stats_method::count: {
-        for ( i = 0; i < bin_num; ++i )
-            results[ i ] = ( double )counts[ i ];
+    case ana::stats_method::count: {
+        auto kernel = [ & ]( long begin, long end, double acc[] ) {
+            long bin;
+            for ( long i = begin; i < end; ++i )
+                if ( ( bin = bin_of( i ) ) >= 0 )
+                    acc[ bin ] += 1;
+        };
+        galotfa::threads::chunked_sum( len, bin_total, results, kernel );
+        if ( global )
+            MPI_Allreduce( MPI_IN_PLACE, results, ( int )bin_total, MPI_DOUBLE, MPI_SUM, comm );
         break;
     }
-    case stats_method::sum: {
-        for ( i = 0; i < bin_num; ++i )
-            results[ i ] = sum[ i ];
+    case ana::stats_method::sum: {
+        auto kernel = [ & ]( long begin, long end, double acc[] ) {
+            long bin;
+            for ( long i = begin; i < end; ++i )
+                if ( ( bin = bin_of( i ) ) >= 0 )
+                    acc[ bin ] += data[ i ];
+        };
+        galotfa::threads::chunked_sum( len, bin_total, results, kernel );
+        if ( global )
+            MPI_Allreduce( MPI_IN_PLACE, results, ( int )bin_total, MPI_DOUBLE, MPI_SUM, comm );
         break;
     }
-    case stats_method::mean: {
-        for ( i = 0; i < bin_num; ++i )
-            results[ i ] = sum[ i ] / ( double )counts[ i ];
+    case ana::stats_method::mean: {
+        // the sums and then the counts, to be reduced in one call
+        vector< double > sums( 2 * ( size_t )bin_total, 0 );
+        auto             kernel = [ & ]( long begin, long end, double acc[] ) {
+            long bin;
+            for ( long i = begin; i < end; ++i )
+                if ( ( bin = bin_of( i ) ) >= 0 )
+                {
+                    acc[ bin ] += data[ i ];
+                    acc[ bin_total + bin ] += 1;
+                }
+        };
+        galotfa::threads::chunked_sum( len, sums.size(), sums.data(), kernel );
+        if ( global )
+            MPI_Allreduce( MPI_IN_PLACE, sums.data(), 2 * ( int )bin_total, MPI_DOUBLE, MPI_SUM,
+                           comm );
+        for ( unsigned int j = 0; j < bin_total; ++j )
+            results[ j ] = sums[ j ] / sums[ bin_total + j ];  // NaN for the empty bins
         break;
     }
-    case stats_method::min: {
-        for ( i = 0; i < bin_num; ++i )
-            results[ i ] = min[ i ];
+    case ana::stats_method::min:
+    case ana::stats_method::max: {
+        bool   is_min    = method == ana::stats_method::min;
+        double init      = is_min ? INFINITY : -INFINITY;
+        int    chunk_num = galotfa::threads::chunks( len );
+        // the extrema of each chunk, the first chunk is the results
+        vector< double > extrema( ( chunk_num - 1 ) * ( size_t )bin_total, init );
+        std::fill( results, results + bin_total, init );
+
+        auto kernel = [ & ]( int c, long begin, long end ) {
+            double* acc = c == 0 ? results : &extrema[ ( c - 1 ) * ( size_t )bin_total ];
+            long    bin;
+            for ( long i = begin; i < end; ++i )
+                if ( ( bin = bin_of( i ) ) >= 0
+                     && ( is_min ? data[ i ] < acc[ bin ] : data[ i ] > acc[ bin ] ) )
+                    acc[ bin ] = data[ i ];
+        };
+        galotfa::threads::for_chunks( len, chunk_num, kernel );
+        for ( int c = 1; c < chunk_num; ++c )
+            for ( unsigned int j = 0; j < bin_total; ++j )
+            {
+                double value = extrema[ ( c - 1 ) * ( size_t )bin_total + j ];
+                if ( is_min ? value < results[ j ] : value > results[ j ] )
+                    results[ j ] = value;
+            }
+        if ( global )
+            MPI_Allreduce( MPI_IN_PLACE, results, ( int )bin_total, MPI_DOUBLE,
+                           is_min ? MPI_MIN : MPI_MAX, comm );
+        for ( unsigned int j = 0; j < bin_total; ++j )
+            if ( results[ j ] == init )
+                results[ j ] = nan( "" );  // the empty bins
         break;
     }
-    case stats_method::max: {
-        for ( i = 0; i < bin_num; ++i )
-            results[ i ] = max[ i ];
+    case ana::stats_method::std: {
+        auto stats = chunked_stats< ana::running_moments >( array_len, data, bin_total, bin_of );
+        if ( global )
+            ana::merge_across_ranks( stats.data(), ( int )bin_total, comm );
+        for ( unsigned int j = 0; j < bin_total; ++j )
+            results[ j ] = stats[ j ].dispersion();
         break;
     }
-    case stats_method::median: {
-        for ( i = 0; i < bin_num; ++i )
-        {
-            if ( counts[ i ] == 0 )
-                results[ i ] = nan( "" );
-            else
-            {
-                std::sort( data_in_each_bin[ i ].begin(),
-                           data_in_each_bin[ i ].begin() + counts[ i ] );
-                if ( counts[ i ] % 2 == 0 )
-                    results[ i ] = ( data_in_each_bin[ i ][ counts[ i ] / 2 - 1 ]
-                                     + data_in_each_bin[ i ][ counts[ i ] / 2 ] )
-                                   / 2;
-                else
-                    results[ i ] = data_in_each_bin[ i ][ counts[ i ] / 2 ];
-            }
-        }
+    case ana::stats_method::median: {
+        auto stats = chunked_stats< ana::p2_quantile >( array_len, data, bin_total, bin_of );
+        if ( global )
+            ana::merge_across_ranks( stats.data(), ( int )bin_total, comm );
+        for ( unsigned int j = 0; j < bin_total; ++j )
+            results[ j ] = stats[ j ].value();
         break;
     }
-    case stats_method::std: {
-        for ( i = 0; i < bin_num; ++i )
-        {
-            if ( counts[ i ] == 0 )
-                results[ i ] = nan( "" );
-            else
-            {
-                double mean   = sum[ i ] / ( double )counts[ i ];
-                double error2 = 0;
-                for ( j = 0; j < counts[ i ]; ++j )
-                    error2 += ( data_in_each_bin[ i ][ j ] - mean )
-                              * ( data_in_each_bin[ i ][ j ] - mean );
-                results[ i ] = sqrt( error2 / counts[ i ] );
-            }
-        }
-    }
     }
-
-
-    // release the memory
-    if ( counts != nullptr )
-        delete[] counts;
-    if ( sum != nullptr )
-        delete[] sum;
-    if ( min != nullptr )
-        delete[] min;
-    if ( max != nullptr )
-        delete[] max;
-    data_in_each_bin.clear();
-
-    return results;
 }
 
-vector< vector< double > > ana::bin2d( unsigned long array_len, double coord_x[], double coord_y[],
-                                       double data[], double lower_bound_x, double upper_bound_x,
-                                       double lower_bound_y, double upper_bound_y,
-                                       unsigned int bin_numx, unsigned int bin_numy,
-                                       ana::stats_method method )
+vector< double > ana::bin1d( unsigned long array_len, double coord[], double data[],
+                             double lower_bound, double upper_bound, unsigned int bin_num,
+                             ana::stats_method method, MPI_Comm comm )
 {
-    if ( bin_numx == 0 || bin_numy == 0 )
+    if ( bin_num == 0 )
     {
         ERROR( "The number of bins should be larger than 0." );
     }
-    else if ( array_len == 0 )
+    else if ( array_len == 0 && comm == MPI_COMM_NULL )
     {
         WARN( "The length of array for binning is 0, return a vector of 0." );
-        return vector< vector< double > >( bin_numx, vector< double >( bin_numy, 0 ) );
+        return vector< double >( bin_num, 0 );
     }
 
-    // the final result
-    vector< vector< double > > results( bin_numx, vector< double >( bin_numy ) );
-
-    double*       sum    = nullptr;  // summation of the data points in each bin
-    double*       min    = nullptr;  // minimum of the data points in each bin
-    double*       max    = nullptr;  // maximum of the data points in each bin
-    unsigned int* counts = nullptr;  // the counts of the data points in each bin
-    vector< vector< vector< double > > > data_in_each_bin(
-        bin_numx, vector< vector< double > >(
-                      bin_numy ) );  // the data points in each bin, only used for median and std
+    double range  = upper_bound - lower_bound;
+    auto   bin_of = [ & ]( unsigned long i ) -> long {
+        if ( coord[ i ] < lower_bound || coord[ i ] > upper_bound )
+            return -1;
+        unsigned int bin_index = ( unsigned int )( ( coord[ i ] - lower_bound ) / range * bin_num );
+        if ( bin_index == bin_num )
+            bin_index = bin_num - 1;  // avoid the overflow at the upper bound
+        return ( long )bin_index;
+    };
+    vector< double > results( bin_num );
+    binned_stats( array_len, data, bin_num, bin_of, method, comm, results.data() );
+    return results;
+}
 
-    if ( method == stats_method::count || method == stats_method::mean
-         || method == stats_method::std || method == stats_method::median )
-        counts = new unsigned int[ bin_numx * bin_numy ]();
-    if ( method == stats_method::sum || method == stats_method::std
-         || method == stats_method::mean )
-        sum = new double[ bin_numx * bin_numy ]();
-    if ( method == stats_method::min )
+ana::histogram< double, 2 > ana::bin2d( unsigned long array_len, double coord_x[], double coord_y[],
+                                        double data[], double lower_bound_x, double upper_bound_x,
+                                        double lower_bound_y, double upper_bound_y,
+                                        unsigned int bin_numx, unsigned int bin_numy,
+                                        ana::stats_method method, MPI_Comm comm )
+{
+    if ( bin_numx == 0 || bin_numy == 0 )
     {
-        min = new double[ bin_numx * bin_numy ]();
-        for ( unsigned int i = 0; i < bin_numx * bin_numy; ++i )
-            min[ i ] = std::numeric_limits< double >::max();
+        ERROR( "The number of bins should be larger than 0." );
     }
-    if ( method == stats_method::max )
+    else if ( array_len == 0 && comm == MPI_COMM_NULL )
     {
-        max = new double[ bin_numx * bin_numy ]();
-        for ( unsigned int i = 0; i < bin_numx * bin_numy; ++i )
-            max[ i ] = std::numeric_limits< double >::min();
+        WARN( "The length of array for binning is 0, return a vector of 0." );
+        histogram< double, 2 > zeros{ bin_numx, bin_numy };
+        zeros.fill( 0 );
+        return zeros;
     }
 
     double range_x = upper_bound_x - lower_bound_x;
     double range_y = upper_bound_y - lower_bound_y;
-
-    unsigned int i, j, k;  // array index
-
-    // iterate over the data points
-    for ( i = 0; i < array_len; ++i )
-    {
+    auto   bin_of  = [ & ]( unsigned long i ) -> long {
         if ( coord_x[ i ] < lower_bound_x || coord_x[ i ] > upper_bound_x )
-            continue;
+            return -1;
         else if ( coord_y[ i ] < lower_bound_y || coord_y[ i ] > upper_bound_y )
-            continue;
-        // the index of the bin
+            return -1;
         unsigned int bin_index_x =
             ( unsigned int )( ( coord_x[ i ] - lower_bound_x ) / range_x * bin_numx );
         unsigned int bin_index_y =
@@ -274,151 +429,18 @@ vector< vector< double > > ana::bin2d( unsigned long array_len, double coord_x[]
             bin_index_x = bin_numx - 1;  // avoid the overflow at the upper bound
         if ( bin_index_y == bin_numy )
             bin_index_y = bin_numy - 1;  // avoid the overflow at the upper bound
-        switch ( method )
-        {
-        case stats_method::count: {
-            ++counts[ bin_index_x * bin_numy + bin_index_y ];
-            break;
-        }
-        case stats_method::sum: {
-            sum[ bin_index_x * bin_numy + bin_index_y ] += data[ i ];
-            break;
-        }
-        case stats_method::mean: {
-            sum[ bin_index_x * bin_numy + bin_index_y ] += data[ i ];
-            ++counts[ bin_index_x * bin_numy + bin_index_y ];
-            break;
-        }
-        case stats_method::min: {
-            if ( min[ bin_index_x * bin_numy + bin_index_y ] > data[ i ] )
-                min[ bin_index_x * bin_numy + bin_index_y ] = data[ i ];
-            break;
-        }
-        case stats_method::max: {
-            if ( max[ bin_index_x * bin_numy + bin_index_y ] < data[ i ] )
-                max[ bin_index_x * bin_numy + bin_index_y ] = data[ i ];
-            break;
-        }
-        case stats_method::median: {
-            if ( counts[ bin_index_x * bin_numy + bin_index_y ] + 1
-                 > ( unsigned int )data_in_each_bin[ bin_index_x ][ bin_index_y ].size() )
-                data_in_each_bin[ bin_index_x ][ bin_index_y ].resize(
-                    counts[ bin_index_x * bin_numy + bin_index_y ] + 1 + 20 );
-            data_in_each_bin[ bin_index_x ][ bin_index_y ]
-                            [ counts[ bin_index_x * bin_numy + bin_index_y ]++ ] =
-                                data[ i ];  // NOTE: test this index carefullly
-            break;
-        }
-        case stats_method::std: {
-            sum[ bin_index_x * bin_numy + bin_index_y ] += data[ i ];
-            if ( counts[ bin_index_x * bin_numy + bin_index_y ] + 1
-                 > ( unsigned int )data_in_each_bin[ bin_index_x ][ bin_index_y ].size() )
-                data_in_each_bin[ bin_index_x ][ bin_index_y ].resize(
-                    counts[ bin_index_x * bin_numy + bin_index_y ] + 1 + 20 );
-            data_in_each_bin[ bin_index_x ][ bin_index_y ]
-                            [ counts[ bin_index_x * bin_numy + bin_index_y ]++ ] =
-                                data[ i ];  // NOTE: test this index carefullly
-            break;
-        }
-        }
-    }
-
-    // erase the extra space
-    if ( method == stats_method::median || method == stats_method::std )
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numy; ++j )
-                data_in_each_bin[ i ][ j ].resize( counts[ i * bin_numy + j ] );
-
-    switch ( method )
-    {
-    case stats_method::count: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-                results[ i ][ j ] = ( double )counts[ i * bin_numy + j ];
-        break;
-    }
-    case stats_method::sum: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-                results[ i ][ j ] = ( double )sum[ i * bin_numy + j ];
-        break;
-    }
-    case stats_method::mean: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-                results[ i ][ j ] = sum[ i * bin_numy + j ] / ( double )counts[ i * bin_numy + j ];
-        break;
-    }
-    case stats_method::min: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-                results[ i ][ j ] = ( double )min[ i * bin_numy + j ];
-        break;
-    }
-    case stats_method::max: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-                results[ i ][ j ] = ( double )max[ i * bin_numy + j ];
-        break;
-    }
-    case stats_method::median: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-            {
-                if ( counts[ i * bin_numy + j ] == 0 )
-                    results[ i ][ j ] = nan( "" );
-                else
-                {
-                    std::sort( data_in_each_bin[ i ][ j ].begin(),
-                               data_in_each_bin[ i ][ j ].begin() + counts[ i * bin_numy + j ] );
-                    if ( counts[ i * bin_numy + j ] % 2 == 0 )
-                        results[ i ][ j ] =
-                            ( data_in_each_bin[ i ][ j ][ counts[ i * bin_numy + j ] / 2 - 1 ]
-                              + data_in_each_bin[ i ][ j ][ counts[ i * bin_numy + j ] / 2 ] )
-                            / 2;
-                    else
-                        results[ i ][ j ] =
-                            data_in_each_bin[ i ][ j ][ counts[ i * bin_numy + j ] / 2 ];
-                }
-            }
-        break;
-    }
-    case stats_method::std: {
-        for ( i = 0; i < bin_numx; ++i )
-            for ( j = 0; j < bin_numx; ++j )
-            {
-                if ( counts[ i ] == 0 )
-                    results[ i ][ j ] = nan( "" );
-                else
-                {
-                    double mean   = sum[ i ] / ( double )counts[ i ];
-                    double error2 = 0;
-                    for ( k = 0; k < counts[ i * bin_numy + j ]; ++k )
-                        error2 += ( data_in_each_bin[ i ][ j ][ k ] - mean )
-                                  * ( data_in_each_bin[ i ][ j ][ k ] - mean );
-                    results[ i ][ j ] = sqrt( error2 / counts[ i * bin_numy + j ] );
-                }
-            }
-    }
-    }
-
-    // release the memory
-    if ( counts != nullptr )
-        delete[] counts;
-    if ( sum != nullptr )
-        delete[] sum;
-    if ( min != nullptr )
-        delete[] min;
-    if ( max != nullptr )
-        delete[] max;
-    data_in_each_bin.clear();
-
+        return ( long )bin_index_x * bin_numy + bin_index_y;
+    };
+    histogram< double, 2 > results{ bin_numx, bin_numy };
+    binned_stats( array_len, data, bin_numx * bin_numy, bin_of, method, comm, results.data() );
     return results;
 }
 
 
 #ifdef debug_utils
 #include "../tools/prompt.h"
+#include "../tools/threads.h"
+#include <stdint.h>
 namespace unit_test {
 int test_in_spheroid()
 {
@@ -837,41 +859,187 @@ int test_bin2d( void )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res1[ i ][ j ] - exp1[ i ][ j ] ) > 1e-6 )
+            if ( fabs( res1( i, j ) - exp1[ i ][ j ] ) > 1e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res2[ i ][ j ] - exp2[ i ][ j ] ) > 2e-6 )
+            if ( fabs( res2( i, j ) - exp2[ i ][ j ] ) > 2e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res3[ i ][ j ] - exp3[ i ][ j ] ) > 3e-6 )
+            if ( fabs( res3( i, j ) - exp3[ i ][ j ] ) > 3e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res4[ i ][ j ] - exp4[ i ][ j ] ) > 4e-6 )
+            if ( fabs( res4( i, j ) - exp4[ i ][ j ] ) > 4e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res5[ i ][ j ] - exp5[ i ][ j ] ) > 1e-6 )
+            if ( fabs( res5( i, j ) - exp5[ i ][ j ] ) > 1e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res6[ i ][ j ] - exp6[ i ][ j ] ) > 1e-6 )
+            if ( fabs( res6( i, j ) - exp6[ i ][ j ] ) > 1e-6 )
                 CHECK_RETURN( false )
 
     for ( size_t i = 0; i < 4; ++i )
         for ( size_t j = 0; j < 4; ++j )
-            if ( fabs( res7[ i ][ j ] - exp7[ i ][ j ] ) > 1e-6 )
+            if ( fabs( res7( i, j ) - exp7[ i ][ j ] ) > 1e-6 )
                 CHECK_RETURN( false )
 
     CHECK_RETURN( true );
 }
+
+int test_streaming_stats( void )
+{
+    println( "Test the streaming statistics and their merge across the ranks ..." );
+    // the serial test has no MPI environment: the binning is local on a single "rank"
+    int      rank = 0, size = 1;
+    MPI_Comm comm = MPI_COMM_NULL;
+#ifdef MPI_TEST
+    comm = MPI_COMM_WORLD;
+    MPI_Comm_rank( comm, &rank );
+    MPI_Comm_size( comm, &size );
+#endif
+
+    // a skewed data set with a known median: x^2 of a uniform grid in [0, 1)
+    const int        num = 20000;
+    vector< double > data( num ), coord( num );
+    for ( int i = 0; i < num; ++i )
+    {
+        double x    = ( ( i * 7919 ) % num + 0.5 ) / num;  // a shuffled grid
+        data[ i ]  = x * x;
+        coord[ i ] = 0.5;
+    }
+
+    println( "Test the merge of the moments ..." );
+    ana::running_moments whole, part1, part2;
+    for ( int i = 0; i < num; ++i )
+    {
+        whole.add( data[ i ] );
+        ( i < num / 3 ? part1 : part2 ).add( data[ i ] );
+    }
+    part1.merge( part2 );
+    // the dispersion of x^2 for a uniform x: sqrt( 1/5 - 1/9 )
+    if ( fabs( part1.mean - whole.mean ) > 1e-12
+         || fabs( part1.dispersion() - whole.dispersion() ) > 1e-12
+         || fabs( whole.dispersion() - sqrt( 1.0 / 5 - 1.0 / 9 ) ) > 1e-6 )
+        CHECK_RETURN( false );
+
+    println( "Test the P^2 median ..." );
+    ana::p2_quantile small, large, half1, half2;
+    double           small_data[ 6 ] = { 5, 1, 4, 2, 6, 3 };
+    for ( int i = 0; i < 6; ++i )
+        small.add( small_data[ i ] );
+    if ( small.value() != 3.5 )
+        CHECK_RETURN( false );
+    for ( int i = 0; i < num; ++i )
+    {
+        large.add( data[ i ] );
+        ( i % 2 == 0 ? half1 : half2 ).add( data[ i ] );
+    }
+    half1.merge( half2 );
+    // the median of x^2 is 1/4, the estimators are accurate to ~1% for such a smooth distribution
+    if ( fabs( large.value() - 0.25 ) > 0.0025 || fabs( half1.value() - 0.25 ) > 0.0025 )
+    {
+        println( "The estimated medians: %lf, %lf (merged)", large.value(), half1.value() );
+        CHECK_RETURN( false );
+    }
+
+    println( "Test the binning across the ranks ..." );
+    // each rank holds a strided subset, the binned statistics should be of the whole set
+    vector< double > local_data, local_coord;
+    for ( int i = rank; i < num; i += size )
+    {
+        local_data.push_back( data[ i ] );
+        local_coord.push_back( coord[ i ] );
+    }
+    auto global_std    = ana::bin1d( local_data.size(), local_coord.data(), local_data.data(), 0, 1,
+                                     1, ana::stats_method::std, comm );
+    auto global_median = ana::bin1d( local_data.size(), local_coord.data(), local_data.data(), 0, 1,
+                                     1, ana::stats_method::median, comm );
+    auto global_max    = ana::bin1d( local_data.size(), local_coord.data(), local_data.data(), 0, 1,
+                                     2, ana::stats_method::max, comm );
+    if ( fabs( global_std[ 0 ] - whole.dispersion() ) > 1e-12
+         || fabs( global_median[ 0 ] - 0.25 ) > 0.0025 || !std::isnan( global_max[ 0 ] )
+         || global_max[ 1 ] != *std::max_element( data.begin(), data.end() ) )
+    {
+        println( "The binned std, median and max: %lf, %lf, %lf", global_std[ 0 ],
+                 global_median[ 0 ], global_max[ 1 ] );
+        CHECK_RETURN( false );
+    }
+
+    CHECK_RETURN( true );
+}
+
+int test_histogram( void )
+{
+    println( "Test the flat N-dimensional histogram ..." );
+    ana::histogram< double, 3 > hist{ 2, 3, 4 };
+    if ( hist.size() != 24 || hist.shape( 0 ) != 2 || hist.shape( 2 ) != 4
+         || ( uintptr_t )hist.data() % ana::histogram< double, 3 >::alignment != 0 )
+        CHECK_RETURN( false );
+    // row-major: the last index is the fastest
+    for ( size_t i = 0; i < hist.size(); ++i )
+        hist[ i ] = ( double )i;
+    if ( hist( 1, 2, 3 ) != 23 || hist( 0, 1, 0 ) != 4 || hist( 1, 0, 2 ) != 14 )
+        CHECK_RETURN( false );
+
+    println( "Test the reshape and move of the histogram ..." );
+    double* buffer = hist.data();
+    hist.reshape( { 4, 3, 2 } );  // the same size, no reallocation
+    if ( hist.data() != buffer || hist.shape( 0 ) != 4 || hist( 3, 2, 1 ) != 23 )
+        CHECK_RETURN( false );
+    vector< ana::histogram< double, 3 > > hists;
+    hists.push_back( std::move( hist ) );
+    hists.resize( 10 );  // the moved histograms keep their buffers
+    if ( hists[ 0 ].data() != buffer || hist.data() != nullptr || hist.size() != 0 )
+        CHECK_RETURN( false );
+    hists[ 0 ].fill( 1.5 );
+    CHECK_RETURN( std::accumulate( hists[ 0 ].data(), hists[ 0 ].data() + 24, 0.0 ) == 36 );
+}
+
+int test_threaded_binning( void )
+{
+    println( "Test the binning with the private accumulators of the threads ..." );
+    const int        num = 50000;
+    vector< double > data( num ), coord( num );
+    for ( int i = 0; i < num; ++i )
+    {
+        coord[ i ] = ( ( i * 7919 ) % num + 0.5 ) / num;  // a shuffled grid
+        data[ i ]  = sin( 0.01 * i );
+    }
+    ana::stats_method methods[] = { ana::stats_method::count, ana::stats_method::sum,
+                                    ana::stats_method::mean,  ana::stats_method::min,
+                                    ana::stats_method::max,   ana::stats_method::std,
+                                    ana::stats_method::median };
+    for ( auto& method : methods )
+    {
+        galotfa::threads::set( 1 );
+        auto serial = ana::bin1d( num, coord.data(), data.data(), 0, 1, 7, method );
+        galotfa::threads::set( 4 );
+        auto threaded = ana::bin1d( num, coord.data(), data.data(), 0, 1, 7, method );
+        auto again    = ana::bin1d( num, coord.data(), data.data(), 0, 1, 7, method );
+        galotfa::threads::set( 1 );
+        for ( int j = 0; j < 7; ++j )
+        {
+            // the same for a fixed number of threads, and close to the serial results
+            double tolerance = method == ana::stats_method::median ? 0.05 : 1e-9;
+            if ( threaded[ j ] != again[ j ] || fabs( threaded[ j ] - serial[ j ] ) > tolerance )
+            {
+                println( "The serial and threaded results of bin %d: %.17g, %.17g", j,
+                         serial[ j ], threaded[ j ] );
+                CHECK_RETURN( false );
+            }
+        }
+    }
+    CHECK_RETURN( true );
+}
 }  // namespace unit_test
 #endif
 #endif
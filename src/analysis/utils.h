@@ -5,8 +5,11 @@
 #include <gsl/gsl_linalg.h>
 #include <initializer_list>
 #include <math.h>
+#include <mpi.h>
 #include <numeric>
+#include <stdlib.h>
 #include <string.h>
+#include <utility>
 #include <vector>
 using std::vector;
 namespace galotfa {
@@ -477,17 +480,167 @@ namespace analysis {
         return result;
     };
 
+    // the N-dimensional histogram in one contiguous, row-major and aligned buffer: it's binned,
+    // reduced and pushed to the HDF5 writer in place, without any intermediate copy
+    template < typename T, unsigned int Dim > class histogram
+    {
+    private:
+        T*     buffer         = nullptr;
+        size_t capacity       = 0;  // in elements
+        size_t len            = 0;  // the product of the shape
+        size_t extents[ Dim ] = { 0 };
+
+    public:
+        static const size_t alignment = 64;  // in bytes, for SIMD
+        histogram( void ){};
+        histogram( std::initializer_list< size_t > shape )
+        {
+            this->reshape( shape );
+        }
+        histogram( histogram&& other ) noexcept
+        {
+            *this = std::move( other );
+        }
+        histogram& operator=( histogram&& other ) noexcept
+        {
+            std::swap( this->buffer, other.buffer );
+            std::swap( this->capacity, other.capacity );
+            std::swap( this->len, other.len );
+            for ( unsigned int d = 0; d < Dim; ++d )
+                std::swap( this->extents[ d ], other.extents[ d ] );
+            return *this;
+        }
+        histogram( const histogram& )            = delete;
+        histogram& operator=( const histogram& ) = delete;
+        ~histogram()
+        {
+            if ( this->buffer != nullptr )
+                free( this->buffer );
+        }
+
+        // set the shape, the buffer only grows, and the content is NOT initialized
+        void reshape( std::initializer_list< size_t > shape )
+        {
+            if ( shape.size() != Dim )
+                ERROR( "The shape of a %u-dimensional histogram has %lu extents.", Dim,
+                       shape.size() );
+            this->len = 1;
+            for ( unsigned int d = 0; d < Dim; ++d )
+                this->len *= this->extents[ d ] = *( shape.begin() + d );
+            if ( this->len <= this->capacity )
+                return;
+            if ( this->buffer != nullptr )
+                free( this->buffer );
+            this->buffer = nullptr;
+            size_t bytes = ( this->len * sizeof( T ) + alignment - 1 ) / alignment * alignment;
+            if ( posix_memalign( ( void** )&this->buffer, alignment, bytes ) != 0 )
+            {
+                this->capacity = this->len = 0;
+                ERROR( "Failed to allocate %lu bytes for a histogram.", bytes );
+            }
+            this->capacity = this->len;
+        }
+        inline void fill( T value )
+        {
+            std::fill( this->buffer, this->buffer + this->len, value );
+        }
+        inline T* data( void )
+        {
+            return this->buffer;
+        }
+        inline const T* data( void ) const
+        {
+            return this->buffer;
+        }
+        inline size_t size( void ) const
+        {
+            return this->len;
+        }
+        inline size_t shape( unsigned int d ) const
+        {
+            return this->extents[ d ];
+        }
+        inline T& operator[]( size_t flat_index )
+        {
+            return this->buffer[ flat_index ];
+        }
+        inline const T& operator[]( size_t flat_index ) const
+        {
+            return this->buffer[ flat_index ];
+        }
+        // the element at the multi-dimensional index, e.g. image( i, j )
+        template < typename... Index > inline T& operator()( Index... index )
+        {
+            static_assert( sizeof...( Index ) == Dim, "The number of indexes should be Dim." );
+            size_t indexes[ Dim ] = { ( size_t )index... };
+            size_t flat_index     = 0;
+            for ( unsigned int d = 0; d < Dim; ++d )
+                flat_index = flat_index * this->extents[ d ] + indexes[ d ];
+            return this->buffer[ flat_index ];
+        }
+    };
+
     enum stats_method { mean, median, std, max, min, sum, count };
 
+    // the streaming moments of a data set: Welford's update, and Chan's formula to merge two sets
+    // NOTE: all the members are double, so an array of it can be reduced as MPI_DOUBLE blocks
+    struct running_moments
+    {
+        double n    = 0;
+        double mean = 0;
+        double m2   = 0;  // the sum of the squared deviations from the mean
+
+        inline void add( double x )
+        {
+            n += 1;
+            double delta = x - mean;
+            mean += delta / n;
+            m2 += delta * ( x - mean );
+        }
+        void          merge( const running_moments& other );
+        inline double dispersion( void ) const
+        {
+            return n > 0 ? sqrt( m2 / n ) : nan( "" );
+        }
+    };
+
+    // the streaming quantile estimator of the P^2 algorithm (Jain & Chlamtac 1985): the first
+    // exact_num values are kept, so small sets are exact, then 5 markers track the quantile in
+    // constant memory
+    struct p2_quantile
+    {
+        static const int exact_num           = 32;
+        double           prob                = 0.5;    // the target quantile, 0.5 for the median
+        double           count               = 0;
+        double           height[ 5 ]         = { 0 };  // the heights of the markers
+        double           pos[ 5 ]            = { 0 };  // the positions of the markers, from 1
+        double           values[ exact_num ] = { 0 };  // the sorted values before the markers
+
+        void   add( double x );
+        void   merge( const p2_quantile& other );
+        double value( void ) const;
+
+    private:
+        void   set_markers( void );
+        double desired( int marker, double total ) const;
+        double rank( double x ) const;  // the estimated number of values <= x
+    };
+
+    // merge the accumulators of each bin across the ranks, the results are on all ranks
+    void merge_across_ranks( running_moments stats[], int len, MPI_Comm comm );
+    void merge_across_ranks( p2_quantile stats[], int len, MPI_Comm comm );
+
+    // NOTE: if comm is not MPI_COMM_NULL, the statistics are of the particles on all the ranks of
+    // comm, so it must be called by all of them
     vector< double > bin1d( unsigned long array_len, double coord[], double data[],
                             double lower_bound, double upper_bound, unsigned int bin_num,
-                            stats_method method );
+                            stats_method method, MPI_Comm comm = MPI_COMM_NULL );
 
-    vector< vector< double > > bin2d( unsigned long array_len, double coord_x[], double coord_y[],
-                                      double data[], double lower_bound_x, double upper_bound_x,
-                                      double lower_bound_y, double upper_bound_y,
-                                      unsigned int bin_numx, unsigned int bin_numy,
-                                      stats_method method );
+    histogram< double, 2 > bin2d( unsigned long array_len, double coord_x[], double coord_y[],
+                                  double data[], double lower_bound_x, double upper_bound_x,
+                                  double lower_bound_y, double upper_bound_y,
+                                  unsigned int bin_numx, unsigned int bin_numy,
+                                  stats_method method, MPI_Comm comm = MPI_COMM_NULL );
 }  // namespace analysis
 }  // namespace galotfa
 
@@ -500,6 +653,9 @@ int test_vec( void );
 int test_mat( void );
 int test_bin1d( void );
 int test_bin2d( void );
+int test_streaming_stats( void );
+int test_histogram( void );
+int test_threaded_binning( void );
 }  // namespace unit_test
 #endif
 #endif
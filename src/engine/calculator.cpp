@@ -2,7 +2,10 @@
 #define GALOTFA_CALCULATOR_CPP
 #include "calculator.h"
 #include "../analysis/utils.h"
+#include "../tools/comm.h"
+#include "../tools/threads.h"
 #include <cstring>
+#include <mpi.h>
 namespace ana = galotfa::analysis;
 namespace galotfa {
 
@@ -14,6 +17,10 @@ calculator::calculator( galotfa::para* parameter )
     {
         this->recenter_method = center_of_mass;
     }
+    else if ( this->para->pre_recenter_method == "shrink" )
+    {
+        this->recenter_method = shrinking_sphere;
+    }
     else
     {
         this->recenter_method = most_dense_pixel;
@@ -30,68 +37,40 @@ calculator::calculator( galotfa::para* parameter )
     {
         this->recenter_region_shape = box;
     }
+    if ( this->para->md_region_shape == "sphere" )
+    {
+        this->model_region_shape = sphere;
+    }
+    else if ( this->para->md_region_shape == "cylinder" )
+    {
+        this->model_region_shape = cylinder;
+    }
+    else
+    {
+        this->model_region_shape = box;
+    }
+    // the threads of the analysis kernels
+    galotfa::threads::set( this->para->glb_threads );
+
+    // start the recentering from the origin
+    this->system_center[ 0 ] = 0;
+    this->system_center[ 1 ] = 0;
+    this->system_center[ 2 ] = 0;
+
+    // the highest order of the Fourier modes to be calculated in the fused kernel
+    for ( auto& n : this->para->md_an )
+        if ( ( unsigned int )n > this->max_order )
+            this->max_order = ( unsigned int )n;
 
     this->ptrs_of_results = new analysis_result;
     this->setup_res();
+    this->setup_plan();
 }
 
 calculator::~calculator()
 {
     if ( this->para->md_switch_on )
     {
-        if ( this->para->md_image )
-        {
-            for ( auto& color : this->colors )
-            {
-                if ( color == "number_density" )
-                {
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                    {
-                        delete[] this->ptrs_of_results->images[ 0 ][ 0 ][ i ];
-                        delete[] this->ptrs_of_results->images[ 0 ][ 1 ][ i ];
-                        delete[] this->ptrs_of_results->images[ 0 ][ 2 ][ i ];
-                    }
-                }
-                else if ( color == "surface_density" )
-                {
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                    {
-                        delete[] this->ptrs_of_results->images[ 1 ][ 0 ][ i ];
-                        delete[] this->ptrs_of_results->images[ 1 ][ 1 ][ i ];
-                        delete[] this->ptrs_of_results->images[ 1 ][ 2 ][ i ];
-                    }
-                }
-                else if ( color == "mean_velocity" )
-                {
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                        for ( int k = 2; k < 5; ++k )
-                        {
-                            delete[] this->ptrs_of_results->images[ k ][ 0 ][ i ];
-                            delete[] this->ptrs_of_results->images[ k ][ 1 ][ i ];
-                            delete[] this->ptrs_of_results->images[ k ][ 2 ][ i ];
-                        }
-                }
-                else  // ( color == "velocity_dispersion" )
-                {
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                        for ( int k = 5; k < 8; ++k )
-                        {
-                            delete[] this->ptrs_of_results->images[ k ][ 0 ][ i ];
-                            delete[] this->ptrs_of_results->images[ k ][ 1 ][ i ];
-                            delete[] this->ptrs_of_results->images[ k ][ 2 ][ i ];
-                        }
-                }
-            }
-        }
-        if ( this->para->md_dispersion_tensor )
-        {
-            for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-            {
-                delete[] this->ptrs_of_results->dispersion_tensor[ i ];
-            }
-            this->ptrs_of_results->dispersion_tensor.clear();
-        }
-
         if ( this->para->md_inertia_tensor )
         {
             for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
@@ -134,79 +113,29 @@ void calculator::setup_res()
         if ( this->para->md_image )
         {
             this->colors             = this->para->md_colors;
+            size_t       set_num     = this->para->md_target_sets.size();
             unsigned int base_binnum = this->para->md_image_bins;
             unsigned int third_binnum =
                 ( unsigned int )this->para->md_image_bins * this->para->md_axis_ratio;
             for ( auto& color : this->colors )
             {
+                // the indexes of the images of this color, see the comments of analysis_result
+                int first = 0, last = 0;
                 if ( color == "number_density" )
-                {
-                    for ( int j = 0; j < 3; ++j )
-                        this->ptrs_of_results->images[ 0 ][ j ].resize(
-                            this->para->md_target_sets.size() );
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                    {
-                        double* image_xy_ptr = new double[ base_binnum * base_binnum ];
-                        double* image_xz_ptr = new double[ base_binnum * third_binnum ];
-                        double* image_yz_ptr = new double[ base_binnum * third_binnum ];
-                        this->ptrs_of_results->images[ 0 ][ 0 ][ i ] = image_xy_ptr;
-                        this->ptrs_of_results->images[ 0 ][ 1 ][ i ] = image_xz_ptr;
-                        this->ptrs_of_results->images[ 0 ][ 2 ][ i ] = image_yz_ptr;
-                    }
-                }
+                    first = last = 0;
                 else if ( color == "surface_density" )
-                {
-                    for ( int j = 0; j < 3; ++j )
-                        this->ptrs_of_results->images[ 1 ][ j ].resize(
-                            this->para->md_target_sets.size() );
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                    {
-                        double* image_xy_ptr = new double[ base_binnum * base_binnum ];
-                        double* image_xz_ptr = new double[ base_binnum * third_binnum ];
-                        double* image_yz_ptr = new double[ base_binnum * third_binnum ];
-                        this->ptrs_of_results->images[ 1 ][ 0 ][ i ] = image_xy_ptr;
-                        this->ptrs_of_results->images[ 1 ][ 1 ][ i ] = image_xz_ptr;
-                        this->ptrs_of_results->images[ 1 ][ 2 ][ i ] = image_yz_ptr;
-                    }
-                }
+                    first = last = 1;
                 else if ( color == "mean_velocity" )
-                {
-                    for ( int j = 0; j < 3; ++j )
-                        for ( int k = 2; k < 5; ++k )
-                            this->ptrs_of_results->images[ k ][ j ].resize(
-                                this->para->md_target_sets.size() );
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-                    {
-                        for ( int k = 2; k < 5; ++k )
-                        {
-                            double* image_xy_ptr = new double[ base_binnum * base_binnum ];
-                            double* image_xz_ptr = new double[ base_binnum * third_binnum ];
-                            double* image_yz_ptr = new double[ base_binnum * third_binnum ];
-                            this->ptrs_of_results->images[ k ][ 0 ][ i ] = image_xy_ptr;
-                            this->ptrs_of_results->images[ k ][ 1 ][ i ] = image_xz_ptr;
-                            this->ptrs_of_results->images[ k ][ 2 ][ i ] = image_yz_ptr;
-                        }
-                    }
-                }
+                    first = 2, last = 4;
                 else  // ( color == "velocity_dispersion" )
-                {
+                    first = 5, last = 7;
+                for ( int k = first; k <= last; ++k )
                     for ( int j = 0; j < 3; ++j )
-                        for ( int k = 5; k < 8; ++k )
-                            this->ptrs_of_results->images[ k ][ j ].resize(
-                                this->para->md_target_sets.size() );
-                    for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
                     {
-                        for ( int k = 5; k < 8; ++k )
-                        {
-                            double* image_xy_ptr = new double[ base_binnum * base_binnum ];
-                            double* image_xz_ptr = new double[ base_binnum * third_binnum ];
-                            double* image_yz_ptr = new double[ base_binnum * third_binnum ];
-                            this->ptrs_of_results->images[ k ][ 0 ][ i ] = image_xy_ptr;
-                            this->ptrs_of_results->images[ k ][ 1 ][ i ] = image_xz_ptr;
-                            this->ptrs_of_results->images[ k ][ 2 ][ i ] = image_yz_ptr;
-                        }
+                        this->ptrs_of_results->images[ k ][ j ].resize( set_num );
+                        for ( auto& image : this->ptrs_of_results->images[ k ][ j ] )
+                            image.reshape( { base_binnum, j == 0 ? base_binnum : third_binnum } );
                     }
-                }
             }
         }
         if ( this->para->md_dispersion_tensor )
@@ -215,11 +144,17 @@ void calculator::setup_res()
             unsigned int third_binnum =
                 ( unsigned int )this->para->md_image_bins * this->para->md_axis_ratio;
 
-            this->ptrs_of_results->dispersion_tensor.resize( this->para->md_target_sets.size() );
-            for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
+            size_t set_num = this->para->md_target_sets.size();
+            if ( this->para->md_sparse_tensor )
             {
-                double* tensor_ptr = new double[ base_binnum * base_binnum * third_binnum * 3 * 3 ];
-                this->ptrs_of_results->dispersion_tensor[ i ] = tensor_ptr;
+                this->ptrs_of_results->tensor_voxels.resize( set_num );
+                this->ptrs_of_results->sparse_tensors.resize( set_num );
+            }
+            else
+            {
+                this->ptrs_of_results->dispersion_tensor.resize( set_num );
+                for ( auto& tensor : this->ptrs_of_results->dispersion_tensor )
+                    tensor.reshape( { base_binnum, base_binnum, third_binnum, 9 } );
             }
         }
         if ( this->para->md_inertia_tensor )
@@ -232,32 +167,46 @@ void calculator::setup_res()
             }
         }
     }
+    // assign the value of the particle analysis part
+    if ( this->para->ptc_switch_on )
+    {
+        size_t type_num = this->para->ptc_particle_types.size();
+        this->ptrs_of_results->particle_ids.resize( type_num );
+        if ( this->para->ptc_circularity )
+            this->ptrs_of_results->circularity.resize( type_num );
+        if ( this->para->ptc_circularity_3d )
+            this->ptrs_of_results->circularity_3d.resize( type_num );
+    }
 }
 
-int calculator::call_pre_module( int& partnum_total, int types[], double masses[],
-                                 double coordinates[][ 3 ] ) const
+int calculator::call_pre_module( const galotfa::particle_view& view ) const
 {
+    if ( this->recenter_method == shrinking_sphere )  // select its own candidates
+        return this->shrink_recenter( view );
+
+    int partnum_total = view.size();
     vector< unsigned long* > id_for_pre;   // the array index of pre-process section's target
                                            // particles in the simulation data
     vector< unsigned long > part_num_pre;  // the length of the array index
 
-    auto ids     = new unsigned long[ partnum_total ];
+    auto ids     = this->scratch.get< unsigned long >( slot_pre_ids, partnum_total );
     int  counter = 0;  // how many particles have been used in this iteration
     for ( int j = 0; j < partnum_total; ++j )
     {
-        if ( this->is_target_of_pre( types[ j ], coordinates[ j ][ 0 ], coordinates[ j ][ 1 ],
-                                     coordinates[ j ][ 2 ] ) )
+        if ( this->is_target_of_pre( view.type( j ), view.pos( j, 0 ), view.pos( j, 1 ),
+                                     view.pos( j, 2 ) ) )
             ids[ counter++ ] = j;
     }
-    double* anchor_masses         = new double[ counter ];
-    double( *anchor_coords )[ 3 ] = new double[ counter ][ 3 ];
+    double* anchor_masses = this->scratch.get< double >( slot_pre_mass, counter );
+    double( *anchor_coords )[ 3 ] =
+        ( double( * )[ 3 ] )this->scratch.get< double >( slot_pre_coords, 3 * counter );
     // get the anchor particles' data
     for ( int j = 0; j < counter; ++j )
     {
-        anchor_masses[ j ]      = masses[ ids[ j ] ];
-        anchor_coords[ j ][ 0 ] = coordinates[ ids[ j ] ][ 0 ];
-        anchor_coords[ j ][ 1 ] = coordinates[ ids[ j ] ][ 1 ];
-        anchor_coords[ j ][ 2 ] = coordinates[ ids[ j ] ][ 2 ];
+        anchor_masses[ j ]      = view.mass( ids[ j ] );
+        anchor_coords[ j ][ 0 ] = view.pos( ids[ j ], 0 );
+        anchor_coords[ j ][ 1 ] = view.pos( ids[ j ], 1 );
+        anchor_coords[ j ][ 2 ] = view.pos( ids[ j ], 2 );
     }
 
     switch ( this->recenter_method )
@@ -308,14 +257,15 @@ int calculator::call_pre_module( int& partnum_total, int types[], double masses[
             double upper_bound_x = this->system_center[ 0 ] + this->para->pre_region_size * 0.5;
             double lower_bound_y = this->system_center[ 1 ] - this->para->pre_region_size * 0.5;
             double upper_bound_y = this->system_center[ 1 ] + this->para->pre_region_size * 0.5;
-            double lower_bound_z = this->system_center[ 1 ]
+            double lower_bound_z = this->system_center[ 2 ]
                                    - this->para->pre_region_size * 0.5 * this->para->pre_axis_ratio;
-            double upper_bound_z = this->system_center[ 1 ]
+            double upper_bound_z = this->system_center[ 2 ]
                                    + this->para->pre_region_size * 0.5 * this->para->pre_axis_ratio;
 
             ana::most_dense_pixel( counter, anchor_coords, lower_bound_x, upper_bound_x,
                                    lower_bound_y, upper_bound_y, lower_bound_z, upper_bound_z,
-                                   bin_num_x, bin_num_y, bin_num_z, this->system_center );
+                                   bin_num_x, bin_num_y, bin_num_z, this->system_center,
+                                   this->para->pre_subpixel );
 
             offset[ 0 ] -= this->system_center[ 0 ];
             offset[ 1 ] -= this->system_center[ 1 ];
@@ -334,16 +284,84 @@ int calculator::call_pre_module( int& partnum_total, int types[], double masses[
             }
         }
         break;
+    case shrinking_sphere:  // handled by shrink_recenter
+        break;
     case most_bound_particle:
         WARN( "Most boud partcile is not implemented yet." );
         break;
     }
 
-    // release the memory
-    delete[] ids;
-    delete[] anchor_masses;
-    delete[] anchor_coords;
+    return 0;
+}
+
+int calculator::shrink_recenter( const galotfa::particle_view& view ) const
+{
+    const double final_radius  = this->para->pre_region_size * this->para->pre_shrink_limit;
+    int          partnum_total = view.size();
+    double*      masses        = this->scratch.get< double >( slot_pre_mass, partnum_total );
+    double*      x             = this->scratch.get< double >( slot_pre_coords, 3 * partnum_total );
+    double*      y             = x + partnum_total;
+    double*      z             = y + partnum_total;
+
+    // warm start: the sphere of the final radius around the center of the last step, which
+    // usually converges in 1-2 iterations; fall back to a cold start from the whole recenter
+    // region if there is no anchor in the sphere, e.g. at the first step
+    for ( int cold = this->recentered ? 0 : 1; cold <= 1; ++cold )
+    {
+        double        radius  = cold ? this->para->pre_region_size : final_radius;
+        unsigned long counter = 0;
+        for ( int j = 0; j < partnum_total; ++j )
+        {
+            double pos[ 3 ] = { view.pos( j, 0 ), view.pos( j, 1 ), view.pos( j, 2 ) };
+            if ( cold )
+            {
+                if ( !this->is_target_of_pre( view.type( j ), pos[ 0 ], pos[ 1 ], pos[ 2 ] ) )
+                    continue;
+            }
+            else
+            {
+                double offset[ 3 ] = { pos[ 0 ] - this->system_center[ 0 ],
+                                       pos[ 1 ] - this->system_center[ 1 ],
+                                       pos[ 2 ] - this->system_center[ 2 ] };
+                if ( ana::norm( offset ) > radius
+                     || std::find( this->para->pre_recenter_anchors.begin(),
+                                   this->para->pre_recenter_anchors.end(), view.type( j ) )
+                            == this->para->pre_recenter_anchors.end() )
+                    continue;
+            }
+            masses[ counter ] = view.mass( j );
+            x[ counter ]      = pos[ 0 ];
+            y[ counter ]      = pos[ 1 ];
+            z[ counter ]      = pos[ 2 ];
+            ++counter;
+        }
+
+        bool found = false;  // whether any sphere contains the anchors, the same on all ranks
+        for ( int i = 0; i < this->para->glb_max_iter; ++i )
+        {
+            double offset[ 3 ] = { this->system_center[ 0 ], this->system_center[ 1 ],
+                                   this->system_center[ 2 ] };
+            if ( ana::shrink_sphere( counter, x, y, z, masses, radius, this->system_center ) <= 0 )
+                break;
+            found = true;
 
+            offset[ 0 ] -= this->system_center[ 0 ];
+            offset[ 1 ] -= this->system_center[ 1 ];
+            offset[ 2 ] -= this->system_center[ 2 ];
+            bool converged = this->para->glb_convergence_type == "relative"
+                                 ? ana::norm( offset ) / this->para->pre_region_size
+                                       <= this->para->glb_convergence_threshold
+                                 : ana::norm( offset ) <= this->para->glb_convergence_threshold;
+            if ( converged && radius <= final_radius )
+                break;
+            radius = std::max( radius * this->para->pre_shrink_factor, final_radius );
+        }
+        if ( found )
+        {
+            this->recentered = true;
+            break;
+        }
+    }
     return 0;
 }
 
@@ -353,41 +371,44 @@ int calculator::call_md_module md_args const
     for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
     {
         // hte mass of the target set
-        double* mass = new double[ part_num_md[ i ] ];
+        double* mass = this->scratch.get< double >( slot_mass, part_num_md[ i ] );
         // the coordinates used in the bin2d function
-        double* x = new double[ part_num_md[ i ] ];
-        double* y = new double[ part_num_md[ i ] ];
-        double* z = new double[ part_num_md[ i ] ];
+        double* x = this->scratch.get< double >( slot_x, part_num_md[ i ] );
+        double* y = this->scratch.get< double >( slot_y, part_num_md[ i ] );
+        double* z = this->scratch.get< double >( slot_z, part_num_md[ i ] );
         double* vels[ 3 ];
-        vels[ 0 ] = new double[ part_num_md[ i ] ];
-        vels[ 1 ] = new double[ part_num_md[ i ] ];
-        vels[ 2 ] = new double[ part_num_md[ i ] ];
+        vels[ 0 ] = this->scratch.get< double >( slot_vx, part_num_md[ i ] );
+        vels[ 1 ] = this->scratch.get< double >( slot_vy, part_num_md[ i ] );
+        vels[ 2 ] = this->scratch.get< double >( slot_vz, part_num_md[ i ] );
         // extract the data of the target set
-        for ( int j = 0; j < ( int )part_num_md[ i ]; ++j )
-        {
-            {
-                x[ j ] = coordinates[ id_for_md[ i ][ j ] ][ 0 ] - this->system_center[ 0 ];
-                y[ j ] = coordinates[ id_for_md[ i ][ j ] ][ 1 ] - this->system_center[ 1 ];
-                z[ j ] = coordinates[ id_for_md[ i ][ j ] ][ 2 ]
-                         - this->system_center[ 2 ] * this->para->md_axis_ratio;
-                vels[ 0 ][ j ] = velocities[ id_for_md[ i ][ j ] ][ 0 ];
-                vels[ 1 ][ j ] = velocities[ id_for_md[ i ][ j ] ][ 1 ];
-                vels[ 2 ][ j ] = velocities[ id_for_md[ i ][ j ] ][ 2 ];
-                mass[ j ]      = masses[ id_for_md[ i ][ j ] ];
-            }
-        }
+        galotfa::threads::for_each( part_num_md[ i ], [ & ]( long j ) {
+            x[ j ] = view.pos( id_for_md[ i ][ j ], 0 ) - this->system_center[ 0 ];
+            y[ j ] = view.pos( id_for_md[ i ][ j ], 1 ) - this->system_center[ 1 ];
+            z[ j ] = view.pos( id_for_md[ i ][ j ], 2 )
+                     - this->system_center[ 2 ] * this->para->md_axis_ratio;
+            vels[ 0 ][ j ] = view.vel( id_for_md[ i ][ j ], 0 );
+            vels[ 1 ][ j ] = view.vel( id_for_md[ i ][ j ], 1 );
+            vels[ 2 ][ j ] = view.vel( id_for_md[ i ][ j ], 2 );
+            mass[ j ]      = view.mass( id_for_md[ i ][ j ] );
+        } );
+        // the images and the tensors of a set are reduced to the process writing its file, while
+        // the scalars are known by all the processes
+        int owner = this->para->md_multiple ? galotfa::comm::owner( i ) : 0;
+        // all the azimuthal quantities and the inertia tensor in one sweep and one reduction
+        ana::moments moments;
+        ana::fused_moments( part_num_md[ i ], mass, x, y, z, this->max_order, moments );
         if ( this->para->md_bar_major_axis )
-            this->ptrs_of_results->bar_major_axis[ i ] =
-                ana::bar_major_axis( part_num_md[ i ], mass, x, y );
+            this->ptrs_of_results->bar_major_axis[ i ] = arg( moments.An[ 2 ] ) / 2;
         if ( this->para->md_sbar )
-            this->ptrs_of_results->s_bar[ i ] = ana::s_bar( part_num_md[ i ], mass, x, y );
+            this->ptrs_of_results->s_bar[ i ] = abs( moments.An[ 2 ] / moments.An[ 0 ] );
         if ( this->para->md_sbuckle )
-            this->ptrs_of_results->s_buckle[ i ] = ana::s_buckle( part_num_md[ i ], mass, x, y, z );
+            this->ptrs_of_results->s_buckle[ i ] = abs( moments.buckle / moments.mass );
         if ( this->para->md_an.size() > 0 )
             for ( auto& n : this->para->md_an )
-            {
-                this->ptrs_of_results->Ans[ n ][ i ] = ana::An( part_num_md[ i ], mass, x, y, n );
-            }
+                this->ptrs_of_results->Ans[ n ][ i ] = moments.An[ n ];
+        if ( this->para->md_inertia_tensor )
+            memcpy( this->ptrs_of_results->inertia_tensor[ i ], moments.inertia,
+                    sizeof( double ) * 9 );
 
         if ( this->para->md_bar_radius )  // must call this after s_bar
         {
@@ -399,7 +420,8 @@ int calculator::call_md_module md_args const
                 ana::bar_radius( part_num_md[ i ], mass, x, y, rmin, rmax, rbins,
                                  this->ptrs_of_results->bar_major_axis[ i ], this->para->md_deg,
                                  this->para->md_percentage,
-                                 this->ptrs_of_results->bar_radius[ i ].data() );
+                                 this->ptrs_of_results->bar_radius[ i ].data(), this->scratch,
+                                 slot_bar );
             }
             else
             {
@@ -415,18 +437,18 @@ int calculator::call_md_module md_args const
             // rotate the coordinates to align the bar
             double phi = -this->ptrs_of_results->bar_major_axis[ i ];
             // minus sign: passively rotate the coordinates
-            double _x, _y;  // tmp variables
-            for ( int j = 0; j < part_num_md[ i ]; ++j )
-            {
-                _x             = x[ j ];
-                _y             = y[ j ];
+            galotfa::threads::for_each( part_num_md[ i ], [ & ]( long j ) {
+                double _x      = x[ j ];  // tmp variables
+                double _y      = y[ j ];
                 x[ j ]         = _x * cos( phi ) - _y * sin( phi );
                 y[ j ]         = _x * sin( phi ) + _y * cos( phi );
                 _x             = vels[ 0 ][ j ];
                 _y             = vels[ 1 ][ j ];
                 vels[ 0 ][ j ] = _x * cos( phi ) - _y * sin( phi );
                 vels[ 1 ][ j ] = _x * sin( phi ) + _y * cos( phi );
-            }
+            } );
+            if ( this->para->md_inertia_tensor )
+                ana::rotate_tensor_z( this->ptrs_of_results->inertia_tensor[ i ], phi );
         }
 
         if ( this->para->md_image )
@@ -437,113 +459,54 @@ int calculator::call_md_module md_args const
             unsigned int third_binnum =
                 ( unsigned int )this->para->md_image_bins * this->para->md_axis_ratio;
 
-            unsigned int k, m, n;  // tmp variables for the loop
+            bool number_density = false, surface_density = false, mean_velocity = false,
+                 dispersion = false;
             for ( auto& color : this->colors )
             {
-                if ( color == "number_density" )
-                {
-                    auto image_xy =
-                        ana::bin2d( part_num_md[ i ], x, y, x, -base_size, base_size, -base_size,
-                                    base_size, base_binnum, base_binnum, ana::stats_method::count );
-                    auto image_xz = ana::bin2d( part_num_md[ i ], x, z, x, -base_size, base_size,
-                                                -third_size, third_size, base_binnum, third_binnum,
-                                                ana::stats_method::count );
-                    auto image_yz = ana::bin2d( part_num_md[ i ], y, z, x, -base_size, base_size,
-                                                -third_size, third_size, base_binnum, third_binnum,
-                                                ana::stats_method::count );
-                    for ( k = 0; k < base_binnum; ++k )
-                        for ( m = 0; m < third_binnum; ++m )
-                        {
-                            this->ptrs_of_results->images[ 0 ][ 0 ][ i ][ k * base_binnum + m ] =
-                                image_xy[ k ][ m ];
-                            this->ptrs_of_results->images[ 0 ][ 1 ][ i ][ k * base_binnum + m ] =
-                                image_xz[ k ][ m ];
-                            this->ptrs_of_results->images[ 0 ][ 2 ][ i ][ k * base_binnum + m ] =
-                                image_yz[ k ][ m ];
-                        }
-                }
-                else if ( color == "surface_density" )
+                number_density |= color == "number_density";
+                surface_density |= color == "surface_density";
+                mean_velocity |= color == "mean_velocity";
+                dispersion |= color == "velocity_dispersion";
+            }
+            // the velocity moments are only accumulated if needed
+            int    moment_num = dispersion ? 8 : ( mean_velocity ? 5 : 2 );
+            size_t pixel_num[ 3 ] = { ( size_t )base_binnum * base_binnum,
+                                      ( size_t )base_binnum * third_binnum,
+                                      ( size_t )base_binnum * third_binnum };
+            double area[ 3 ]      = { 4 * base_size * base_size / base_binnum / base_binnum,
+                                      4 * base_size * third_size / base_binnum / third_binnum,
+                                      4 * base_size * third_size / base_binnum / third_binnum };
+            double* moments       = this->scratch.get< double >(
+                slot_image, moment_num * ( pixel_num[ 0 ] + pixel_num[ 1 ] + pixel_num[ 2 ] ) );
+            // all the colors and projections in one sweep and one reduction to the owner
+            ana::image_moments( part_num_md[ i ], mass, x, y, z, vels, base_size, third_size,
+                                base_binnum, third_binnum, moment_num, moments, owner );
+
+            // derive the images from the pixel moments, only the owner writes them
+            int rank;
+            MPI_Comm_rank( galotfa::comm::current(), &rank );
+            double* pixel = moments;
+            for ( int p = 0; rank == owner && p < 3; ++p )
+                for ( size_t k = 0; k < pixel_num[ p ]; ++k, pixel += moment_num )
                 {
-                    static double area_xy = 4 * base_size * base_size / base_binnum / base_binnum;
-                    static double area_xz = 4 * base_size * third_size / base_binnum / third_binnum;
-                    static double area_yz = 4 * base_size * third_size / base_binnum / third_binnum;
-                    auto          image_xy =
-                        ana::bin2d( part_num_md[ i ], x, y, mass, -base_size, base_size, -base_size,
-                                    base_size, base_binnum, base_binnum, ana::stats_method::sum );
-                    auto image_xz = ana::bin2d( part_num_md[ i ], x, z, mass, -base_size, base_size,
-                                                -third_size, third_size, base_binnum, third_binnum,
-                                                ana::stats_method::sum );
-                    auto image_yz = ana::bin2d( part_num_md[ i ], y, z, mass, -base_size, base_size,
-                                                -third_size, third_size, base_binnum, third_binnum,
-                                                ana::stats_method::sum );
-                    for ( k = 0; k < base_binnum; ++k )
-                        for ( m = 0; m < third_binnum; ++m )
+                    auto& images = this->ptrs_of_results->images;
+                    if ( number_density )
+                        images[ 0 ][ p ][ i ][ k ] = pixel[ 0 ];
+                    if ( surface_density )
+                        images[ 1 ][ p ][ i ][ k ] = pixel[ 1 ] / area[ p ];
+                    for ( int n = 0; n < 3 && moment_num > 2; ++n )
+                    {
+                        // NaN for the empty pixels
+                        double mean = pixel[ 2 + n ] / pixel[ 0 ];
+                        if ( mean_velocity )
+                            images[ 2 + n ][ p ][ i ][ k ] = mean;
+                        if ( dispersion )
                         {
-                            this->ptrs_of_results->images[ 1 ][ 0 ][ i ][ k * base_binnum + m ] =
-                                image_xy[ k ][ m ] / area_xy;
-                            this->ptrs_of_results->images[ 1 ][ 1 ][ i ][ k * base_binnum + m ] =
-                                image_xz[ k ][ m ] / area_xz;
-                            this->ptrs_of_results->images[ 1 ][ 2 ][ i ][ k * base_binnum + m ] =
-                                image_yz[ k ][ m ] / area_yz;
+                            double variance = pixel[ 5 + n ] / pixel[ 0 ] - mean * mean;
+                            images[ 5 + n ][ p ][ i ][ k ] = sqrt( variance < 0 ? 0 : variance );
                         }
-                }
-                else if ( color == "mean_velocity" )
-                {
-                    for ( n = 0; n < 3; ++n )
-                    {
-                        auto image_xy = ana::bin2d( part_num_md[ i ], x, y, vels[ n ], -base_size,
-                                                    base_size, -base_size, base_size, base_binnum,
-                                                    base_binnum, ana::stats_method::mean );
-                        auto image_xz = ana::bin2d( part_num_md[ i ], x, z, vels[ n ], -base_size,
-                                                    base_size, -third_size, third_size, base_binnum,
-                                                    third_binnum, ana::stats_method::mean );
-                        auto image_yz = ana::bin2d( part_num_md[ i ], y, z, vels[ n ], -base_size,
-                                                    base_size, -third_size, third_size, base_binnum,
-                                                    third_binnum, ana::stats_method::mean );
-                        for ( k = 0; k < base_binnum; ++k )
-                            for ( m = 0; m < third_binnum; ++m )
-                            {
-                                this->ptrs_of_results
-                                    ->images[ 2 + n ][ 0 ][ i ][ k * base_binnum + m ] =
-                                    image_xy[ k ][ m ];
-                                this->ptrs_of_results
-                                    ->images[ 2 + n ][ 1 ][ i ][ k * base_binnum + m ] =
-                                    image_xz[ k ][ m ];
-                                this->ptrs_of_results
-                                    ->images[ 2 + n ][ 2 ][ i ][ k * base_binnum + m ] =
-                                    image_yz[ k ][ m ];
-                            }
                     }
                 }
-                else  // ( color == "velocity_dispersion" )
-                {
-                    for ( n = 0; n < 3; ++n )
-                    {
-                        auto image_xy = ana::bin2d( part_num_md[ i ], x, y, vels[ n ], -base_size,
-                                                    base_size, -base_size, base_size, base_binnum,
-                                                    base_binnum, ana::stats_method::std );
-                        auto image_xz = ana::bin2d( part_num_md[ i ], x, z, vels[ n ], -base_size,
-                                                    base_size, -third_size, third_size, base_binnum,
-                                                    third_binnum, ana::stats_method::std );
-                        auto image_yz = ana::bin2d( part_num_md[ i ], y, z, vels[ n ], -base_size,
-                                                    base_size, -third_size, third_size, base_binnum,
-                                                    third_binnum, ana::stats_method::std );
-                        for ( k = 0; k < base_binnum; ++k )
-                            for ( m = 0; m < third_binnum; ++m )
-                            {
-                                this->ptrs_of_results
-                                    ->images[ 5 + n ][ 0 ][ i ][ k * base_binnum + m ] =
-                                    image_xy[ k ][ m ];
-                                this->ptrs_of_results
-                                    ->images[ 5 + n ][ 1 ][ i ][ k * base_binnum + m ] =
-                                    image_xz[ k ][ m ];
-                                this->ptrs_of_results
-                                    ->images[ 5 + n ][ 2 ][ i ][ k * base_binnum + m ] =
-                                    image_yz[ k ][ m ];
-                            }
-                    }
-                }
-            }
         }
         if ( this->para->md_dispersion_tensor )
         {
@@ -552,20 +515,14 @@ int calculator::call_md_module md_args const
             double       third_size  = base_size * this->para->md_axis_ratio;
             unsigned int third_binnum =
                 ( unsigned int )this->para->md_image_bins * this->para->md_axis_ratio;
-            if ( this->para->md_region_shape == "box" )
-            {
-                ana::dispersion_tensor( part_num_md[ i ], x, y, z, vels[ 0 ], vels[ 1 ], vels[ 2 ],
-                                        -base_size, base_size, -base_size, base_size, -third_size,
-                                        third_size, base_binnum, base_binnum, third_binnum,
-                                        this->ptrs_of_results->dispersion_tensor[ i ] );
-            }
-            else if ( this->para->md_region_shape == "sphere" )
+            // the velocity components along the principle axes of the region shape
+            double* tensor_vels[ 3 ] = { vels[ 0 ], vels[ 1 ], vels[ 2 ] };
+            if ( this->para->md_region_shape == "sphere" )
             {
-                double* v_r     = new double[ part_num_md[ i ] ];
-                double* v_phi   = new double[ part_num_md[ i ] ];
-                double* v_theta = new double[ part_num_md[ i ] ];
-                for ( int j = 0; j < part_num_md[ i ]; ++j )
-                {
+                double* v_r     = this->scratch.get< double >( slot_v1, part_num_md[ i ] );
+                double* v_phi   = this->scratch.get< double >( slot_v2, part_num_md[ i ] );
+                double* v_theta = this->scratch.get< double >( slot_v3, part_num_md[ i ] );
+                galotfa::threads::for_each( part_num_md[ i ], [ & ]( long j ) {
                     v_r[ j ] = ( vels[ 0 ][ j ] * x[ j ] + vels[ 1 ][ j ] * y[ j ]
                                  + vels[ 2 ][ j ] * z[ j ] )
                                / sqrt( x[ j ] * x[ j ] + y[ j ] * y[ j ] + z[ j ] * z[ j ] );
@@ -574,61 +531,151 @@ int calculator::call_md_module md_args const
                     v_theta[ j ] = ( -vels[ 0 ][ j ] * z[ j ]
                                      + vels[ 2 ][ j ] * ( x[ j ] * x[ j ] + y[ j ] * y[ j ] ) )
                                    / sqrt( x[ j ] * x[ j ] + y[ j ] * y[ j ] + z[ j ] * z[ j ] );
-                }
-                ana::dispersion_tensor( part_num_md[ i ], x, y, z, v_r, v_phi, v_theta, -base_size,
-                                        base_size, -base_size, base_size, -third_size, third_size,
-                                        base_binnum, base_binnum, third_binnum,
-                                        this->ptrs_of_results->dispersion_tensor[ i ] );
-                delete[] v_r;
-                delete[] v_phi;
-                delete[] v_theta;
+                } );
+                tensor_vels[ 0 ] = v_r;
+                tensor_vels[ 1 ] = v_phi;
+                tensor_vels[ 2 ] = v_theta;
             }
-            else  // ( this->para->md_region_shape == "cylinder" )
+            else if ( this->para->md_region_shape == "cylinder" )
             {
-
-                double* v_R   = new double[ part_num_md[ i ] ];
-                double* v_phi = new double[ part_num_md[ i ] ];
-                for ( int j = 0; j < part_num_md[ i ]; ++j )
-                {
+                double* v_R   = this->scratch.get< double >( slot_v1, part_num_md[ i ] );
+                double* v_phi = this->scratch.get< double >( slot_v2, part_num_md[ i ] );
+                galotfa::threads::for_each( part_num_md[ i ], [ & ]( long j ) {
                     v_R[ j ] = ( vels[ 0 ][ j ] * x[ j ] + vels[ 1 ][ j ] * y[ j ] )
                                / sqrt( x[ j ] * x[ j ] + y[ j ] * y[ j ] );
                     v_phi[ j ] = ( -vels[ 0 ][ j ] * y[ j ] + vels[ 1 ][ j ] * x[ j ] )
                                  / sqrt( x[ j ] * x[ j ] + y[ j ] * y[ j ] );
+                } );
+                tensor_vels[ 0 ] = v_R;
+                tensor_vels[ 1 ] = v_phi;
+            }
+
+            int rank;
+            MPI_Comm_rank( galotfa::comm::current(), &rank );
+            double component[ 6 ];  // xx, xy, xz, yy, yz, zz
+            if ( this->para->md_sparse_tensor )
+            {
+                // only the occupied voxels, with their ( x, y, z ) bin indexes
+                const long long* voxels    = nullptr;
+                const double*    moments   = nullptr;
+                size_t           voxel_num = 0;
+                ana::sparse_dispersion_moments( part_num_md[ i ], x, y, z, tensor_vels, base_size,
+                                                third_size, base_binnum, third_binnum,
+                                                this->scratch, slot_sparse, this->voxel_rows,
+                                                voxels, moments, voxel_num, owner );
+                auto& indexes = this->ptrs_of_results->tensor_voxels[ i ];
+                auto& tensors = this->ptrs_of_results->sparse_tensors[ i ];
+                indexes.resize( 3 * voxel_num );
+                tensors.resize( 6 * voxel_num );
+                for ( size_t v = 0; v < voxel_num; ++v )
+                {
+                    indexes[ 3 * v ]     = voxels[ v ] / third_binnum / base_binnum;
+                    indexes[ 3 * v + 1 ] = voxels[ v ] / third_binnum % base_binnum;
+                    indexes[ 3 * v + 2 ] = voxels[ v ] % third_binnum;
+                    ana::voxel_dispersion( &moments[ ana::voxel_moment_num * v ],
+                                           &tensors[ 6 * v ] );
+                }
+            }
+            else
+            {
+                auto&   tensor  = this->ptrs_of_results->dispersion_tensor[ i ];
+                size_t  voxels  = tensor.size() / 9;
+                double* moments = this->scratch.get< double >( slot_tensor,
+                                                               ana::voxel_moment_num * voxels );
+                ana::dispersion_moments( part_num_md[ i ], x, y, z, tensor_vels, base_size,
+                                         third_size, base_binnum, third_binnum, moments, owner );
+                // only the owner writes the tensor, which is symmetric
+                static const int full[ 9 ] = { 0, 1, 2, 1, 3, 4, 2, 4, 5 };
+                for ( size_t v = 0; rank == owner && v < voxels; ++v )
+                {
+                    ana::voxel_dispersion( moments + ana::voxel_moment_num * v, component );
+                    for ( int k = 0; k < 9; ++k )
+                        tensor[ 9 * v + k ] = component[ full[ k ] ];
                 }
-                ana::dispersion_tensor( part_num_md[ i ], x, y, z, v_R, v_phi, vels[ 2 ],
-                                        -base_size, base_size, -base_size, base_size, -third_size,
-                                        third_size, base_binnum, base_binnum, third_binnum,
-                                        this->ptrs_of_results->dispersion_tensor[ i ] );
-                delete[] v_R;
-                delete[] v_phi;
             }
         }
-        if ( this->para->md_inertia_tensor )
-        {
-            ana::inertia_tensor( part_num_md[ i ], mass, x, y, z,
-                                 this->ptrs_of_results->inertia_tensor[ i ] );
-        }
-        // release the memory
-        delete[] x;
-        delete[] y;
-        delete[] z;
-        for ( int i = 0; i < 3; ++i )
-            delete[] vels[ i ];
-        delete[] mass;
     }
     return 0;
 }
 
-int calculator::call_ptc_module() const
+int calculator::call_ptc_module( const galotfa::particle_view& view, vector< int* >& id_for_ptc,
+                                 vector< int >& part_num_ptc ) const
 {
-    INFO( "Mock the behavior of particle analysis module." );
+    // the results stay on each process: the particle file is written with the slabs of all the
+    // processes, so no particle is sent to the root process
+    analysis_result* res = this->ptrs_of_results;
+    for ( size_t i = 0; i < id_for_ptc.size(); ++i )
+    {
+        int part_num = part_num_ptc[ i ];
+        res->particle_ids[ i ].resize( part_num );
+        double( *coords )[ 3 ] =
+            ( double( * )[ 3 ] )this->scratch.get< double >( slot_ptc_coords, 3 * part_num );
+        double( *vels )[ 3 ] =
+            ( double( * )[ 3 ] )this->scratch.get< double >( slot_ptc_vels, 3 * part_num );
+        galotfa::threads::for_each( part_num, [ & ]( long j ) {
+            int index                   = id_for_ptc[ i ][ j ];
+            res->particle_ids[ i ][ j ] = view.id( index );
+            for ( int k = 0; k < 3; ++k )
+            {
+                coords[ j ][ k ] = view.pos( index, k );
+                vels[ j ][ k ]   = view.vel( index, k );
+            }
+        } );
+
+        if ( this->para->ptc_circularity )
+        {
+            res->circularity[ i ].resize( part_num );
+            ana::circularity( part_num, coords, vels, this->system_center,
+                              res->circularity[ i ].data() );
+        }
+        if ( this->para->ptc_circularity_3d )
+        {
+            res->circularity_3d[ i ].resize( part_num );
+            ana::circularity_3d( part_num, coords, vels, this->system_center,
+                                 res->circularity_3d[ i ].data() );
+        }
+    }
     return 0;
 }
 
-int calculator::call_orb_module() const
+int calculator::call_orb_module( const galotfa::particle_view& view, int id_for_orb[],
+                                 int part_num_orb ) const
 {
-    INFO( "Mock the behavior of orbital curve log module." );
-    return 0;
+    // the frame of the orbits: optionally recentered to the system center, and rotated to align
+    // the x axis with the bar major axis of the first model analysis set, if the bar is detected
+    double center[ 3 ] = { 0, 0, 0 };
+    if ( this->para->orb_recenter )
+        for ( int k = 0; k < 3; ++k )
+            center[ k ] = this->system_center[ k ];
+    double phi = 0;
+    if ( this->para->orb_align_bar && this->ptrs_of_results->s_bar.size() > 0
+         && this->ptrs_of_results->s_bar[ 0 ] > this->para->md_bar_threshold )
+        phi = -this->ptrs_of_results->bar_major_axis[ 0 ];
+    // minus sign: passively rotate the coordinates
+    double cos_phi = cos( phi ), sin_phi = sin( phi );
+
+    long long* ids  = this->scratch.get< long long >( slot_orb_ids, part_num_orb );
+    double*    data = this->scratch.get< double >( slot_orb_data, 6 * ( size_t )part_num_orb );
+    for ( int j = 0; j < part_num_orb; ++j )
+    {
+        int     index = id_for_orb[ j ];
+        double* row   = data + 6 * ( size_t )j;
+        double  x     = view.pos( index, 0 ) - center[ 0 ];
+        double  y     = view.pos( index, 1 ) - center[ 1 ];
+        double  vx    = view.vel( index, 0 );
+        double  vy    = view.vel( index, 1 );
+        ids[ j ]      = view.id( index );
+        row[ 0 ]      = x * cos_phi - y * sin_phi;
+        row[ 1 ]      = x * sin_phi + y * cos_phi;
+        row[ 2 ]      = view.pos( index, 2 ) - center[ 2 ];
+        row[ 3 ]      = vx * cos_phi - vy * sin_phi;
+        row[ 4 ]      = vx * sin_phi + vy * cos_phi;
+        row[ 5 ]      = view.vel( index, 2 );
+    }
+
+    // only the tracked particles are sent to the root process, in the order of their ids
+    return ana::gather_orbits( part_num_orb, ids, data, this->ptrs_of_results->orbit_ids,
+                               this->ptrs_of_results->orbits );
 }
 
 int calculator::call_grp_module() const
@@ -643,12 +690,92 @@ int calculator::call_post_module() const
     return 0;
 }
 
+void calculator::setup_plan()
+{
+    if ( !this->para->md_switch_on )
+        return;
+    if ( this->para->md_target_sets.size() > 64 )
+    {
+        ERROR( "At most 64 target sets are supported for model analysis, but get %lu.",
+               this->para->md_target_sets.size() );
+    }
+
+    for ( size_t j = 0; j < this->para->md_target_sets.size(); ++j )
+        for ( auto& type : this->para->md_target_sets[ j ] )
+        {
+            // only the particle types of the model analysis are the candidates
+            if ( type < 0
+                 || std::find( this->para->md_particle_types.begin(),
+                               this->para->md_particle_types.end(), type )
+                        == this->para->md_particle_types.end() )
+                continue;
+            if ( ( size_t )type >= this->md_set_masks.size() )
+                this->md_set_masks.resize( type + 1, 0 );
+            this->md_set_masks[ type ] |= 1ULL << j;
+        }
+}
+
+// the region tests, the shape is a compile time constant so only one branch is left
+template < calculator::region_shape shape >
+inline bool calculator::in_region( double x, double y, double z, double size, double ratio )
+{
+    if ( shape == sphere )  // the same as ana::in_spheroid()
+        return x * x + y * y + z * z / ( ratio * ratio ) <= size * size;
+    else if ( shape == cylinder )  // the same as ana::in_cylinder()
+        return x * x + y * y <= size * size && z >= -size * ratio / 2 && z <= size * ratio / 2;
+    else  // box, the same as ana::in_box()
+        return x >= -size / 2 && x <= size / 2 && y >= -size / 2 && y <= size / 2
+               && z >= -size * ratio / 2 && z <= size * ratio / 2;
+}
+
+int calculator::select_md_targets( const galotfa::particle_view& view, vector< int* >& id_for_md,
+                                   vector< int >& part_num_md ) const
+{
+    switch ( this->model_region_shape )
+    {
+    case sphere:
+        return this->select_md_targets_in< sphere >( view, id_for_md, part_num_md );
+    case cylinder:
+        return this->select_md_targets_in< cylinder >( view, id_for_md, part_num_md );
+    default:
+        return this->select_md_targets_in< box >( view, id_for_md, part_num_md );
+    }
+}
+
+template < calculator::region_shape shape >
+int calculator::select_md_targets_in( const galotfa::particle_view& view,
+                                      vector< int* >& id_for_md, vector< int >& part_num_md ) const
+{
+    const int          type_num = ( int )this->md_set_masks.size();
+    const double       size     = this->para->md_region_size;
+    const double       ratio    = this->para->md_axis_ratio;
+    int                type     = 0;
+    unsigned long long mask     = 0;  // the sets which the particle belongs to
+    for ( int i = 0; i < view.size(); ++i )
+    {
+        type = view.type( i );
+        if ( type < 0 || type >= type_num || ( mask = this->md_set_masks[ type ] ) == 0 )
+            continue;
+        if ( !in_region< shape >( view.pos( i, 0 ) - this->system_center[ 0 ],
+                                  view.pos( i, 1 ) - this->system_center[ 1 ],
+                                  view.pos( i, 2 ) - this->system_center[ 2 ], size, ratio ) )
+            continue;
+        // append the particle to all its sets
+        for ( ; mask != 0; mask &= mask - 1 )
+        {
+            int j                                = __builtin_ctzll( mask );
+            id_for_md[ j ][ part_num_md[ j ]++ ] = i;
+        }
+    }
+    return 0;
+}
+
 galotfa::analysis_result* calculator::feedback() const
 {
     return this->ptrs_of_results;
 }
 
-bool calculator::is_target_of_pre( int& type, double& coordx, double& coordy, double& coordz ) const
+bool calculator::is_target_of_pre( int type, double coordx, double coordy, double coordz ) const
 {
     double offset[ 3 ] = { 0 };  // the offset w.r.t. the system centers
     offset[ 0 ]        = coordx - this->system_center[ 0 ];
@@ -679,7 +806,7 @@ bool calculator::is_target_of_pre( int& type, double& coordx, double& coordy, do
     return true;
 }
 
-bool calculator::is_target_of_md( int& type, double& coordx, double& coordy, double& coordz ) const
+bool calculator::is_target_of_md( int type, double coordx, double coordy, double coordz ) const
 {
     double offset[ 3 ] = { 0 };  // the offset w.r.t. the system centers
     offset[ 0 ]        = coordx - this->system_center[ 0 ];
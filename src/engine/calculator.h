@@ -4,6 +4,8 @@
 #define GALOTFA_ANALYSIS_ENGINE_H
 // include the prompt header and parameter header
 #include "../parameter/para.h"
+#include "../tools/arena.h"
+#include "../tools/id_hash.h"
 #include "../tools/prompt.h"
 // include the analysis modules
 #include "../analysis/group.h"
@@ -12,6 +14,7 @@
 #include "../analysis/particle.h"
 #include "../analysis/post.h"
 #include "../analysis/pre.h"
+#include "particle_view.h"
 // include the vector
 #include <complex>
 #include <vector>
@@ -23,8 +26,7 @@ using std::vector;
 // id, type, mass, coordinate, velocity, time, particle_number
 // and an optional potential tracer type
 #define md_args                                                             \
-    ( double masses[], double coordinates[][ 3 ], double velocities[][ 3 ], \
-      vector< int* >& id_for_md, vector< int >& part_num_md )
+    ( const galotfa::particle_view& view, vector< int* >& id_for_md, vector< int >& part_num_md )
 
 namespace galotfa {
 
@@ -42,15 +44,29 @@ struct analysis_result
     // N*3 bar radius:
     // N for multiple analysis sets, 3 for Rbar1, Rbar2, Rbar3 in Ghosh & Di Matteo 2023
     vector< vector< double > > bar_radius;
-    vector< double* >          images[ 8 ][ 3 ];
+    vector< analysis::histogram< double, 2 > > images[ 8 ][ 3 ];
     // First dimension are over possible images colors: number_density, surface_density,
     // mean_velocity axis1, mean_velocity axis2, mean_velocity axis3, velocity_dispersion axis1,
     // velocity_dispersion axis2, velocity_dispersion axis3 dispersion
     // their indexes are 0, 1, 2, 3, 4, 5, 6, 7
     // Second dimension: the three projections, x-y, x-z, y-z
-    // Third dimension: the pointer to the data
-    vector< double* > dispersion_tensor;  // the pointer to the dispersion tensor
-    vector< double* > inertia_tensor;     // the pointer to the inertia tensor
+    // Third dimension: the analysis sets, each image is in row-major order
+    // the dispersion tensor of each set: x, y, z bins and then the 3*3 components
+    vector< analysis::histogram< double, 4 > > dispersion_tensor;
+    // or only its occupied voxels if sparse_tensor is on: the ( x, y, z ) bin indexes of each voxel
+    // and its xx, xy, xz, yy, yz, zz components, only on the root process
+    vector< vector< long long > > tensor_voxels;
+    vector< vector< double > >    sparse_tensors;
+    vector< double* >                          inertia_tensor;  // the pointer to the inertia tensor
+    // orbit part, only on the root process: the ids of the tracked particles in ascending order,
+    // and their (x, y, z, vx, vy, vz) in the same order
+    vector< long long > orbit_ids;
+    vector< double >    orbits;
+    // particle part, local to each process: the ids of the target particles of each type, and
+    // their circularity and 3D circularity in the same order
+    vector< vector< long long > > particle_ids;
+    vector< vector< double > >    circularity;
+    vector< vector< double > >    circularity_3d;
 };
 
 
@@ -62,13 +78,46 @@ private:
     // results
     galotfa::para* para;                   // the parameter object
     mutable double system_center[ 3 ];     // the container of the system center
+    mutable bool   recentered = false;     // whether the system center has been found once
     double         convergence_threshold;  // the convergence threshold
-    enum method { center_of_mass, most_dense_pixel, most_bound_particle };  // the recenter method
+    // the recenter method
+    enum method { center_of_mass, most_dense_pixel, shrinking_sphere, most_bound_particle };
     enum region_shape { sphere, cylinder, box };  // the recenter region shape
     method                recenter_method;        // the recenter method
     region_shape          recenter_region_shape;  // the recenter region shape
     region_shape          model_region_shape;
+    unsigned int          max_order = 2;  // the highest order of An in the fused kernel
     analysis_result*      ptrs_of_results;
+    // the slots of the scratch arena: the buffers are reused by all the analysis sets and steps
+    enum scratch_slot {
+        slot_pre_ids,
+        slot_pre_mass,
+        slot_pre_coords,
+        slot_mass,
+        slot_x,
+        slot_y,
+        slot_z,
+        slot_vx,
+        slot_vy,
+        slot_vz,
+        slot_v1,  // the velocity components in the curvilinear coordinates
+        slot_v2,
+        slot_v3,
+        slot_orb_ids,
+        slot_orb_data,
+        slot_ptc_coords,
+        slot_ptc_vels,
+        slot_image,   // the pixel moments of the images
+        slot_tensor,  // the voxel moments of the dispersion tensor
+        slot_bar,     // the first of the ana::bar_slot_num slots of the bar radius
+        // the first of the ana::sparse_slot_num slots of the sparse tensor, so it's the last one
+        slot_sparse = slot_bar + analysis::bar_slot_num,
+    };
+    mutable galotfa::arena   scratch;
+    mutable galotfa::id_hash voxel_rows;  // the hash table of the local voxels of the sparse tensor
+    // the selection plan of the model analysis: bit j of md_set_masks[ type ] is set if the
+    // particles of the type belong to the j-th target set
+    vector< unsigned long long > md_set_masks;
     vector< std::string > colors;  // I dont't know why I need this, but if I don't use c copy,
                                    // the call of this->para->model_colors will dump core
 
@@ -77,20 +126,31 @@ private:
     // the analysis wrappers: call the analysis modules, and restore the results
     inline bool in_recenter_region() const;
     void        setup_res();
+    void        setup_plan();
+    int         shrink_recenter( const galotfa::particle_view& view ) const;
+    template < region_shape shape >
+    static inline bool in_region( double x, double y, double z, double size, double ratio );
+    template < region_shape shape >
+    int select_md_targets_in( const galotfa::particle_view& view, vector< int* >& id_for_md,
+                              vector< int >& part_num_md ) const;
 
 public:
     calculator( galotfa::para* parameter );
     ~calculator();
     galotfa::analysis_result* feedback() const;
-    bool is_target_of_pre( int& type, double& coordx, double& coordy, double& coordz ) const;
-    bool is_target_of_md( int& type, double& coordx, double& coordy, double& coordz ) const;
+    bool is_target_of_pre( int type, double coordx, double coordy, double coordz ) const;
+    bool is_target_of_md( int type, double coordx, double coordy, double coordz ) const;
+    // extract the array indexes of the targets of all the model analysis sets in one pass
+    int select_md_targets( const galotfa::particle_view& view, vector< int* >& id_for_md,
+                           vector< int >& part_num_md ) const;
     // the apis between the analysis engine and the real analysis codes
     // TODO: the version with the potential tracer for the following methods
-    int                call_pre_module( int& particle_num, int types[], double masses[],
-                                        double coordinates[][ 3 ] ) const;
+    int                call_pre_module( const galotfa::particle_view& view ) const;
     int call_md_module md_args const;
-    int                call_ptc_module() const;
-    int                call_orb_module() const;
+    int call_ptc_module( const galotfa::particle_view& view, vector< int* >& id_for_ptc,
+                         vector< int >& part_num_ptc ) const;
+    int call_orb_module( const galotfa::particle_view& view, int id_for_orb[],
+                         int part_num_orb ) const;
     int                call_grp_module() const;
     int                call_post_module() const;
 };
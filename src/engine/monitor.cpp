@@ -1,7 +1,10 @@
 #ifndef GALOTFA_MONITOR_CPP
 #define GALOTFA_MONITOR_CPP
 #include "monitor.h"
+#include "../tools/comm.h"
+#include <algorithm>
 #include <hdf5.h>
+#include <limits>
 #include <math.h>
 #include <mpi.h>
 #include <stdio.h>
@@ -10,6 +13,12 @@
 #include <unistd.h>
 
 namespace galotfa {
+// whether a module with the switch and the period runs at the step
+static inline bool is_due( bool switch_on, int period, unsigned long long step )
+{
+    return switch_on && step % period == 0;
+}
+
 monitor::monitor( void )
 {
     // check and ensure MPI is initialized
@@ -19,7 +28,10 @@ monitor::monitor( void )
         ERROR( "Failed to check MPI initialization status." );
     }
     else if ( !this->mpi_init_before_galotfa )
-        MPI_Init( NULL, NULL );
+    {
+        int provided = 0;  // the worker thread of the async mode calls MPI as well
+        MPI_Init_thread( NULL, NULL, MPI_THREAD_MULTIPLE, &provided );
+    }
 
     // get the rank and size of the MPI process
     MPI_Comm_rank( MPI_COMM_WORLD, &( this->galotfa_rank ) );
@@ -33,6 +45,135 @@ monitor::monitor( void )
         this->init();  // create the output directory and the output files
         // create and start the virtual calc's calculator
         this->calc = new galotfa::calculator( this->para );
+        if ( this->para->glb_async )
+            this->start_worker();
+
+        // the static monitor of the C API is destroyed after MPI_Finalize(), so the buffered
+        // results and the analysis in flight are finished in it, while MPI is still functional
+        MPI_Comm_create_keyval( MPI_COMM_NULL_COPY_FN, monitor::finish_at_finalize,
+                                &this->finalize_keyval, nullptr );
+        MPI_Comm_set_attr( MPI_COMM_SELF, this->finalize_keyval, this );
+    }
+}
+
+void monitor::start_worker()
+{
+    int provided = MPI_THREAD_SINGLE;
+    MPI_Query_thread( &provided );
+    if ( provided < MPI_THREAD_MULTIPLE )
+    {
+        WARN( "The async mode needs MPI initialized with MPI_THREAD_MULTIPLE, galotfa will run "
+              "synchronously." );
+        return;
+    }
+
+    // the types of the particles to be copied into the snapshots
+    auto mark = [ this ]( const vector< int >& types, unsigned char module ) {
+        for ( auto& type : types )
+        {
+            if ( type < 0 )
+                continue;
+            if ( type >= ( int )this->snapshot_modules.size() )
+                this->snapshot_modules.resize( type + 1, 0 );
+            this->snapshot_modules[ type ] |= module;
+        }
+    };
+    mark( this->para->pre_recenter_anchors, 1 );
+    if ( this->para->md_switch_on )
+        for ( auto& types : this->para->md_target_sets )
+            mark( types, 2 );
+    if ( this->para->ptc_switch_on )
+        mark( this->para->ptc_particle_types, 4 );
+
+    // the analysis collectives run on their own communicator, so they never match the ones of
+    // the simulation, and the worker is stopped in finish()
+    MPI_Comm_dup( MPI_COMM_WORLD, &this->async_comm );
+    galotfa::comm::set( this->async_comm );
+
+    this->async  = true;
+    this->worker = std::thread( &monitor::work, this );
+}
+
+int monitor::finish_at_finalize( MPI_Comm comm, int keyval, void* attr, void* extra )
+{
+    // MPI_Finalize() frees MPI_COMM_SELF first, while MPI is still fully functional
+    ( void )comm;
+    ( void )keyval;
+    ( void )extra;
+    ( ( monitor* )attr )->finish();
+    return MPI_SUCCESS;
+}
+
+void monitor::finish()
+{
+    if ( this->worker.joinable() )
+    {
+        {
+            std::lock_guard< std::mutex > lock( this->job_mutex );
+            this->stop_worker = true;
+        }
+        this->job_cond.notify_all();
+        this->worker.join();  // the worker finishes the pending job before it stops
+        if ( this->job_code != 0 )
+            WARN( "Failed to save the analysis results of the last step." );
+
+        // the later steps, if any, run synchronously
+        galotfa::comm::set( MPI_COMM_WORLD );
+        MPI_Comm_free( &this->async_comm );
+        this->async = false;
+    }
+    this->flush();
+    // the particle file may be shared by all the processes, so it's closed while MPI is still
+    // functional
+    if ( this->writers.particle_writer != nullptr )
+    {
+        delete this->writers.particle_writer;
+        this->writers.particle_writer = nullptr;
+    }
+}
+
+int monitor::flush()
+{
+    if ( this->async )
+    {
+        // the writers are owned by the worker until it's idle, and it stays idle until the next
+        // call of run_with() from this thread
+        std::unique_lock< std::mutex > lock( this->job_mutex );
+        this->job_cond.wait( lock, [ this ] { return !this->job_pending; } );
+    }
+
+    int return_code = 0;
+    for ( auto& writer : this->writers.model_writers )
+        if ( writer != nullptr )  // the files of the other processes
+            return_code += writer->flush();
+    for ( auto& writer : this->writers.group_writers )
+        return_code += writer->flush();
+    if ( this->writers.particle_writer != nullptr )
+        return_code += this->writers.particle_writer->flush();
+    if ( this->writers.orbit_writer != nullptr )
+        return_code += this->writers.orbit_writer->flush();
+    return return_code > 0 ? 1 : 0;
+}
+
+void monitor::work()
+{
+    std::unique_lock< std::mutex > lock( this->job_mutex );
+    while ( true )
+    {
+        this->job_cond.wait( lock, [ this ] { return this->job_pending || this->stop_worker; } );
+        if ( !this->job_pending )  // stop after the pending job
+            return;
+
+        this->step                  = this->job_step;
+        this->time                  = this->job_time;
+        galotfa::particle_view view = this->snapshots[ this->job_buffer ].view();
+        lock.unlock();
+        int return_code = this->analyze( view );
+        lock.lock();
+
+        this->job_code    = return_code;
+        this->job_pending = false;
+        this->job_cond.notify_all();
     }
 }
 
@@ -52,21 +193,58 @@ void monitor::init()
         }
         this->create_writers();
     }
+    if ( this->para->md_switch_on )
+        this->create_model_writers();
+    if ( this->para->ptc_switch_on )
+        this->create_particle_writer();
     // extend the size of the members
     if ( this->para->md_switch_on )
     {
         this->id_for_model.resize( this->para->md_target_sets.size(), nullptr );
         this->part_num_model.resize( this->para->md_target_sets.size(), 0 );
     }
+    if ( this->para->orb_switch_on )
+    {
+        // the id list is read by the root process in create_writers(), and broadcast as the
+        // ranges of consecutive ids
+        long long range_num = ( long long )this->orbit_id_ranges.size();
+        MPI_Bcast( &range_num, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD );
+        this->orbit_id_ranges.resize( range_num );
+        MPI_Bcast( this->orbit_id_ranges.data(), 2 * range_num, MPI_LONG_LONG, 0,
+                   MPI_COMM_WORLD );
+        if ( !this->is_root() )
+            this->expand_orbit_ids();
+        this->orbit_id_index.build( this->orbit_log_ids.data(), this->orbit_log_ids.size() );
+    }
     if ( this->para->ptc_switch_on )
     {
         this->id_for_particle.resize( this->para->ptc_particle_types.size(), nullptr );
         this->part_num_particle.resize( this->para->ptc_particle_types.size(), 0 );
+        // the lookup table from the particle type to its index, the first one wins
+        for ( int j = ( int )this->para->ptc_particle_types.size() - 1; j >= 0; --j )
+        {
+            int type = this->para->ptc_particle_types[ j ];
+            if ( type < 0 )
+                continue;
+            if ( type >= ( int )this->ptc_slot_of_type.size() )
+                this->ptc_slot_of_type.resize( type + 1, -1 );
+            this->ptc_slot_of_type[ type ] = j;
+        }
     }
 }
 
 monitor::~monitor()
 {
+    int mpi_finalized = 0;
+    MPI_Finalized( &mpi_finalized );
+    if ( this->finalize_keyval != MPI_KEYVAL_INVALID && !mpi_finalized )
+    {
+        // the host destroys galotfa before MPI_Finalize(): finish it now
+        MPI_Comm_delete_attr( MPI_COMM_SELF, this->finalize_keyval );
+        MPI_Comm_free_keyval( &this->finalize_keyval );
+    }
+    this->finish();
+
     if ( this->calc != nullptr )
     {
         delete this->calc;
@@ -118,10 +296,10 @@ int monitor::create_writers()
 
     // create the files for each analysis set
     this->create_files();
+    if ( this->writers.orbit_writer != nullptr )
+        this->writers.orbit_writer->set_flush_rows( this->para->glb_flush_rows );
 
     // create the datasets in each file
-    if ( this->para->md_switch_on )
-        this->create_model_file_datasets();
     if ( this->para->orb_switch_on )
         this->create_orbit_file_datasets();
     if ( this->para->grp_switch_on )
@@ -136,181 +314,280 @@ inline void monitor::create_files()
     // NOTE: this function will access the hdf5 files, so it should be called by the root process
     // Besides, it should be called only when galotfa is enabled (para->glb_switch_on == true)
 
-    if ( this->para->md_switch_on )
-    {
-        if ( this->para->md_multiple )
-        {
-            for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
-            {
-                std::string prefix = "set" + std::to_string( i + 1 ) + "_";
-
-                std::string file =
-                    this->para->glb_output_dir + "/" + prefix + this->para->md_filename;
-
-                galotfa::writer* writer = new galotfa::writer( file.c_str() );
-                this->writers.model_writers.push_back( writer );
-            }
-        }
-        else
-        {
-            std::string file = this->para->glb_output_dir + "/" + this->para->md_filename;
-
-            galotfa::writer* writer = new galotfa::writer( file.c_str() );
-            this->writers.model_writers.push_back( writer );
-        }
-    }
-
-    if ( this->para->ptc_switch_on )
-    {
-        std::string      file         = this->para->glb_output_dir + "/" + this->para->ptc_filename;
-        galotfa::writer* writer       = new galotfa::writer( file.c_str() );
-        this->writers.particle_writer = writer;
-    }
-
     if ( this->para->orb_switch_on )
     {
         std::string      file      = this->para->glb_output_dir + "/" + this->para->orb_filename;
         galotfa::writer* writer    = new galotfa::writer( file.c_str() );
+        writer->set_filters( this->output_filters() );
         this->writers.orbit_writer = writer;
     }
     // TODO: the file of group analysis
 }
 
+inline galotfa::hdf5::filters monitor::output_filters( int scale_digits ) const
+{
+    galotfa::hdf5::filters filters;
+    filters.scale_digits = scale_digits;
+    filters.shuffle      = this->para->glb_shuffle;
+    filters.deflate      = this->para->glb_deflate;
+    return filters;
+}
+
+inline void monitor::create_model_writers()
+{
+    // with multiple target sets, the file of each set is owned by a process in round-robin, which
+    // gets the images and tensors of the set in their reductions, and writes the file alone, so
+    // the sets are written in parallel; otherwise the only model file is owned by the root process
+    MPI_Barrier( MPI_COMM_WORLD );  // the output directory is created by the root process
+    size_t file_num = this->para->md_multiple ? this->para->md_target_sets.size() : 1;
+    for ( size_t i = 0; i < file_num; ++i )
+    {
+        int owner = this->para->md_multiple ? galotfa::comm::owner( i ) : 0;
+        if ( owner != this->galotfa_rank )
+        {
+            this->writers.model_writers.push_back( nullptr );
+            continue;
+        }
+        std::string prefix = this->para->md_multiple ? "set" + std::to_string( i + 1 ) + "_" : "";
+        std::string file   = this->para->glb_output_dir + "/" + prefix + this->para->md_filename;
+        galotfa::writer* writer = new galotfa::writer( file.c_str() );
+        writer->set_flush_rows( this->para->glb_flush_rows );
+        writer->set_filters( this->output_filters() );
+        this->writers.model_writers.push_back( writer );
+    }
+    this->create_model_file_datasets();
+}
+
+inline void monitor::create_particle_writer()
+{
+    // the particle file is shared by all the processes with MPI-IO, so each process writes its
+    // own particles, or it's written by the root process if HDF5 has no parallel support
+    std::string file = this->para->glb_output_dir + "/" + this->para->ptc_filename;
+#ifdef H5_HAVE_PARALLEL
+    MPI_Barrier( MPI_COMM_WORLD );  // the output directory is created by the root process
+    this->writers.particle_writer = new galotfa::writer( file.c_str(), MPI_COMM_WORLD );
+#else
+    if ( !this->is_root() )
+        return;
+    this->writers.particle_writer = new galotfa::writer( file.c_str() );
+#endif
+    this->writers.particle_writer->set_flush_rows( this->para->glb_flush_rows );
+    this->writers.particle_writer->set_filters( this->output_filters() );
+}
+
 int monitor::save()
 {
     // this function mock you press a button to save the data on the monitor dashboard
     // so it should only be called by the run_with() function
-    int return_code = 0;
-    if ( this->is_root() && this->need_ana() )
-    {
-        galotfa::analysis_result* res = this->calc->feedback();  // get the analysis results
-        int                       i   = 0;  // index of the target model analysis sets
-        if ( this->need_ana_model() )
-            for ( auto& single_model : this->writers.model_writers )
+    int                       return_code = 0;
+    galotfa::analysis_result* res         = this->calc->feedback();  // get the analysis results
+    if ( this->need_ana_model() )
+        // each model file is written by its owner, see create_model_writers()
+        for ( size_t i = 0; i < this->writers.models.size(); ++i )
+        {
+            if ( this->writers.model_writers[ i ] == nullptr )
+                continue;
+            model_channels& channels = this->writers.models[ i ];
+            // the scalars are appended into their datasets one by one, or gathered into one
+            // row of the scalar table, in the same order as its columns
+            channels.row.clear();
+            auto scalar = [ & ]( channel< double >& target, const double* value, int width ) {
+                if ( this->para->md_scalar_table )
+                    channels.row.insert( channels.row.end(), value, value + width );
+                else
+                    target.append( value );
+            };
+            scalar( channels.times, &this->time, 1 );
+            if ( this->para->pre_recenter )
+                scalar( channels.center, res->system_center, 3 );
+            if ( this->para->md_bar_major_axis )
+                scalar( channels.major_axis, &res->bar_major_axis[ i ], 1 );
+            if ( this->para->md_sbar )
+                scalar( channels.sbar, &res->s_bar[ i ], 1 );
+            if ( this->para->md_sbuckle )
+                scalar( channels.sbuckle, &res->s_buckle[ i ], 1 );
+            for ( size_t j = 0; j < this->para->md_an.size(); ++j )
+            {
+                auto   m    = this->para->md_an[ j ];
+                double real = res->Ans[ m ][ i ].real();
+                double imag = res->Ans[ m ][ i ].imag();
+                scalar( channels.an_real[ j ], &real, 1 );
+                scalar( channels.an_imag[ j ], &imag, 1 );
+            }
+            if ( this->para->md_bar_radius )
+                for ( int n = 0; n < 3; ++n )
+                    scalar( channels.radius[ n ], &res->bar_radius[ i ][ n ], 1 );
+            if ( this->para->md_scalar_table )
+                channels.scalars.append( channels.row.data() );
+
+            if ( this->para->md_image )
+                // the images are appended in place, only those of the enabled colors
+                for ( int k = 0; k < 8; ++k )
+                    for ( int p = 0; p < 3; ++p )
+                        if ( channels.images[ k ][ p ].valid() )
+                            channels.images[ k ][ p ].append( res->images[ k ][ p ][ i ].data() );
+            if ( this->para->md_dispersion_tensor && this->para->md_sparse_tensor )
             {
-                single_model->push< double >( &this->time, 1, "/Times" );
-
-                if ( this->para->pre_recenter )
-                    single_model->push< double >( res->system_center, 3, "/Center" );
-                if ( this->para->md_bar_major_axis )
-                    single_model->push< double >( &res->bar_major_axis[ i ], 1, "/Bar/MajorAxis" );
-                if ( this->para->md_sbar )
-                    single_model->push< double >( &res->s_bar[ i ], 1, "/Bar/SBar" );
-                if ( this->para->md_sbuckle )
-                    single_model->push< double >( &res->s_buckle[ i ], 1, "/Bar/SBuckle" );
-                if ( this->para->md_an.size() > 0 )
-                    for ( auto& m : this->para->md_an )
-                    {
-                        double real = res->Ans[ m ][ i ].real();
-                        double imag = res->Ans[ m ][ i ].real();
-                        single_model->push< double >( &real, 1,
-                                                      "/Bar/A" + std::to_string( m ) + "(real)" );
-                        single_model->push< double >( &imag, 1,
-                                                      "/Bar/A" + std::to_string( m ) + "(imag)" );
-                    }
-                if ( this->para->md_bar_radius )
-                {
-                    single_model->push< double >( &res->bar_radius[ i ][ 0 ], 1, "/Bar/Radius1" );
-                    single_model->push< double >( &res->bar_radius[ i ][ 1 ], 1, "/Bar/Radius2" );
-                    single_model->push< double >( &res->bar_radius[ i ][ 2 ], 1, "/Bar/Radius3" );
-                }
-
-                if ( this->para->md_image )
-                {
-                    unsigned long binnum = this->para->md_image_bins;
-                    for ( auto& color : this->para->md_colors )
-                    {
-                        if ( color == "number_density" )
-                        {
-                            single_model->push< double >( res->images[ 0 ][ 0 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(xy)" );
-                            single_model->push< double >( res->images[ 0 ][ 1 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(xz)" );
-                            single_model->push< double >( res->images[ 0 ][ 2 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(yz)" );
-                        }
-                        else if ( color == "surface_density" )
-                        {
-                            single_model->push< double >( res->images[ 1 ][ 0 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(xy)" );
-                            single_model->push< double >( res->images[ 1 ][ 1 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(xz)" );
-                            single_model->push< double >( res->images[ 1 ][ 2 ][ i ],
-                                                          binnum * binnum,
-                                                          "/Image/" + color + "(yz)" );
-                        }
-                        else if ( color == "mean_velocity" )
-                        {
-                            for ( int n = 0; n < 3; ++n )
-                            {
-                                single_model->push< double >(
-                                    res->images[ 2 + n ][ 0 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(xy)" );
-                                single_model->push< double >(
-                                    res->images[ 2 + n ][ 1 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(yz)" );
-                                single_model->push< double >(
-                                    res->images[ 2 + n ][ 2 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(yz)" );
-                            }
-                        }
-                        else  // ( color == "velocity_dispersion" )
-                        {
-                            for ( int n = 0; n < 3; ++n )
-                            {
-                                single_model->push< double >(
-                                    res->images[ 5 + n ][ 0 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(xy)" );
-                                single_model->push< double >(
-                                    res->images[ 5 + n ][ 1 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(yz)" );
-                                single_model->push< double >(
-                                    res->images[ 5 + n ][ 2 ][ i ], binnum * binnum,
-                                    "/Image/" + color + "_axis_" + std::to_string( n + 1 )
-                                        + "(yz)" );
-                            }
-                        }
-                    }
-                }
-                if ( this->para->md_dispersion_tensor )
-                {
-                    unsigned long binnum = this->para->md_image_bins;
-                    unsigned long binnum_third =
-                        ( unsigned long )this->para->md_image_bins * this->para->md_axis_ratio;
-                    single_model->push< double >( res->dispersion_tensor[ i ],
-                                                  binnum * binnum * binnum_third * 3 * 3,
-                                                  "/DispersionTensor", 5 );
-                }
-                if ( this->para->md_inertia_tensor )
-                {
-                    single_model->push< double >( res->inertia_tensor[ i ], 9, "/InertiaTensor" );
-                }
-                ++i;
+                long long voxel_number = ( long long )res->sparse_tensors[ i ].size() / 6;
+                channels.voxel_number.append( &voxel_number );
+                channels.voxels.append_rows( res->tensor_voxels[ i ].data(), voxel_number );
+                channels.tensors.append_rows( res->sparse_tensors[ i ].data(), voxel_number );
             }
+            else if ( this->para->md_dispersion_tensor )
+                channels.dispersion_tensor.append( res->dispersion_tensor[ i ].data() );
+            if ( this->para->md_inertia_tensor )
+                channels.inertia_tensor.append( res->inertia_tensor[ i ] );
+        }
+
+    // the orbits are gathered to the root process
+    if ( this->is_root() && this->need_log_orbit() )
+    {
+        // both the gathered particles and the rows are sorted by the ids, so merge them in
+        // one pass, and the particles not found in the simulation are filled with NaN
+        this->orbit_rows.assign( 6 * ( size_t )this->orbit_part_num,
+                                 std::numeric_limits< double >::quiet_NaN() );
+        size_t row = 0;
+        for ( size_t j = 0; j < res->orbit_ids.size(); ++j )
+        {
+            while ( row < this->orbit_log_ids.size()
+                    && this->orbit_log_ids[ row ] < res->orbit_ids[ j ] )
+                ++row;
+            if ( row < this->orbit_log_ids.size()
+                 && this->orbit_log_ids[ row ] == res->orbit_ids[ j ] )
+                std::copy( &res->orbits[ 6 * j ], &res->orbits[ 6 * j ] + 6,
+                           &this->orbit_rows[ 6 * row ] );
+        }
+        // one hyperslab for all the tracked particles
+        this->writers.orbit.times.append( &this->time );
+        this->writers.orbit.orbits.append( this->orbit_rows.data() );
     }
 
-    MPI_Bcast( &return_code, 1, MPI_INT, 0, MPI_COMM_WORLD );
+    if ( this->need_ana_particle() && !this->ptc_totals.empty() )
+        return_code += this->save_particles();
+
+    MPI_Allreduce( MPI_IN_PLACE, &return_code, 1, MPI_INT, MPI_MAX, galotfa::comm::current() );
     // make all the MPI processes return the same value
     return return_code;
 }
 
+int monitor::save_particles()
+{
+    // each row of the particle file is the particles of all the processes in the rank order, so
+    // the rows of different steps should be matched by /PartType*/ParticleIDs, unless the particles
+    // are sorted by their IDs across the processes at first
+    galotfa::analysis_result* res         = this->calc->feedback();
+    int                       return_code = 0;
+    // check the particle numbers of all the types at first, and skip the whole step, including
+    // /Times, if any of them is changed, so the rows of all the datasets are still aligned
+    vector< unsigned long > sums( this->ptc_totals.size() );
+    for ( size_t i = 0; i < sums.size(); ++i )
+        sums[ i ] = res->particle_ids[ i ].size();
+    MPI_Allreduce( MPI_IN_PLACE, sums.data(), ( int )sums.size(), MPI_UNSIGNED_LONG, MPI_SUM,
+                   galotfa::comm::current() );
+    for ( size_t i = 0; i < sums.size(); ++i )
+    {
+        if ( sums[ i ] == this->ptc_totals[ i ] )
+            continue;
+        // e.g. the particles are created or removed by the simulation
+        if ( this->is_root() )
+            WARN( "Get %lu particles of type %d, but the particle file has %lu per row, skip the "
+                  "step at time %g.",
+                  sums[ i ], this->para->ptc_particle_types[ i ], this->ptc_totals[ i ],
+                  this->time );
+        return 1;
+    }
+    // the time is only given by the root process, at the beginning of the row
+    return_code += this->push_distributed( &this->time, this->is_root() ? 1 : 0, 0, 1, "/Times" );
+    for ( size_t i = 0; i < this->ptc_totals.size(); ++i )
+    {
+        if ( this->ptc_totals[ i ] == 0 )
+            continue;
+        int              type   = this->para->ptc_particle_types[ i ];
+        std::string      prefix = "/PartType" + std::to_string( type );
+        unsigned long    len    = res->particle_ids[ i ].size();
+        unsigned long    total  = this->ptc_totals[ i ];
+        const long long* ids    = res->particle_ids[ i ].data();
+        if ( this->para->ptc_sort_by_id )
+        {
+            this->ptc_sorter.plan( ids, len, galotfa::comm::current() );
+            ids = this->ptc_sorter.ids();
+            len = this->ptc_sorter.size();
+        }
+        // the elements of this process are placed after those of the lower ranks, which is the
+        // same for all the datasets of this type
+        unsigned long offset = 0;
+        MPI_Exscan( &len, &offset, 1, MPI_UNSIGNED_LONG, MPI_SUM, galotfa::comm::current() );
+        if ( this->is_root() )
+            offset = 0;  // the result of MPI_Exscan is undefined on the first process
+        // push a result of the particles, in the sorted order if required
+        auto push = [ & ]( vector< double >& values, const std::string& name ) {
+            double* ptr = values.data();
+            if ( this->para->ptc_sort_by_id )
+            {
+                this->ptc_sorter.apply( ptr, this->ptc_sorted );
+                ptr = this->ptc_sorted.data();
+            }
+            return this->push_distributed( ptr, len, offset, total, prefix + name );
+        };
+        return_code +=
+            this->push_distributed( ids, len, offset, total, prefix + "/ParticleIDs" );
+        if ( this->para->ptc_circularity )
+            return_code += push( res->circularity[ i ], "/Circularity" );
+        if ( this->para->ptc_circularity_3d )
+            return_code += push( res->circularity_3d[ i ], "/Circularity3D" );
+    }
+    return return_code > 0 ? 1 : 0;
+}
+
+template < typename T >
+int monitor::push_distributed( const T* ptr, unsigned long len, unsigned long offset,
+                               unsigned long total, const std::string& dataset_name )
+{
+    // the global length is checked by the caller, i.e. the sum of len is total
+#ifdef H5_HAVE_PARALLEL
+    return this->writers.particle_writer->push_slab( ( T* )ptr, len, offset, dataset_name );
+#else
+    // the row is gathered to the root process, which writes it at once
+    MPI_Comm     comm = galotfa::comm::current();
+    MPI_Datatype element;
+    MPI_Type_contiguous( ( int )sizeof( T ), MPI_BYTE, &element );
+    MPI_Type_commit( &element );
+    int            count  = ( int )len;
+    vector< int >& counts = this->ptc_counts;  // only used on the root, kept across the steps
+    vector< int >& displs = this->ptc_displs;
+    if ( this->is_root() )
+    {
+        counts.resize( this->galotfa_size );
+        displs.assign( this->galotfa_size, 0 );
+        this->ptc_row.resize( total * sizeof( T ) );
+    }
+    MPI_Gather( &count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm );
+    for ( int r = 1; r < ( int )displs.size(); ++r )
+        displs[ r ] = displs[ r - 1 ] + counts[ r - 1 ];
+    MPI_Gatherv( ptr, count, element, this->ptc_row.data(), counts.data(), displs.data(), element,
+                 0, comm );
+    MPI_Type_free( &element );
+    ( void )offset;
+    if ( !this->is_root() )
+        return 0;
+    return this->writers.particle_writer->push_slab( ( T* )this->ptc_row.data(), total, 0,
+                                                     dataset_name );
+#endif
+}
+
 
 inline void monitor::create_model_file_datasets()
 {
     // this function should be called only when the model file is enabled
-    // again, it should be called by the root process
+    // again, it should be called by all the processes, and each one creates the datasets of its
+    // own files, with the invalid channels for the others
     for ( auto& single_model : this->writers.model_writers )
     {
+        this->writers.models.emplace_back();
+        model_channels& channels = this->writers.models.back();
+        if ( single_model == nullptr )
+            continue;
+
         // the size of the datasets
         galotfa::hdf5::size_info single_scaler_info = { H5T_NATIVE_DOUBLE,
                                                         1,
@@ -321,99 +598,113 @@ inline void monitor::create_model_file_datasets()
         size_t binnum       = ( size_t )this->para->md_image_bins;
         size_t binnum_third = ( size_t )this->para->md_image_bins * this->para->md_axis_ratio;
         galotfa::hdf5::size_info image_info = { H5T_NATIVE_DOUBLE, 2, { binnum, binnum } };
+        // for the x-z and y-z images
+        galotfa::hdf5::size_info image_info_third = { H5T_NATIVE_DOUBLE,
+                                                      2,
+                                                      { binnum, binnum_third } };
         // for tensor
         // 5 dimensions: x, y, z, (i, j) of the tensor
         galotfa::hdf5::size_info dispersion_tensor_info = {
             H5T_NATIVE_DOUBLE, 5, { binnum, binnum, binnum_third, 3, 3 }
         };
         galotfa::hdf5::size_info inertia_tensor_info = { H5T_NATIVE_DOUBLE, 2, { 3, 3 } };
+        // the lossy scale-offset filter turns NaN into a number, so it's only for the datasets
+        // without NaN: the density images and the tensors of the occupied voxels, while the
+        // velocity images and the dense tensor with NaN in the empty bins are written lossless
+        auto image_filters  = this->output_filters( this->para->md_image_digits );
+        auto tensor_filters = this->output_filters( this->para->md_tensor_digits );
 
-        single_model->create_dataset( "/Times", single_scaler_info );
+        // the scalars are in their own datasets, or the columns of the /Scalars table named
+        // by the paths of the datasets, in the same order as they are appended in save()
+        vector< galotfa::hdf5::column > columns;
+        auto scalar = [ & ]( channel< double >& target, std::string name, unsigned int width ) {
+            if ( this->para->md_scalar_table )
+                columns.push_back( { name, width } );
+            else
+                target = single_model->create_channel< double >(
+                    "/" + name, width == 1 ? single_scaler_info : single_vector_info );
+        };
+        scalar( channels.times, "Times", 1 );
         if ( this->para->pre_recenter )
-            single_model->create_dataset( "/Center", single_vector_info );
+            scalar( channels.center, "Center", 3 );
         if ( this->para->md_bar_major_axis )
-            single_model->create_dataset( "/Bar/MajorAxis", single_scaler_info );
-        if ( this->para->md_bar_radius )
-        {
-            single_model->create_dataset( "/Bar/Radius1", single_scaler_info );
-            single_model->create_dataset( "/Bar/Radius2", single_scaler_info );
-            single_model->create_dataset( "/Bar/Radius3", single_scaler_info );
-        }
+            scalar( channels.major_axis, "Bar/MajorAxis", 1 );
         if ( this->para->md_sbar )
-            single_model->create_dataset( "/Bar/SBar", single_scaler_info );
+            scalar( channels.sbar, "Bar/SBar", 1 );
         if ( this->para->md_sbuckle )
-            single_model->create_dataset( "/Bar/SBuckle", single_scaler_info );
-        if ( this->para->md_an.size() > 0 )
-            for ( auto& m : this->para->md_an )
-            {
-                single_model->create_dataset( "/Bar/A" + std::to_string( m ) + "(real)",
-                                              single_scaler_info );
-                single_model->create_dataset( "/Bar/A" + std::to_string( m ) + "(imag)",
-                                              single_scaler_info );
-            }
+            scalar( channels.sbuckle, "Bar/SBuckle", 1 );
+        channels.an_real.resize( this->para->md_an.size() );
+        channels.an_imag.resize( this->para->md_an.size() );
+        for ( size_t j = 0; j < this->para->md_an.size(); ++j )
+        {
+            std::string an = "Bar/A" + std::to_string( this->para->md_an[ j ] );
+            scalar( channels.an_real[ j ], an + "(real)", 1 );
+            scalar( channels.an_imag[ j ], an + "(imag)", 1 );
+        }
+        if ( this->para->md_bar_radius )
+            for ( int n = 0; n < 3; ++n )
+                scalar( channels.radius[ n ], "Bar/Radius" + std::to_string( n + 1 ), 1 );
+        if ( this->para->md_scalar_table )
+            channels.scalars = single_model->create_table( "/Scalars", columns );
         if ( this->para->md_image )
         {
+            // the names of the images, in the order of analysis_result::images
+            const char* projections[ 3 ] = { "(xy)", "(xz)", "(yz)" };
             for ( auto& color : this->para->md_colors )
             {
+                vector< std::pair< int, std::string > > images;  // ( index, name ) of the images
                 if ( color == "number_density" )
-                {
-                    single_model->create_dataset( "/Image/" + color + "(xy)", image_info );
-                    single_model->create_dataset( "/Image/" + color + "(xz)", image_info );
-                    single_model->create_dataset( "/Image/" + color + "(yz)", image_info );
-                }
+                    images.push_back( { 0, color } );
                 else if ( color == "surface_density" )
-                {
-                    single_model->create_dataset( "/Image/" + color + "(xy)", image_info );
-                    single_model->create_dataset( "/Image/" + color + "(xz)", image_info );
-                    single_model->create_dataset( "/Image/" + color + "(yz)", image_info );
-                }
-                else if ( color == "mean_velocity" )
-                {
-                    for ( int n = 0; n < 3; ++n )
-                    {
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(xy)",
-                                                      image_info );
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(xz)",
-                                                      image_info );
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(yz)",
-                                                      image_info );
-                    }
-                }
-                else  // ( color == "velocity_dispersion" )
-                {
+                    images.push_back( { 1, color } );
+                else  // mean_velocity or velocity_dispersion, for each axis
                     for ( int n = 0; n < 3; ++n )
-                    {
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(xy)",
-                                                      image_info );
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(xz)",
-                                                      image_info );
-                        single_model->create_dataset( "/Image/" + color + "_axis_"
-                                                          + std::to_string( n + 1 ) + "(yz)",
-                                                      image_info );
-                    }
-                }
+                        images.push_back( { ( color == "mean_velocity" ? 2 : 5 ) + n,
+                                            color + "_axis_" + std::to_string( n + 1 ) } );
+                for ( auto& image : images )
+                    for ( int p = 0; p < 3; ++p )
+                        if ( !channels.images[ image.first ][ p ].valid() )
+                            channels.images[ image.first ][ p ] =
+                                single_model->create_channel< double >(
+                                    "/Image/" + image.second + projections[ p ],
+                                    p == 0 ? image_info : image_info_third, 1000,
+                                    image.first < 2 ? &image_filters : nullptr );
             }
         }
 
-        if ( this->para->md_dispersion_tensor )
-            single_model->create_dataset( "/DispersionTensor", dispersion_tensor_info, 5 );
+        // for the occupied voxels of the sparse dispersion tensor, appended over the steps
+        galotfa::hdf5::size_info voxel_number_info = { H5T_NATIVE_LLONG, 1, { 1 } };
+        galotfa::hdf5::size_info voxel_info        = { H5T_NATIVE_LLONG, 1, { 3 } };
+        galotfa::hdf5::size_info voxel_tensor_info = { H5T_NATIVE_DOUBLE, 1, { 6 } };
+
+        if ( this->para->md_dispersion_tensor && this->para->md_sparse_tensor )
+        {
+            channels.voxel_number = single_model->create_channel< long long >(
+                "/DispersionTensor/VoxelNumber", voxel_number_info );
+            channels.voxels = single_model->create_channel< long long >(
+                "/DispersionTensor/Voxels", voxel_info, 4096 );
+            channels.tensors = single_model->create_channel< double >(
+                "/DispersionTensor/Tensors", voxel_tensor_info, 4096, &tensor_filters );
+        }
+        else if ( this->para->md_dispersion_tensor )
+            // use a smaller chunk size to avoid the memory error
+            channels.dispersion_tensor = single_model->create_channel< double >(
+                "/DispersionTensor", dispersion_tensor_info, 5 );
         if ( this->para->md_inertia_tensor )
-            single_model->create_dataset( "/InertiaTensor", inertia_tensor_info );
-        // use a smaller chunk size to avoid the memory error
+            channels.inertia_tensor =
+                single_model->create_channel< double >( "/InertiaTensor", inertia_tensor_info );
     }
 }
 
 void monitor::create_particle_file_datasets( vector< unsigned long >& particle_ana_nums )
 {
     // this function should be called only when the particle file is enabled
-    // again, it should be called by the root process
+    // again, it should be called by all the processes sharing the file, or the root process
     // NOTE: due to the particle number of target particels is unknown, so the datasets should be
     // created in the first call of `run_with(...)`
+    // each row has all the target particles of a type, so a chunk is one row
+    galotfa::hdf5::size_info single_scaler_info = { H5T_NATIVE_DOUBLE, 1, { 1 } };
+    this->writers.particle_writer->create_dataset( "/Times", single_scaler_info, 1 );
     for ( size_t i = 0; i < this->para->ptc_particle_types.size(); ++i )
     {
         if ( particle_ana_nums[ i ] == 0 )  // if there is no target particle, just ignore it
@@ -422,21 +713,19 @@ void monitor::create_particle_file_datasets( vector< unsigned long >& particle_a
         galotfa::hdf5::size_info scalers_info = { H5T_NATIVE_DOUBLE,
                                                   1,
                                                   { particle_ana_nums[ i ] } };
+        galotfa::hdf5::size_info id_info      = { H5T_NATIVE_LLONG, 1, { particle_ana_nums[ i ] } };
         std::string prefix = "/PartType" + std::to_string( this->para->ptc_particle_types[ i ] );
+        this->writers.particle_writer->create_dataset( prefix + "/ParticleIDs", id_info, 1 );
         if ( this->para->ptc_circularity )
         {
-            this->writers.particle_writer->create_dataset( prefix + "/Circularity", scalers_info );
+            this->writers.particle_writer->create_dataset( prefix + "/Circularity", scalers_info,
+                                                           1 );
         }
         if ( this->para->ptc_circularity_3d )
         {
             this->writers.particle_writer->create_dataset( prefix + "/Circularity3D",
-                                                           scalers_info );
-        }
-        if ( this->para->ptc_rg )
-        {
-            this->writers.particle_writer->create_dataset( prefix + "/Rg", scalers_info );
+                                                           scalers_info, 1 );
         }
-        // TODO: the orbital frequency is not supported yet
     }
 }
 
@@ -444,71 +733,43 @@ inline void monitor::create_orbit_file_datasets()
 {
     // this function should be called only when the orbit file is enabled
     // again, it should be called by the root process
-    FILE* idfile = fopen( this->para->orb_idfile.c_str(), "r" );
-    if ( idfile == nullptr )
-        ERROR( "The file %s does not exist!\n", this->para->orb_idfile.c_str() );
-
-    struct stat* st = new struct stat;
-    st->st_size     = 0;
-    stat( this->para->orb_idfile.c_str(), st );
-    try
-    {
-        this->check_filesize( st->st_size );
-    }
-    catch ( const std::exception& e )
-    {
-        delete st;
-        fclose( idfile );
-        ERROR( "%s", e.what() );
-    }
-
-    char buffer[ st->st_size + 1 ];
-    buffer[ st->st_size ] = '\0';
-    char* p_buffer        = buffer;
-    fread( p_buffer, ( size_t )st->st_size, 1, idfile );
-    std::string           id_string = buffer;
-    vector< std::string > ids       = galotfa::string::split( id_string, " \t\n" );
-    for ( auto& id_str : ids )
-    {
-        this->orbit_log_ids.push_back( std::stoul( id_str ) );
-    }
-
-    this->orbit_part_num = ids.size();
-    for ( auto& target_id : this->orbit_log_ids )
-    {
-        // TODO: support more available orbit types, such as recentered, aligned and corotating
-        galotfa::hdf5::size_info single_vector_info = { H5T_NATIVE_DOUBLE, 1, { 3 } };
-        // this->orbit_writer->create_group( "/Orbit" + std::to_string( target_id ) );
-        this->writers.orbit_writer->create_dataset(
-            "/Particle" + std::to_string( target_id ) + "/Position",
-            single_vector_info );  // create the dataset for each particle
-        this->writers.orbit_writer->create_dataset(
-            "/Particle" + std::to_string( target_id ) + "/Velocity",
-            single_vector_info );  // create the dataset for each particle
-        // TODO: add an attribute in each dataset to indicate the particle id
-    }
+    // the ids are read into the sorted ranges, so the duplicated ones are dropped
+    if ( galotfa::id_list::read( this->para->orb_idfile, this->orbit_id_ranges ) != 0 )
+        ERROR( "Failed to read the id list file %s.", this->para->orb_idfile.c_str() );
+    if ( this->orbit_id_ranges.empty() )
+        ERROR( "The id list file %s is empty.", this->para->orb_idfile.c_str() );
+    this->expand_orbit_ids();
+    this->orbit_part_num = this->orbit_log_ids.size();
 
-    delete st;
-    fclose( idfile );
+    // all the tracked particles are logged in one dataset of [time, particle, 6], whose rows are
+    // in the order of /ParticleIDs, and each row is (x, y, z, vx, vy, vz)
+    size_t row_bytes       = ( size_t )this->orbit_part_num * 6 * sizeof( double );
+    this->orbit_chunk_size = ( unsigned int )std::max< size_t >(
+        1, std::min< size_t >( 1000, ( 1 << 20 ) / row_bytes ) );  // about 1 MB per chunk
+    galotfa::hdf5::size_info single_scaler_info = { H5T_NATIVE_DOUBLE, 1, { 1 } };
+    galotfa::hdf5::size_info id_info    = { H5T_NATIVE_LLONG,
+                                            1,
+                                            { ( hsize_t )this->orbit_part_num } };
+    galotfa::hdf5::size_info orbit_info = { H5T_NATIVE_DOUBLE,
+                                            2,
+                                            { ( hsize_t )this->orbit_part_num, 6 } };
+    this->writers.orbit.times =
+        this->writers.orbit_writer->create_channel< double >( "/Times", single_scaler_info );
+    this->writers.orbit_writer->create_dataset( "/ParticleIDs", id_info, 1 );
+    this->writers.orbit.orbits = this->writers.orbit_writer->create_channel< double >(
+        "/Orbits", orbit_info, this->orbit_chunk_size );
+    this->writers.orbit_writer->push< long long >( this->orbit_log_ids.data(),
+                                                   this->orbit_part_num, "/ParticleIDs" );
 }
 
-inline void monitor::check_filesize( long int size ) const
-// The same as ini_parser::check_filesize()
+inline void monitor::expand_orbit_ids()
 {
-    if ( size == 0 )
-    {
-        ERROR( "The size of the id list file is 0, most common case: the file was not found." );
-    }
-    else if ( size >= 1024 * 1024 * 5 && size < 1024 * 1024 * 1024 )
-    {
-        WARN( "The id list file is too big: size = %ld MB.", size / 1024 / 1024 );
-    }
-    else if ( size >= 1024 * 1024 * 1024 )
-    {
-        ERROR( " The id list file is too big: size = %ld MB\nPlease check whether the your file is "
-               "correct!",
-               size / 1024 / 1024 );
-    }
+    this->orbit_log_ids.clear();
+    this->orbit_log_ids.reserve( galotfa::id_list::count( this->orbit_id_ranges ) );
+    for ( auto& r : this->orbit_id_ranges )
+        for ( long long id = r.first; id <= r.last; ++id )
+            this->orbit_log_ids.push_back( id );
+    this->orbit_part_num = this->orbit_log_ids.size();
 }
 
 inline void monitor::create_group_file_datasets()
@@ -528,15 +789,76 @@ inline void monitor::create_post_file_datasets()
 }
 
 int monitor::run_with call_without_tracer
+{
+    galotfa::particle_view view( particle_ids, types, masses, coordinates, velocities,
+                                 particle_number );
+    return this->run_with( view, time );
+}
+
+int monitor::run_with( const galotfa::particle_view& view, double& time )
 {
     if ( !this->para->glb_switch_on )  // if galotfa is disabled, just return 0
         return 0;
+    if ( this->async )
+        return this->run_async( view, time );
 
+    this->step = this->sim_step++;
     this->time = time;
+    if ( !this->need_ana() )
+        return 0;
+    return this->analyze( view );
+}
+
+int monitor::run_async( const galotfa::particle_view& view, double time )
+{
+    unsigned long long step = this->sim_step++;
+    if ( !this->need_ana_at( step ) )
+        return 0;
+
+    // the snapshot is taken while the worker may be still busy with the other buffer
+    galotfa::snapshot& buffer = this->snapshots[ this->next_buffer ];
+    this->take_snapshot( view, step, buffer );
 
-    if ( this->need_ana() )
-        this->extractor( particle_number, types, particle_ids,
-                         coordinates );  // extract the target particles
+    // hand over the snapshot once the last step is done, and return at once
+    std::unique_lock< std::mutex > lock( this->job_mutex );
+    this->job_cond.wait( lock, [ this ] { return !this->job_pending; } );
+    int return_code   = this->job_code;  // the return code of the last analysis step
+    this->job_code    = 0;
+    this->job_pending = true;
+    this->job_buffer  = this->next_buffer;
+    this->job_step    = step;
+    this->job_time    = time;
+    lock.unlock();
+    this->job_cond.notify_all();
+
+    this->next_buffer ^= 1;
+    return return_code;
+}
+
+void monitor::take_snapshot( const galotfa::particle_view& view, unsigned long long step,
+                             galotfa::snapshot& buffer ) const
+{
+    // only the particles of the modules to run at the step, the pre-process always runs
+    unsigned char modules = 1;
+    if ( is_due( this->para->md_switch_on, this->para->md_period, step ) )
+        modules |= 2;
+    if ( is_due( this->para->ptc_switch_on, this->para->ptc_period, step ) )
+        modules |= 4;
+    bool orbit = is_due( this->para->orb_switch_on, this->para->orb_period, step );
+
+    auto wanted = [ & ]( int i ) {
+        int type = view.type( i );
+        if ( type >= 0 && type < ( int )this->snapshot_modules.size()
+             && ( this->snapshot_modules[ type ] & modules ) )
+            return true;
+        return orbit && this->orbit_id_index.find( view.id( i ) ) >= 0;
+    };
+    buffer.take( view, wanted );
+}
+
+int monitor::analyze( const galotfa::particle_view& view )
+{
+    this->extractor( view );  // extract the target particles
 
     if ( this->step == 0 && this->para->ptc_switch_on )
     {
@@ -546,59 +868,79 @@ int monitor::run_with call_without_tracer
         for ( size_t i = 0; i < ptc_target_type_num; ++i )
             particle_ana_nums[ i ] = this->part_num_particle[ i ];
         MPI_Allreduce( MPI_IN_PLACE, particle_ana_nums.data(), ptc_target_type_num,
-                       MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD );
+                       MPI_UNSIGNED_LONG, MPI_SUM, galotfa::comm::current() );
         // sum the number of target particles in all the MPI processes
-        if ( this->is_root() )
+        this->ptc_totals.assign( particle_ana_nums.begin(), particle_ana_nums.end() );
+        if ( this->writers.particle_writer != nullptr )
             this->create_particle_file_datasets( particle_ana_nums );  // create the datasets
     }
 
-    inject_data no_tracer;  // a function object to inject the data to the virtual calculator
-    int         return_code = this->save();  // save the analysis results to the output files
+    inject_data( view, this->time );  // inject the data to the virtual calculator
+    int return_code = this->save();   // save the analysis results to the output files
+    this->release_once();             // release the memory allocated in extractor()
     if ( return_code != 0 )
-    {
         WARN( "Failed to save analysis results to the output files." );
-        return return_code;
-    }
+    return return_code;
+}
+
+bool monitor::wants_step() const
+{
+    return this->para->glb_switch_on && this->need_ana_at( this->sim_step );
+}
 
-    if ( this->need_ana() )
-        this->release_once();  // release the memory allocated in extractor()
+int monitor::skip_step( double& time )
+{
+    if ( !this->para->glb_switch_on )
+        return 0;
 
-    ++this->step;
-    return 0;
+    ( void )time;  // the skipped step has no analysis results
+    int return_code = 0;
+    if ( this->need_ana_at( this->sim_step ) )
+    {
+        WARN( "The analysis at step %llu is skipped by the simulation.", this->sim_step );
+        return_code = 1;
+    }
+    ++this->sim_step;
+    return return_code;
 }
 
 inline bool monitor::need_ana_model() const
 {
-    return this->para->md_switch_on && this->step % this->para->md_period == 0;
+    return is_due( this->para->md_switch_on, this->para->md_period, this->step );
 }
 inline bool monitor::need_ana_particle() const
 {
-    return this->para->ptc_switch_on && this->step % this->para->ptc_period == 0;
+    return is_due( this->para->ptc_switch_on, this->para->ptc_period, this->step );
 }
 inline bool monitor::need_log_orbit() const
 {
-    return this->para->orb_switch_on && this->step % this->para->orb_period == 0;
+    return is_due( this->para->orb_switch_on, this->para->orb_period, this->step );
 }
 inline bool monitor::need_ana_group() const
 {
-    return this->para->grp_switch_on && this->step % this->para->grp_period == 0;
+    return is_due( this->para->grp_switch_on, this->para->grp_period, this->step );
 }
 inline bool monitor::need_ana() const
 {
-    return need_ana_model() || need_ana_particle() || need_log_orbit() || need_ana_group();
+    return this->need_ana_at( this->step );
+}
+inline bool monitor::need_ana_at( unsigned long long step ) const
+{
+    return is_due( this->para->md_switch_on, this->para->md_period, step )
+           || is_due( this->para->ptc_switch_on, this->para->ptc_period, step )
+           || is_due( this->para->orb_switch_on, this->para->orb_period, step )
+           || is_due( this->para->grp_switch_on, this->para->grp_period, step );
 }
 
 void monitor::release_once() const
 {
+    // NOTE: the buffers of the index arrays are owned by index_buffers and kept for the next
+    // analysis step, only the pointers and the counters are reset here
     if ( need_ana_model() )
     {
         for ( size_t i = 0; i < this->para->md_target_sets.size(); ++i )
         {
-            if ( this->id_for_model[ i ] != nullptr )
-            {
-                delete[] this->id_for_model[ i ];
-                this->id_for_model[ i ] = nullptr;
-            }
+            this->id_for_model[ i ]   = nullptr;
             this->part_num_model[ i ] = 0;
         }
     }
@@ -607,22 +949,16 @@ void monitor::release_once() const
     {
         for ( size_t i = 0; i < this->para->ptc_particle_types.size(); ++i )
         {
-            if ( this->id_for_particle[ i ] != nullptr )
-            {
-                delete[] this->id_for_particle[ i ];
-                this->id_for_particle[ i ] = nullptr;
-            }
+            this->id_for_particle[ i ]   = nullptr;
             this->part_num_particle[ i ] = 0;
         }
     }
 
-    if ( this->id_for_orbit != nullptr )
-        if ( need_log_orbit() )
-        {
-            delete[] this->id_for_orbit;
-            this->id_for_orbit   = nullptr;
-            this->part_num_orbit = 0;
-        }
+    if ( need_log_orbit() )
+    {
+        this->id_for_orbit   = nullptr;
+        this->part_num_orbit = 0;
+    }
 
     /* if ( this->id_for_group != nullptr )
         if ( need_ana_group() )
@@ -632,26 +968,30 @@ void monitor::release_once() const
         } */
 }
 
-void monitor::extractor( int& partnum_total, int types[], int ids[],
-                         double coordinates[][ 3 ] ) const
+void monitor::extractor( const galotfa::particle_view& view ) const
 {
+    int partnum_total = view.size();
     // NOTE: the pre-process data will always be extracted, so the extractor should be called
     // only when need_ana() is true
 
     // HACK: the extract of target particles for pre-process is implemented in the calculator
+    // the index arrays are reused across the steps, see release_once()
+    size_t slot = 0;
     if ( this->need_ana_model() )
     {
         for ( auto& ids : this->id_for_model )
-            ids = new int[ partnum_total ];
+            ids = this->index_buffers.get< int >( slot++, partnum_total );
     }
+    slot = this->id_for_model.size();
     if ( this->need_ana_particle() )
     {
         for ( auto& ids : this->id_for_particle )
-            ids = new int[ partnum_total ];
+            ids = this->index_buffers.get< int >( slot++, partnum_total );
     }
+    slot = this->id_for_model.size() + this->id_for_particle.size();
     if ( this->need_log_orbit() )
     {
-        this->id_for_orbit = new int[ this->orbit_part_num ];
+        this->id_for_orbit = this->index_buffers.get< int >( slot, this->orbit_part_num );
     }
 
     /* if ( this->need_ana_group() )
@@ -659,72 +999,88 @@ void monitor::extractor( int& partnum_total, int types[], int ids[],
         this->id_for_group = new unsigned long[ partnum_total ];
     } */
 
-    static int    i = 0;  // a static temporary variable
-    static size_t j = 0;  // a static temporary variable
-    static size_t k = 0;  // a static temporary variable
+    // extract the target particles of all the model analysis sets in one pass
+    if ( this->need_ana_model() )
+        this->calc->select_md_targets( view, this->id_for_model, this->part_num_model );
+
+    // reuse the orbit log targets of the last step if none of them has been moved
+    bool scan_orbit = this->need_log_orbit() && !this->orbit_cache_valid( view );
+    if ( this->need_log_orbit() && !scan_orbit )
+    {
+        this->part_num_orbit = ( int )this->orbit_cached_index.size();
+        for ( int j = 0; j < this->part_num_orbit; ++j )
+            this->id_for_orbit[ j ] = this->orbit_cached_index[ j ];
+    }
+
+    if ( !this->need_ana_particle() && !scan_orbit )
+        return;
+
+    static int i         = 0;  // a static temporary variable
+    static int type      = 0;  // the type of the current particle
+    static int type_slot = 0;  // the index of the type in the particle analysis
     // i: index for iterating all the particles
-    // j: index for iterating all the target sets
-    // k: index for iterating all the members in each target set
     for ( i = 0; i < partnum_total; ++i )
     {
-        // extract the target particles for model analysis
-        if ( this->need_ana_model() )
-            if ( this->calc->is_target_of_md( types[ i ], coordinates[ i ][ 0 ],
-                                              coordinates[ i ][ 1 ], coordinates[ i ][ 2 ] ) )
-            {
-                for ( j = 0; j < this->para->md_target_sets.size(); ++j )
-                {
-                    for ( k = 0; k < this->para->md_target_sets[ j ].size(); ++k )
-                        if ( types[ i ] == this->para->md_target_sets[ j ][ k ] )
-                        {
-                            this->id_for_model[ j ][ this->part_num_model[ j ]++ ] = i;
-                            break;
-                        }
-                }
-            }
-
         // extract the target particles for particle analysis
         if ( this->need_ana_particle() )
         {
-            for ( size_t j = 0; j < this->para->ptc_particle_types.size(); ++j )
-            {
-                if ( types[ i ] == this->para->ptc_particle_types[ j ] )
-                {
-                    this->id_for_particle[ j ][ this->part_num_particle[ j ]++ ] = i;
-                    break;
-                }
-            }
+            type = view.type( i );
+            if ( type >= 0 && type < ( int )this->ptc_slot_of_type.size()
+                 && ( type_slot = this->ptc_slot_of_type[ type ] ) >= 0 )
+                this->id_for_particle[ type_slot ][ this->part_num_particle[ type_slot ]++ ] = i;
         }
 
         // extract the target particles for orbit analysis
-        if ( this->need_log_orbit() )
-        {
-            for ( int j = 0; j < this->orbit_part_num; ++j )
-            {
-                if ( ids[ i ] == this->orbit_log_ids[ j ] )
-                {
-                    this->id_for_orbit[ this->part_num_orbit++ ] = i;
-                    break;
-                }
-            }
-        }
+        if ( scan_orbit && this->part_num_orbit < this->orbit_part_num
+             && this->orbit_id_index.find( view.id( i ) ) >= 0 )
+            this->id_for_orbit[ this->part_num_orbit++ ] = i;
+    }
+
+    if ( scan_orbit )
+    {
+        // update the cache for the next steps
+        this->orbit_cached_index.assign( this->id_for_orbit,
+                                         this->id_for_orbit + this->part_num_orbit );
+        this->orbit_cached_ids.resize( this->part_num_orbit );
+        for ( int j = 0; j < this->part_num_orbit; ++j )
+            this->orbit_cached_ids[ j ] = view.id( this->id_for_orbit[ j ] );
+        this->orbit_found_total = this->part_num_orbit;
+        MPI_Allreduce( MPI_IN_PLACE, &this->orbit_found_total, 1, MPI_LONG_LONG, MPI_SUM,
+                       galotfa::comm::current() );
+    }
+}
+
+bool monitor::orbit_cache_valid( const galotfa::particle_view& view ) const
+{
+    // the cache is valid if every cached particle is still at its array index, and no tracked
+    // particle has moved to another process, i.e. the global number of valid entries is the same
+    // as that of the last full scan
+    long long status[ 2 ] = { 0, 0 };  // the number of invalid and valid entries
+    for ( size_t j = 0; j < this->orbit_cached_index.size(); ++j )
+    {
+        int index = this->orbit_cached_index[ j ];
+        if ( index < view.size() && view.id( index ) == this->orbit_cached_ids[ j ] )
+            ++status[ 1 ];
+        else
+            ++status[ 0 ];
     }
+    MPI_Allreduce( MPI_IN_PLACE, status, 2, MPI_LONG_LONG, MPI_SUM, galotfa::comm::current() );
+    return this->orbit_found_total >= 0 && status[ 0 ] == 0
+           && status[ 1 ] == this->orbit_found_total;
 }
 
-inline int monitor::inject_data call_without_tracer const
+inline int monitor::inject_data( const galotfa::particle_view& view, double& time ) const
 {
     ( void )time;  // avoid the warning of unused variable
-    ( void )particle_ids;
     // This function should be called before the increment of the step counter
     if ( need_ana() )
-        this->calc->call_pre_module( particle_number, types, masses, coordinates );
+        this->calc->call_pre_module( view );
     if ( need_ana_model() )
-        this->calc->call_md_module( masses, coordinates, velocities, this->id_for_model,
-                                    this->part_num_model );
+        this->calc->call_md_module( view, this->id_for_model, this->part_num_model );
     if ( need_ana_particle() )
-        this->calc->call_ptc_module();
+        this->calc->call_ptc_module( view, this->id_for_particle, this->part_num_particle );
     if ( need_log_orbit() )
-        this->calc->call_orb_module();
+        this->calc->call_orb_module( view, this->id_for_orbit, this->part_num_orbit );
     if ( need_ana_group() )
         this->calc->call_grp_module();
     return 0;
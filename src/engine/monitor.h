@@ -4,8 +4,16 @@
 #include "../output/writer.h"
 #include "../parameter/ini_parser.h"
 #include "../parameter/para.h"
+#include "../tools/arena.h"
+#include "../tools/id_hash.h"
+#include "../tools/id_list.h"
+#include "../tools/id_sort.h"
 #include "calculator.h"
+#include "snapshot.h"
+#include <condition_variable>
 #include <mpi.h>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 using std::vector;
@@ -28,12 +36,41 @@ using std::vector;
 
 namespace galotfa {
 
+// the typed channels of the time series in a model file, invalid for the disabled datasets
+struct model_channels
+{
+    channel< double >           times;
+    channel< double >           center;
+    channel< double >           major_axis;
+    channel< double >           sbar;
+    channel< double >           sbuckle;
+    channel< double >           radius[ 3 ];
+    vector< channel< double > > an_real;  // in the order of md_an
+    vector< channel< double > > an_imag;
+    channel< double >           images[ 8 ][ 3 ];  // the same indexes as analysis_result::images
+    channel< long long >        voxel_number;
+    channel< long long >        voxels;
+    channel< double >           tensors;
+    channel< double >           dispersion_tensor;
+    channel< double >           inertia_tensor;
+    channel< double >           scalars;  // the table of all the scalars if scalar_table is on
+    vector< double >            row;      // a row of the scalar table
+};
+
+struct orbit_channels
+{
+    channel< double > times;
+    channel< double > orbits;
+};
+
 struct writer_sets
 {
     vector< galotfa::writer* > model_writers;
     galotfa::writer*           particle_writer = nullptr;
     vector< galotfa::writer* > group_writers;
     galotfa::writer*           orbit_writer = nullptr;
+    vector< model_channels >   models;  // the channels of each model writer
+    orbit_channels             orbit;
 };
 
 class monitor
@@ -43,8 +80,9 @@ private:
     int                  mpi_init_before_galotfa = 0;
     galotfa::para*       para                    = nullptr;  // pointer to the parameter class
     galotfa::calculator* calc                    = nullptr;
-    unsigned long long   step = 0;    // the current step of the simulation/analysis
-    double               time = 0.0;  // the current time of the simulation/analysis
+    unsigned long long   step     = 0;    // the step under analysis
+    double               time     = 0.0;  // the time of the step under analysis
+    unsigned long long   sim_step = 0;    // the step of the simulation: the calls of run_with()
     // array of pointers to the writers: 5 possible output files
     // model, particle, orbit, group, post
     // nested vector of the data writers to be written: due to there may be multiple analysis
@@ -54,17 +92,53 @@ private:
     int           galotfa_size;  // the global size of the MPI process
     vector< int > include_particle_types;
     // vector< vector< int >* > classifications;
-    int           orbit_part_num = 0;     // the number of target particles for orbital curve log
-    vector< int > orbit_log_ids;          // the particle ids for orbital curve log
+    int                 orbit_part_num = 0;  // the number of target particles for orbital curve log
+    vector< long long > orbit_log_ids;       // the particle ids for orbital curve log
+    vector< galotfa::id_list::range > orbit_id_ranges;  // the same ids in the compact form
+    galotfa::id_hash    orbit_id_index;      // the index of the ids above
+    // the array indexes and ids of the orbit log targets found in the last step: they are reused
+    // until the particles are moved by the simulation, e.g. by the domain decomposition
+    mutable vector< int >       orbit_cached_index;
+    mutable vector< long long > orbit_cached_ids;
+    mutable long long           orbit_found_total = -1;  // the global number found in the last scan
+    unsigned int     orbit_chunk_size = 1;  // the chunk size along the time of the orbit dataset
+    vector< double > orbit_rows;            // the rows of the orbit dataset in one step
     mutable vector< int* > id_for_model;  // similar but for model analysis section
     mutable vector< int >  part_num_model;
     mutable vector< int* > id_for_particle;  // simlar but for particle analysis
     mutable vector< int >  part_num_particle;
+    vector< int >          ptc_slot_of_type;  // the index of each type in the particle analysis
+    vector< size_t >       ptc_totals;        // the global number of the targets of each type
+    vector< char >         ptc_row;           // the row gathered on the root without parallel HDF5
+    vector< int >          ptc_counts;        // the counts of the processes in the gathered row
+    vector< int >          ptc_displs;        // the displacements of the processes in the row
+    galotfa::id_sort       ptc_sorter;        // the sort of the particles by IDs before writing
+    vector< double >       ptc_sorted;        // a result of the particles in the sorted order
     mutable int*           id_for_orbit   = nullptr;  // similar but for orbital curve log
     mutable int            part_num_orbit = 0;
+    // the buffers of the index arrays above, in order of model sets, particle types and orbit
+    mutable galotfa::arena index_buffers;
     // mutable unsigned long*           id_for_group   = nullptr;  // similar but for group
     // analysis mutable unsigned long            part_num_group = 0;
 
+    // the asynchronous mode: the analysis of a step runs in the worker thread on a snapshot of the
+    // target particles, with its own communicator, while the simulation goes on
+    bool                    async = false;
+    galotfa::snapshot       snapshots[ 2 ];   // the double buffer of the snapshots
+    int                     next_buffer = 0;  // the buffer of the next snapshot
+    vector< unsigned char > snapshot_modules;  // bit 0, 1, 2: the type is used by pre, md, ptc
+    MPI_Comm                async_comm      = MPI_COMM_NULL;
+    int                     finalize_keyval = MPI_KEYVAL_INVALID;
+    std::thread             worker;
+    std::mutex              job_mutex;
+    std::condition_variable job_cond;
+    bool                    job_pending = false;  // whether the worker has a snapshot to analyze
+    bool                    stop_worker = false;
+    int                     job_buffer  = 0;  // the snapshot of the pending job
+    int                     job_code    = 0;  // the return code of the last finished job
+    unsigned long long      job_step    = 0;
+    double                  job_time    = 0.0;
+
     // pointer to the analysis engine
     // private methods
 private:
@@ -75,28 +149,47 @@ private:
     }
 
     // the push data API with potential tracer
-    inline int inject_data call_without_tracer const;
+    inline int inject_data( const galotfa::particle_view& view, double& time ) const;
     inline int inject_data call_with_tracer const;
     int                    create_writers();              // create the writers
     inline void            create_files();                // create the output files
+    inline void            create_model_writers();    // create the model files on their owners
+    inline void            create_particle_writer();  // create the particle file on all processes
     inline void            create_model_file_datasets();  // create the datasets in the model file
+    // the filters of the output datasets, with the scale-offset filter of the digits if >= 0
+    inline galotfa::hdf5::filters output_filters( int scale_digits = -1 ) const;
     void                   create_particle_file_datasets(
                           vector< unsigned long >& particle_ana_nums );  // create the datasets in the particle file
     inline void create_orbit_file_datasets();  // create the datasets in the orbit file
     inline void create_group_file_datasets();  // create the datasets in the group file
     inline void create_post_file_datasets();   // create the datasets in the post file
     int         save( void );                  // write the data to the output files
+    int         save_particles( void );        // write the particle file on all processes
+    // append a row to the particle file, which is the elements of all the processes in the rank
+    // order: the len elements of this process start at offset, and total is the sum of len
+    template < typename T >
+    int push_distributed( const T* ptr, unsigned long len, unsigned long offset,
+                          unsigned long total, const std::string& dataset_name );
     inline void init();
-    inline void check_filesize( long int size ) const;
+    int         analyze( const galotfa::particle_view& view );  // analyze and save this->step
+    void        start_worker();  // set up the asynchronous mode
+    void        work();          // the loop of the worker thread
+    int         run_async( const galotfa::particle_view& view, double time );
+    void        take_snapshot( const galotfa::particle_view& view, unsigned long long step,
+                               galotfa::snapshot& buffer ) const;
+    static int  finish_at_finalize( MPI_Comm comm, int keyval, void* attr, void* extra );
+    inline void expand_orbit_ids();  // expand orbit_id_ranges into orbit_log_ids
     // extract the target particles from the simulation data
-    void extractor( int& partnum_total, int types[], int ids[], double coordinates[][ 3 ] ) const;
+    void extractor( const galotfa::particle_view& view ) const;
     void release_once() const;  // release the resource alloacted in extractor()
+    bool orbit_cache_valid( const galotfa::particle_view& view ) const;
     inline bool need_ana_model() const;
     inline bool need_ana_particle() const;
     inline bool need_log_orbit() const;
     inline bool need_ana_group() const;
     inline bool need_ana_post() const;
     inline bool need_ana() const;
+    inline bool need_ana_at( unsigned long long step ) const;
 
     // public methods
 public:
@@ -104,6 +197,16 @@ public:
     ~monitor();
     // interface of the simulation data: without potential tracer
     int run_with call_without_tracer;
+    // interface of the simulation data: read through the strided view of the host's particles
+    int run_with( const galotfa::particle_view& view, double& time );
+    // whether the current step needs the simulation data: the host can skip the data collection
+    // and call skip_step() instead if not
+    bool wants_step() const;
+    int  skip_step( double& time );  // advance to the next step without any simulation data
+    // wait for the analysis in flight of the asynchronous mode, stop the worker and write the
+    // buffered results, it's called automatically by MPI_Finalize()
+    void finish();
+    int  flush();  // write the buffered results into the files, e.g. before a checkpoint
     inline void  post_analysis();  // TODO: to be implemented
 };
 }  // namespace galotfa
@@ -0,0 +1,111 @@
+// This header define the read-only accessor of the simulation data, which reads the particle
+// fields through the strided view of the C API, so that the host doesn't need to copy its data
+#ifndef GALOTFA_PARTICLE_VIEW_H
+#define GALOTFA_PARTICLE_VIEW_H
+#include "../galotfa.h"
+#include <stdint.h>
+
+namespace galotfa {
+
+class particle_view
+{
+    // private members
+private:
+    galotfa_particle_view view;
+
+    // private methods
+private:
+    // read the raw value of a field, without the scale and offset
+    static inline double raw( const galotfa_field& field, int i )
+    {
+        const char* ptr = ( const char* )field.base + ( ptrdiff_t )i * field.stride;
+        switch ( field.dtype )
+        {
+        case GALOTFA_DOUBLE:
+            return *( const double* )ptr;
+        case GALOTFA_FLOAT:
+            return *( const float* )ptr;
+        case GALOTFA_INT32:
+            return *( const int32_t* )ptr;
+        case GALOTFA_INT64:
+            return ( double )*( const int64_t* )ptr;
+        case GALOTFA_UINT8:
+            return *( const uint8_t* )ptr;
+        case GALOTFA_UINT32:
+            return *( const uint32_t* )ptr;
+        case GALOTFA_UINT64:
+            return ( double )*( const uint64_t* )ptr;
+        default:
+            return 0;
+        }
+    }
+    static inline double value( const galotfa_field& field, int i )
+    {
+        if ( field.base == nullptr )
+            return field.offset;
+        return raw( field, i ) * field.scale + field.offset;
+    }
+
+    // public methods
+public:
+    particle_view( const galotfa_particle_view& host_view ) : view( host_view ){};
+    // the view of the AoS arrays used by the legacy API
+    particle_view( int particle_ids[], int types[], double masses[], double coordinates[][ 3 ],
+                   double velocities[][ 3 ], int particle_number )
+    {
+        this->view.particle_number = particle_number;
+
+        this->view.id   = galotfa_strided_field( particle_ids, GALOTFA_INT32, sizeof( int ) );
+        this->view.type = galotfa_strided_field( types, GALOTFA_INT32, sizeof( int ) );
+        this->view.mass = galotfa_strided_field( masses, GALOTFA_DOUBLE, sizeof( double ) );
+        for ( int i = 0; i < 3; ++i )
+        {
+            this->view.pos[ i ] = galotfa_strided_field( &coordinates[ 0 ][ i ], GALOTFA_DOUBLE,
+                                                         sizeof( double[ 3 ] ) );
+            this->view.vel[ i ] = galotfa_strided_field( &velocities[ 0 ][ i ], GALOTFA_DOUBLE,
+                                                         sizeof( double[ 3 ] ) );
+        }
+    };
+    inline int size() const
+    {
+        return this->view.particle_number;
+    }
+    // the integer fields are read without the scale and offset
+    inline long long id( int i ) const
+    {
+        const galotfa_field& field = this->view.id;
+        if ( field.base == nullptr )
+            return ( long long )field.offset;
+        const char* ptr = ( const char* )field.base + ( ptrdiff_t )i * field.stride;
+        switch ( field.dtype )
+        {
+        case GALOTFA_INT64:
+            return *( const int64_t* )ptr;
+        case GALOTFA_UINT32:
+            return *( const uint32_t* )ptr;
+        case GALOTFA_UINT64:
+            return ( long long )*( const uint64_t* )ptr;
+        default:
+            return ( long long )raw( field, i );
+        }
+    }
+    inline int type( int i ) const
+    {
+        return ( int )value( this->view.type, i );
+    }
+    inline double mass( int i ) const
+    {
+        return value( this->view.mass, i );
+    }
+    inline double pos( int i, int dim ) const
+    {
+        return value( this->view.pos[ dim ], i );
+    }
+    inline double vel( int i, int dim ) const
+    {
+        return value( this->view.vel[ dim ], i );
+    }
+};
+
+}  // namespace galotfa
+#endif
@@ -0,0 +1,87 @@
+// This header define the snapshot of the target particles for the asynchronous analysis: the fields
+// are copied from the host's view into owned SoA arrays, and read back through a particle_view, so
+// the analysis can go on while the simulation moves its particles
+#ifndef GALOTFA_SNAPSHOT_H
+#define GALOTFA_SNAPSHOT_H
+#include "../galotfa.h"
+#include "particle_view.h"
+#include <vector>
+
+namespace galotfa {
+
+class snapshot
+{
+    // private members
+private:
+    std::vector< long long > ids;
+    std::vector< int >       types;
+    std::vector< double >    masses;
+    std::vector< double >    pos[ 3 ];
+    std::vector< double >    vel[ 3 ];
+    int                      num = 0;  // the number of particles in the snapshot
+
+    // public methods
+public:
+    snapshot( void ){};
+    ~snapshot(){};
+    // copy the particles i of the view with wanted( i ) true, in their original order
+    // NOTE: the arrays only grow, so the steady state is allocation free
+    template < typename Filter > void take( const galotfa::particle_view& view, Filter wanted )
+    {
+        size_t total = ( size_t )view.size();
+        if ( this->ids.size() < total )
+        {
+            this->ids.resize( total );
+            this->types.resize( total );
+            this->masses.resize( total );
+            for ( int k = 0; k < 3; ++k )
+            {
+                this->pos[ k ].resize( total );
+                this->vel[ k ].resize( total );
+            }
+        }
+        this->num = 0;
+        for ( int i = 0; i < view.size(); ++i )
+        {
+            if ( !wanted( i ) )
+                continue;
+            this->ids[ this->num ]    = view.id( i );
+            this->types[ this->num ]  = view.type( i );
+            this->masses[ this->num ] = view.mass( i );
+            for ( int k = 0; k < 3; ++k )
+            {
+                this->pos[ k ][ this->num ] = view.pos( i, k );
+                this->vel[ k ][ this->num ] = view.vel( i, k );
+            }
+            ++this->num;
+        }
+    }
+    // the view of the copied particles, valid until the next take()
+    galotfa::particle_view view( void ) const
+    {
+        galotfa_particle_view host_view;
+        host_view.particle_number = this->num;
+
+        host_view.id =
+            galotfa_strided_field( this->ids.data(), GALOTFA_INT64, sizeof( long long ) );
+        host_view.type =
+            galotfa_strided_field( this->types.data(), GALOTFA_INT32, sizeof( int ) );
+        host_view.mass =
+            galotfa_strided_field( this->masses.data(), GALOTFA_DOUBLE, sizeof( double ) );
+        for ( int k = 0; k < 3; ++k )
+        {
+            host_view.pos[ k ] =
+                galotfa_strided_field( this->pos[ k ].data(), GALOTFA_DOUBLE, sizeof( double ) );
+            host_view.vel[ k ] =
+                galotfa_strided_field( this->vel[ k ].data(), GALOTFA_DOUBLE, sizeof( double ) );
+        }
+        return galotfa::particle_view( host_view );
+    }
+    inline int size( void ) const
+    {
+        return this->num;
+    }
+};
+
+}  // namespace galotfa
+#endif
@@ -8,24 +8,59 @@
 #include "../output/writer.cpp"
 #include "../parameter/ini_parser.cpp"
 #include "../parameter/para.cpp"
+#include "../tools/arena.cpp"
+#include "../tools/id_hash.cpp"
+#include "../tools/id_list.cpp"
+#include "../tools/id_sort.cpp"
 #include "../tools/prompt.cpp"
 #include "../tools/string.cpp"
 #endif
 
+// the monitor is shared by the array and the view interfaces of the same simulation
+static galotfa::monitor& galotfa_monitor()
+{
+    static galotfa::monitor otf_monitor;
+    return otf_monitor;
+}
+
 extern "C" {
 void galotfa_without_pot_tracer( int particle_ids[], int types[], double masses[],
                                  double coordiantes[][ 3 ], double velocities[][ 3 ], double time,
                                  int particle_number )
 {
-    static galotfa::monitor otf_monitor;
+    int run_failed = galotfa_monitor().run_with( particle_ids, types, masses, coordiantes,
+                                                 velocities, time, particle_number );
+    if ( run_failed )
+        WARN( "Failed to run galotfa at some steps!" );
+    return;
+}
 
-    int run_failed = otf_monitor.run_with( particle_ids, types, masses, coordiantes, velocities,
-                                           time, particle_number );
+void galotfa_view_without_pot_tracer( const struct galotfa_particle_view* view, double time )
+{
+    int run_failed = galotfa_monitor().run_with( galotfa::particle_view( *view ), time );
     if ( run_failed )
         WARN( "Failed to run galotfa at some steps!" );
     return;
 }
 
+int galotfa_wants_step( void )
+{
+    return galotfa_monitor().wants_step() ? 1 : 0;
+}
+
+void galotfa_skip_step( double time )
+{
+    galotfa_monitor().skip_step( time );
+    return;
+}
+
+void galotfa_flush( void )
+{
+    if ( galotfa_monitor().flush() )
+        WARN( "Failed to write the buffered analysis results!" );
+    return;
+}
+
 void galotfa_with_pot_tracer( int pot_tracer_type, int particle_ids[], int types[], double masses[],
                               double coordiantes[][ 3 ], double velocities[][ 3 ], double time,
                               int particle_number )
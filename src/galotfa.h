@@ -1,7 +1,57 @@
 #include "mpi.h"  // must include mpi.h before galotfa.h, to make prompt.h work correctly
 #ifndef GALOTFA_H_INCLUDED
 #define GALOTFA_H_INCLUDED
+#include <stddef.h>
 extern "C" {
+// the element types supported by the fields of a particle view
+enum galotfa_dtype {
+    GALOTFA_INT32,
+    GALOTFA_INT64,
+    GALOTFA_UINT8,
+    GALOTFA_UINT32,
+    GALOTFA_UINT64,
+    GALOTFA_FLOAT,
+    GALOTFA_DOUBLE
+};
+
+// a strided field in the host's particle storage: the value of the i-th particle is
+// *( dtype* )( ( char* )base + i * stride ) * scale + offset
+// if base is NULL, the field is a constant with the value of offset for all particles
+struct galotfa_field
+{
+    const void* base;
+    int         dtype;   // one of galotfa_dtype
+    ptrdiff_t   stride;  // in bytes
+    double      scale;
+    double      offset;
+};
+
+// the zero-copy view of the simulation data: galotfa reads the fields directly from the host's
+// particle array, only at the steps which need any analysis
+struct galotfa_particle_view
+{
+    int                  particle_number;
+    struct galotfa_field id;
+    struct galotfa_field type;
+    struct galotfa_field mass;
+    struct galotfa_field pos[ 3 ];
+    struct galotfa_field vel[ 3 ];
+};
+
+// helpers to fill the fields of a view
+static inline struct galotfa_field galotfa_strided_field( const void* base, int dtype,
+                                                          ptrdiff_t stride )
+{
+    struct galotfa_field field = { base, dtype, stride, 1.0, 0.0 };
+    return field;
+}
+
+static inline struct galotfa_field galotfa_constant_field( double value )
+{
+    struct galotfa_field field = { NULL, GALOTFA_DOUBLE, 0, 1.0, value };
+    return field;
+}
+
 void galotfa_with_pot_tracer( int pot_tracer_type, int particle_ids[], int types[], double masses[],
                               double coordiantes[][ 3 ], double velocities[][ 3 ], double time,
                               int particle_number );
@@ -9,5 +59,16 @@ void galotfa_with_pot_tracer( int pot_tracer_type, int particle_ids[], int types
 void galotfa_without_pot_tracer( int particle_ids[], int types[], double masses[],
                                  double coordiantes[][ 3 ], double velocities[][ 3 ], double time,
                                  int particle_number );
+
+void galotfa_view_without_pot_tracer( const struct galotfa_particle_view* view, double time );
+
+// the schedule of the analysis: if galotfa_wants_step() returns 0, the current step is idle, the
+// host can skip the data collection and call galotfa_skip_step() instead of the APIs above
+int  galotfa_wants_step( void );
+void galotfa_skip_step( double time );
+
+// write the buffered analysis results into the files, e.g. before a checkpoint or when the host
+// catches a termination signal, they are also written in MPI_Finalize()
+void galotfa_flush( void );
 }
 #endif
@@ -6,6 +6,7 @@
 #ifdef DO_UNIT_TEST
 #include "../tools/string.cpp"
 #endif
+#include <cmath>
 #include <hdf5.h>
 #include <unistd.h>
 
@@ -153,6 +154,20 @@ writer::writer( std::string path_to_file )
 #endif
 }
 
+#ifdef H5_HAVE_PARALLEL
+writer::writer( std::string path_to_file, MPI_Comm comm )
+{
+    this->shared = true;
+    this->comm   = comm;
+#ifndef debug_output
+    this->create_file( path_to_file );
+    this->filename = path_to_file;
+#else
+    ( void )path_to_file;
+#endif
+}
+#endif
+
 inline void writer::clean_nodes( void )
 {
     for ( auto& node : this->nodes )
@@ -164,11 +179,16 @@ inline void writer::clean_nodes( void )
         }
     }
     nodes.clear();
+    buffers.clear();
+    for ( auto& type : this->table_types )
+        H5Tclose( type );
+    table_types.clear();
 }
 
 writer::~writer( void )
 {
     // flush the buffer before closing the file
+    this->flush();
     for ( auto& node : this->nodes )
     {
         // flush the buffer if the node is a dataset
@@ -209,7 +229,14 @@ inline hid_t writer::open_file( std::string path_to_file )
 {
     try
     {
-        if ( access( path_to_file.c_str(), F_OK ) == 0 )
+        bool choose_name = true;  // whether this process chooses the name of the file
+#ifdef H5_HAVE_PARALLEL
+        int rank = 0;
+        if ( this->shared )
+            MPI_Comm_rank( this->comm, &rank );
+        choose_name = rank == 0;
+#endif
+        if ( choose_name && access( path_to_file.c_str(), F_OK ) == 0 )
         // if file exists
         {
             // add suffix to file name to avoid overwriting
@@ -220,7 +247,20 @@ inline hid_t writer::open_file( std::string path_to_file )
             }
             path_to_file += "-" + std::to_string( i );
         }
-        hid_t file_id = H5Fcreate( path_to_file.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+        hid_t access_prop = H5Pcreate( H5P_FILE_ACCESS );
+#ifdef H5_HAVE_PARALLEL
+        if ( this->shared )
+        {
+            // the root process chooses the name, and all the processes create the file together
+            unsigned long len = path_to_file.size();
+            MPI_Bcast( &len, 1, MPI_UNSIGNED_LONG, 0, this->comm );
+            path_to_file.resize( len );
+            MPI_Bcast( &path_to_file[ 0 ], ( int )len, MPI_CHAR, 0, this->comm );
+            H5Pset_fapl_mpio( access_prop, this->comm, MPI_INFO_NULL );
+        }
+#endif
+        hid_t file_id = H5Fcreate( path_to_file.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, access_prop );
+        H5Pclose( access_prop );
         return file_id;
     }
     catch ( ... )
@@ -291,7 +331,7 @@ int writer::create_group( std::string group_name )
 }
 
 int writer::create_dataset( std::string dataset_name, hdf5::size_info& info,
-                            unsigned int chunk_size )
+                            unsigned int chunk_size, const hdf5::filters* filters )
 {
     // first check the size of the size_info is consistent
     if ( ( size_t )info.rank != info.dims.size() )
@@ -332,18 +372,19 @@ int writer::create_dataset( std::string dataset_name, hdf5::size_info& info,
         this->create_group( parent_path );
 
     // create the dataset
+    const hdf5::filters& pipeline = filters == nullptr ? this->default_filters : *filters;
     if ( parent_path == "" )
     {
         auto data_node_ptr =
-            create_datanode( *this->nodes.at( "/" ), strings.back(), info, chunk_size );
+            create_datanode( *this->nodes.at( "/" ), strings.back(), info, chunk_size, pipeline );
         // insert the node
         this->nodes.insert(
             std::pair< std::string, galotfa::hdf5::node* >( "/" + strings.back(), data_node_ptr ) );
     }
     else
     {
-        auto data_node_ptr =
-            create_datanode( *this->nodes.at( parent_path ), strings.back(), info, chunk_size );
+        auto data_node_ptr = create_datanode( *this->nodes.at( parent_path ), strings.back(), info,
+                                              chunk_size, pipeline );
         // insert the node
         this->nodes.insert( std::pair< std::string, galotfa::hdf5::node* >(
             parent_path + "/" + strings.back(), data_node_ptr ) );
@@ -352,7 +393,8 @@ int writer::create_dataset( std::string dataset_name, hdf5::size_info& info,
 }
 
 inline hdf5::node* writer::create_datanode( hdf5::node& parent, std::string& dataset,
-                                            hdf5::size_info& info, unsigned int chunk_size )
+                                            hdf5::size_info& info, unsigned int chunk_size,
+                                            const hdf5::filters& filters )
 {
     // check the size of the size_info is consistent: done in the caller-function create_file(
     // ...)
@@ -370,18 +412,39 @@ inline hdf5::node* writer::create_datanode( hdf5::node& parent, std::string& dat
     hsize_t chunk_dims[ info.rank + 1 ];
     hsize_t max_dims[ info.rank + 1 ];
     hsize_t data_dims[ info.rank + 1 ];  // only for the data space creation
+    size_t  row_bytes = H5Tget_size( info.data_type );
     for ( size_t i = 0; i < info.rank; ++i )
-        data_dims[ i + 1 ] = max_dims[ i + 1 ] = chunk_dims[ i + 1 ] = info.dims[ i ];
-    data_dims[ 0 ]  = 0;
-    chunk_dims[ 0 ] = chunk_size;
-    max_dims[ 0 ]   = H5S_UNLIMITED;
+    {
+        data_dims[ i + 1 ] = max_dims[ i + 1 ] = info.dims[ i ];
+        chunk_dims[ i + 1 ] = info.dims[ i ] > 0 ? info.dims[ i ] : 1;
+        row_bytes *= chunk_dims[ i + 1 ];
+    }
+    data_dims[ 0 ] = 0;
+    max_dims[ 0 ]  = H5S_UNLIMITED;
+    // the chunk has at most chunk_size rows within max_chunk_bytes, e.g. a few images, and a row
+    // larger than that is split into the tiles by halving its leading dimensions, so a chunk is
+    // compressed in memory at once and a write of the rows never reads the chunks back
+    chunk_dims[ 0 ] = std::max( ( size_t )1, std::min( ( size_t )chunk_size,
+                                                       max_chunk_bytes / row_bytes ) );
+    for ( size_t i = 1; i <= info.rank && row_bytes > max_chunk_bytes; ++i )
+        while ( chunk_dims[ i ] > 1 && row_bytes > max_chunk_bytes )
+        {
+            row_bytes       = row_bytes / chunk_dims[ i ] * ( ( chunk_dims[ i ] + 1 ) / 2 );
+            chunk_dims[ i ] = ( chunk_dims[ i ] + 1 ) / 2;
+        }
 
     // create property list and set chunk and compression
     hid_t  prop_list = H5Pcreate( H5P_DATASET_CREATE );
     herr_t status    = H5Pset_chunk( prop_list, ( int )info.rank + 1, chunk_dims );
-    status           = H5Pset_deflate( prop_list, 6 );
+    // the scale-offset filter is lossy, and only for the floats
+    if ( status >= 0 && filters.scale_digits >= 0 && H5Tget_class( info.data_type ) == H5T_FLOAT )
+        status = H5Pset_scaleoffset( prop_list, H5Z_SO_FLOAT_DSCALE, filters.scale_digits );
+    if ( status >= 0 && filters.shuffle )
+        status = H5Pset_shuffle( prop_list );
+    if ( status >= 0 && filters.deflate > 0 )
+        status = H5Pset_deflate( prop_list, ( unsigned int )filters.deflate );
     if ( status < 0 )
-        ERROR( "Failed to set deflate!" );
+        ERROR( "Failed to set the chunk and filters of dataset %s!", dataset.c_str() );
 
     // create the zero-size dataspace
     hid_t dataspace = H5Screate_simple( ( int )info.rank + 1, data_dims, max_dims );
@@ -402,8 +465,7 @@ inline hdf5::node* writer::create_datanode( hdf5::node& parent, std::string& dat
     return datanode_ptr;
 }
 
-template < typename T >
-int writer::push( T* ptr, unsigned long len, std::string dataset_name, unsigned int chunk_size )
+template < typename T > int writer::push( T* ptr, unsigned long len, std::string dataset_name )
 {
     // check whether the dataset exists
     if ( this->nodes.find( dataset_name ) == this->nodes.end() )
@@ -431,71 +493,270 @@ int writer::push( T* ptr, unsigned long len, std::string dataset_name, unsigned
         }
     }
 
-    if ( this->stack_counter.find( dataset_name ) == this->stack_counter.end() )
+    // the row is written into the file once the buffer of the dataset is full
+    dataset_ref ref = this->resolve( dataset_name );
+    return this->append( ref, ptr, 1, true );
+}
+
+template < typename T >
+int writer::push_rows( T* ptr, unsigned long rows, std::string dataset_name )
+{
+    if ( this->nodes.find( dataset_name ) == this->nodes.end()
+         || !this->nodes.at( dataset_name )->is_dataset() )
     {
-        stack_counter[ dataset_name ] = 1;
-        // if it is the first push, initialize the stack counter
-    }
-
-    /* // get the filespace
-    hid_t dataset   = this->nodes.at( dataset_name ).get_hid();
-    hid_t filespace = H5Dget_space( dataset );
-
-    // extend the dataset
-    // get the data info from the node
-    hdf5::size_info* info    = this->nodes.at( dataset_name ).get_size_info();
-    auto&            datadim = info->dims;
-    hsize_t          new_sizes[ datadim.size() + 1 ];
-    hsize_t          hyperslab[ datadim.size() + 1 ];
-    hyperslab[ 0 ] = 1;
-    new_sizes[ 0 ] = ( size_t )stack_counter[ dataset_name ];
-    for ( size_t i = 0; i < datadim.size(); ++i )
-        hyperslab[ i + 1 ] = new_sizes[ i + 1 ] = datadim[ i ];
-    // herr_t status = H5Dset_extent( dataset, new_sizes ); */
-
-    // select the hyperslab, namely a subset of the dataset
-    hdf5::size_info* info       = this->nodes.at( dataset_name )->get_size_info();
-    auto             dims       = this->nodes.at( dataset_name )->get_dim_ext();
-    hid_t            dataset_id = this->nodes.at( dataset_name )->get_hid();
-    auto             rank       = dims.size();
-    hsize_t*         offset     = new hsize_t[ rank ]();
-    offset[ 0 ]                 = stack_counter[ dataset_name ] - 1;
-    hid_t memspace              = this->nodes.at( dataset_name )->get_memspace();
-
-    dims[ 0 ]     = stack_counter[ dataset_name ];
-    herr_t status = H5Dset_extent( dataset_id, dims.data() ); /* extend the dataset */
-    dims[ 0 ]     = 1;  // reset the first dimension to 1 for hyperslab selection
-
-    // get file space
+        WARN( "Try to push rows into unexist dataset: %s", dataset_name.c_str() );
+        return 1;
+    }
+    dataset_ref ref = this->resolve( dataset_name );
+    if ( rows == 0 )
+        return 0;
+    return this->append( ref, ptr, rows, false );
+}
+
+template < typename T >
+int writer::push_slab( T* ptr, unsigned long len, unsigned long offset, std::string dataset_name )
+{
+    // NOTE: the checks give the same result on all the processes of a shared file, if they push
+    // the slabs of the same row
+    if ( this->nodes.find( dataset_name ) == this->nodes.end()
+         || !this->nodes.at( dataset_name )->is_dataset() )
+    {
+        WARN( "Try to push a slab into unexist dataset: %s", dataset_name.c_str() );
+        return 1;
+    }
+    dataset_ref ref  = this->resolve( dataset_name );
+    auto        dims = ref.node->get_dim_ext();
+    if ( dims.size() < 2 || offset + len > dims[ 1 ] )
+    {
+        WARN( "The slab [%lu, %lu) is out of the row of the dataset: %s", offset, offset + len,
+              dataset_name.c_str() );
+        return 1;
+    }
+    int status = this->write_buffer( ref );  // the rows pushed before, if any
+
+    // the new row, and the slab of this process in it
+    hid_t                  dataset_id = ref.node->get_hid();
+    std::vector< hsize_t > start( dims.size(), 0 );
+    start[ 0 ] = *ref.counter - 1;
+    dims[ 0 ]  = start[ 0 ] + 1;
+    status += H5Dset_extent( dataset_id, dims.data() ) < 0;
+    start[ 1 ] = offset;
+    dims[ 0 ]  = 1;
+    dims[ 1 ]  = len;
+
     hid_t filespace = H5Dget_space( dataset_id );
-    // get the hyperslab, namely a subset of the dataset
-    status = H5Sselect_hyperslab( filespace, H5S_SELECT_SET, offset, NULL, dims.data(), NULL );
-    // call the write function, its only a API without flush buffer
-    status = H5Dwrite( dataset_id, info->data_type, memspace, filespace, H5P_DEFAULT, ptr );
+    hid_t memspace  = H5Screate_simple( ( int )dims.size(), dims.data(), NULL );
+    if ( len > 0 )
+        H5Sselect_hyperslab( filespace, H5S_SELECT_SET, start.data(), NULL, dims.data(), NULL );
+    else  // still join the collective write
+    {
+        H5Sselect_none( filespace );
+        H5Sselect_none( memspace );
+    }
+    hid_t transfer_prop = H5Pcreate( H5P_DATASET_XFER );
+#ifdef H5_HAVE_PARALLEL
+    if ( this->shared )
+        H5Pset_dxpl_mpio( transfer_prop, H5FD_MPIO_COLLECTIVE );
+#endif
+    status += H5Dwrite( dataset_id, ref.node->get_size_info()->data_type, memspace, filespace,
+                        transfer_prop, ptr )
+              < 0;
+    H5Pclose( transfer_prop );
+    H5Sclose( memspace );
     H5Sclose( filespace );
+    ++*ref.counter;
+    if ( status > 0 )
+    {
+        WARN( "Failed to push a slab into dataset: %s", dataset_name.c_str() );
+        return 1;
+    }
+    return 0;
+}
+
+template < typename T >
+channel< T > writer::create_channel( std::string dataset_name, hdf5::size_info& info,
+                                     unsigned int chunk_size, const hdf5::filters* filters )
+{
+    if ( H5Tget_size( info.data_type ) != sizeof( T ) )
+    {
+        WARN( "The data type of the dataset %s doesn't match its channel.",
+              dataset_name.c_str() );
+        return channel< T >();
+    }
+    dataset_ref ref;
+    if ( this->create_ref( dataset_name, info, chunk_size, filters, ref ) != 0 )
+        return channel< T >();
+    return channel< T >( this, ref );
+}
+
+channel< double > writer::create_table( std::string                         table_name,
+                                        const std::vector< hdf5::column >& columns,
+                                        unsigned int                        chunk_size )
+{
+    size_t width = 0;
+    for ( auto& column : columns )
+        width += column.width;
+    if ( width == 0 )
+    {
+        WARN( "Try to create a table without any column: %s", table_name.c_str() );
+        return channel< double >();
+    }
+
+    // the columns are the members of the compound type, at their offsets in a row of doubles
+    hid_t  type   = H5Tcreate( H5T_COMPOUND, width * sizeof( double ) );
+    size_t offset = 0;
+    for ( auto& column : columns )
+    {
+        hsize_t dim    = column.width;
+        hid_t   member = column.width == 1 ? H5Tcopy( H5T_NATIVE_DOUBLE )
+                                           : H5Tarray_create2( H5T_NATIVE_DOUBLE, 1, &dim );
+        H5Tinsert( type, column.name.c_str(), offset, member );
+        H5Tclose( member );
+        offset += column.width * sizeof( double );
+    }
+
+    hdf5::size_info info = { type, 1, { 1 } };
+    dataset_ref     ref;
+    if ( this->create_ref( table_name, info, chunk_size, nullptr, ref ) != 0 )
+    {
+        H5Tclose( type );
+        return channel< double >();
+    }
+    this->table_types.push_back( type );  // the type is used by the writes of the table
+    return channel< double >( this, ref );
+}
 
-    delete[] offset;
+int writer::create_ref( std::string dataset_name, hdf5::size_info& info,
+                        unsigned int chunk_size, const hdf5::filters* filters, dataset_ref& ref )
+{
+    if ( this->create_dataset( dataset_name, info, chunk_size, filters ) != 0 )
+        return 1;
+    // the path is normalized as the key of the node
+    auto        strings = galotfa::string::split( dataset_name, "/" );
+    std::string path    = "";
+    for ( auto& name : strings )
+        path += "/" + name;
+    ref = this->resolve( path );
+    return 0;
+}
+
+writer::dataset_ref writer::resolve( const std::string& dataset_name )
+{
+    // NOTE: the references to the elements of an unordered_map are stable until they are erased
+    if ( this->stack_counter.find( dataset_name ) == this->stack_counter.end() )
+        stack_counter[ dataset_name ] = 1;  // if it is the first push, initialize the counter
+    dataset_ref ref;
+    auto        iter = this->buffers.emplace( dataset_name, row_buffer() ).first;
+    ref.name         = &iter->first;
+    ref.buffer       = &iter->second;
+    ref.node         = this->nodes.at( dataset_name );
+    ref.counter      = &this->stack_counter.at( dataset_name );
+
+    auto dims    = ref.node->get_dim_ext();
+    ref.row_size = H5Tget_size( ref.node->get_size_info()->data_type );
+    for ( size_t i = 1; i < dims.size(); ++i )
+        ref.row_size *= dims[ i ];
+    // the rows of a chunk along the time, as it's created
+    std::vector< hsize_t > chunk_dims( dims.size(), 1 );
+    H5Pget_chunk( ref.node->get_property(), ( int )dims.size(), chunk_dims.data() );
+    ref.chunk_size = chunk_dims[ 0 ] > 0 ? ( unsigned int )chunk_dims[ 0 ] : 1;
+    return ref;
+}
 
-    // flush the buffer if the "stack" is "full"
-    if ( stack_counter[ dataset_name ] % chunk_size == 0 )
-        H5Dflush( this->nodes.at( dataset_name )->get_hid() );
+int writer::append( dataset_ref& ref, const void* ptr, unsigned long rows, bool chunk_end )
+{
+    row_buffer& buffer = *ref.buffer;
+    buffer.bytes.insert( buffer.bytes.end(), ( const char* )ptr,
+                         ( const char* )ptr + rows * ref.row_size );
+    buffer.rows += rows;
+    *ref.counter += rows;
+
+    int status = 0;
+    if ( buffer.rows >= this->flush_rows || buffer.bytes.size() >= max_buffer_bytes )
+        status = this->write_buffer( ref );
+    // flush the buffer if the "stack" is "full", so a write never spans the chunks
+    if ( chunk_end && ( *ref.counter - 1 ) % ref.chunk_size == 0 )
+    {
+        status += this->write_buffer( ref );
+        H5Dflush( ref.node->get_hid() );
+    }
+    return status > 0 ? 1 : 0;
+}
 
-    ++stack_counter[ dataset_name ];
+int writer::write_buffer( dataset_ref& ref )
+{
+    row_buffer& buffer = *ref.buffer;
+    if ( buffer.rows == 0 )
+        return 0;
+
+    hdf5::node* node       = ref.node;
+    auto        dims       = node->get_dim_ext();
+    hid_t       dataset_id = node->get_hid();
+    // the buffered rows are the last ones of the stack: one extent change and one hyperslab
+    std::vector< hsize_t > offset( dims.size(), 0 );
+    offset[ 0 ]   = *ref.counter - 1 - buffer.rows;
+    dims[ 0 ]     = offset[ 0 ] + buffer.rows;
+    herr_t status = H5Dset_extent( dataset_id, dims.data() );
+    dims[ 0 ]     = buffer.rows;
+
+    hid_t memspace  = buffer.rows == 1 ? node->get_memspace()
+                                       : H5Screate_simple( ( int )dims.size(), dims.data(), NULL );
+    hid_t filespace = H5Dget_space( dataset_id );
+    status = H5Sselect_hyperslab( filespace, H5S_SELECT_SET, offset.data(), NULL, dims.data(),
+                                  NULL );
+    status = H5Dwrite( dataset_id, node->get_size_info()->data_type, memspace, filespace,
+                       H5P_DEFAULT, buffer.bytes.data() );
+    H5Sclose( filespace );
+    if ( memspace != node->get_memspace() )
+        H5Sclose( memspace );
+
+    buffer.bytes.clear();
+    buffer.rows = 0;
     if ( status < 0 )
     {
-        WARN( "Failed to push data into dataset: %s", dataset_name.c_str() );
+        WARN( "Failed to push data into dataset: %s", ref.name->c_str() );
         return 1;
     }
     return 0;
 }
 
+int writer::flush( void )
+{
+    int status = 0;
+    for ( auto& buffer : this->buffers )
+        if ( buffer.second.rows > 0 )
+        {
+            dataset_ref ref = this->resolve( buffer.first );
+            status += this->write_buffer( ref );
+        }
+    if ( this->nodes.find( "/" ) != this->nodes.end() )
+        H5Fflush( this->nodes.at( "/" )->get_hid(), H5F_SCOPE_GLOBAL );
+    return status > 0 ? 1 : 0;
+}
+
 // ensure the template function is instantiated
-template int writer::push< int >( int* ptr, unsigned long len, std::string dataset_name,
-                                  unsigned int chunk_size );
-template int writer::push< double >( double* ptr, unsigned long len, std::string dataset_name,
-                                     unsigned int chunk_size );
+template int writer::push< int >( int* ptr, unsigned long len, std::string dataset_name );
+template int writer::push< double >( double* ptr, unsigned long len, std::string dataset_name );
 template int writer::push< unsigned int >( unsigned int* ptr, unsigned long len,
-                                           std::string dataset_name, unsigned int chunk_size );
+                                           std::string dataset_name );
+template int writer::push< long long >( long long* ptr, unsigned long len,
+                                        std::string dataset_name );
+template int writer::push_rows< double >( double* ptr, unsigned long rows,
+                                          std::string dataset_name );
+template int writer::push_rows< long long >( long long* ptr, unsigned long rows,
+                                             std::string dataset_name );
+template int writer::push_slab< double >( double* ptr, unsigned long len, unsigned long offset,
+                                          std::string dataset_name );
+template int writer::push_slab< long long >( long long* ptr, unsigned long len,
+                                             unsigned long offset, std::string dataset_name );
+template channel< double > writer::create_channel< double >( std::string dataset_name,
+                                                             hdf5::size_info& info,
+                                                             unsigned int chunk_size,
+                                                             const hdf5::filters* filters );
+template channel< long long > writer::create_channel< long long >( std::string dataset_name,
+                                                                   hdf5::size_info& info,
+                                                                   unsigned int chunk_size,
+                                                                   const hdf5::filters* filters );
 
 #ifdef debug_output
 int writer::test_node( void )
@@ -945,6 +1206,335 @@ int writer::test_push( void )
     remove( testfile.c_str() );
     CHECK_RETURN( true );
 }
+int writer::test_push_rows( void )
+{
+    println( "Testing writer::push_rows(T* ptr, unsigned long rows, std::string dataset_name) "
+             "..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    int             create_failure = this->create_file( testfile );
+    hdf5::size_info info{ H5T_NATIVE_DOUBLE, 1, { 2 } };  // rows of 2 doubles
+    create_failure += this->create_dataset( "/list", info, 4 );
+    if ( create_failure )
+        CHECK_RETURN( false );
+
+    // push 0, 1, ..., 4 rows in turn, where the j-th row is ( j, -j )
+    std::vector< double > rows;
+    int                   push_failure = 0, total = 0;
+    for ( int step = 0; step < 5; ++step )
+    {
+        rows.clear();
+        for ( int j = total; j < total + step; ++j )
+        {
+            rows.push_back( j );
+            rows.push_back( -j );
+        }
+        push_failure += this->push_rows( rows.data(), step, "/list" );
+        total += step;
+    }
+
+    // read it back
+    hid_t   dataset_id = this->nodes.at( "/list" )->get_hid();
+    hid_t   filespace  = H5Dget_space( dataset_id );
+    hsize_t dims[ 2 ]  = { 0, 0 };
+    H5Sget_simple_extent_dims( filespace, dims, NULL );
+    H5Sclose( filespace );
+    std::vector< double > read_back( dims[ 0 ] * dims[ 1 ] );
+    if ( push_failure || dims[ 0 ] != ( hsize_t )total || dims[ 1 ] != 2 )
+    {
+        clean_nodes();
+        remove( testfile.c_str() );
+        CHECK_RETURN( false );
+    }
+    H5Dread( dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, read_back.data() );
+    clean_nodes();
+    remove( testfile.c_str() );
+    for ( int j = 0; j < total; ++j )
+        if ( read_back[ 2 * j ] != j || read_back[ 2 * j + 1 ] != -j )
+            CHECK_RETURN( false );
+    CHECK_RETURN( true );
+}
+
+int writer::test_buffered_push( void )
+{
+    println( "Testing the write-behind buffer of writer::push and writer::push_rows ..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    buffers.clear();
+    int             create_failure = this->create_file( testfile );
+    hdf5::size_info scalar{ H5T_NATIVE_DOUBLE, 1, { 1 } };
+    hdf5::size_info list{ H5T_NATIVE_LLONG, 1, { 2 } };
+    create_failure += this->create_dataset( "/scalar", scalar );
+    create_failure += this->create_dataset( "/list", list );
+    if ( create_failure )
+        CHECK_RETURN( false );
+
+    auto rows_in_file = [ this ]( std::string name ) {
+        hid_t   filespace = H5Dget_space( this->nodes.at( name )->get_hid() );
+        hsize_t dims[ 2 ] = { 0, 0 };
+        H5Sget_simple_extent_dims( filespace, dims, NULL );
+        H5Sclose( filespace );
+        return dims[ 0 ];
+    };
+    this->set_flush_rows( 4 );
+    int    push_failure = 0;
+    double value        = 0;
+    for ( ; value < 3; ++value )
+        push_failure += this->push( &value, 1, "/scalar" );
+    hsize_t buffered = rows_in_file( "/scalar" );  // 3 rows in the buffer
+    push_failure += this->push( &value, 1, "/scalar" );
+    hsize_t written = rows_in_file( "/scalar" );  // the 4 rows are written at once
+    for ( ++value; value < 6; ++value )
+        push_failure += this->push( &value, 1, "/scalar" );
+
+    long long pairs[] = { 0, 0, 1, -1, 2, -2, 3, -3, 4, -4 };
+    push_failure += this->push_rows( pairs, 3, "/list" );
+    hsize_t list_buffered = rows_in_file( "/list" );
+    push_failure += this->push_rows( pairs + 6, 2, "/list" );
+    hsize_t list_written = rows_in_file( "/list" );
+    push_failure += this->flush();
+    this->set_flush_rows( 1 );
+    if ( push_failure || buffered != 0 || written != 4 || list_buffered != 0 || list_written != 5
+         || rows_in_file( "/scalar" ) != 6 )
+    {
+        clean_nodes();
+        remove( testfile.c_str() );
+        CHECK_RETURN( false );
+    }
+
+    std::vector< double >    scalars( 6 );
+    std::vector< long long > read_back( 10 );
+    H5Dread( this->nodes.at( "/scalar" )->get_hid(), H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+             H5P_DEFAULT, scalars.data() );
+    H5Dread( this->nodes.at( "/list" )->get_hid(), H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL,
+             H5P_DEFAULT, read_back.data() );
+    clean_nodes();
+    remove( testfile.c_str() );
+    for ( int j = 0; j < 6; ++j )
+        if ( scalars[ j ] != j )
+            CHECK_RETURN( false );
+    CHECK_RETURN( std::equal( read_back.begin(), read_back.end(), pairs ) );
+}
+
+int writer::test_channel( void )
+{
+    println( "Testing the typed channels of writer::create_channel ..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    buffers.clear();
+    this->create_file( testfile );
+    hdf5::size_info vector_info{ H5T_NATIVE_DOUBLE, 1, { 3 } };
+    hdf5::size_info list_info{ H5T_NATIVE_LLONG, 1, { 2 } };
+    auto            vectors  = this->create_channel< double >( "group/vectors", vector_info, 2 );
+    auto            list     = this->create_channel< long long >( "/list", list_info );
+    auto            mismatch = this->create_channel< int >( "/mismatch", vector_info );
+    if ( !vectors.valid() || !list.valid() || mismatch.valid() )
+    {
+        clean_nodes();
+        remove( testfile.c_str() );
+        CHECK_RETURN( false );
+    }
+
+    int    append_failure = 0;
+    double rows[ 5 ][ 3 ];
+    for ( int i = 0; i < 5; ++i )
+    {
+        for ( int j = 0; j < 3; ++j )
+            rows[ i ][ j ] = i * 3 + j;
+        append_failure += vectors.append( rows[ i ] );
+    }
+    long long pairs[] = { 1, -1, 2, -2, 3, -3 };
+    append_failure += list.append_rows( pairs, 3 );
+    append_failure += list.append_rows( pairs, 0 );
+    int invalid_failure = channel< double >().append( rows[ 0 ] );
+    // the channels and the push by name share the same dataset state
+    append_failure += this->push( rows[ 0 ], 3, "/group/vectors" );
+
+    std::vector< double >    vector_back( 18 );
+    std::vector< long long > list_back( 6 );
+    H5Dread( this->nodes.at( "/group/vectors" )->get_hid(), H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+             H5P_DEFAULT, vector_back.data() );
+    H5Dread( this->nodes.at( "/list" )->get_hid(), H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL,
+             H5P_DEFAULT, list_back.data() );
+    clean_nodes();
+    remove( testfile.c_str() );
+    if ( append_failure || invalid_failure != 1 )
+        CHECK_RETURN( false );
+    for ( int j = 0; j < 15; ++j )
+        if ( vector_back[ j ] != j )
+            CHECK_RETURN( false );
+    CHECK_RETURN( std::equal( vector_back.begin() + 15, vector_back.end(), rows[ 0 ] )
+                  && std::equal( list_back.begin(), list_back.end(), pairs ) );
+}
+
+int writer::test_table( void )
+{
+    println( "Testing the compound table of writer::create_table ..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    buffers.clear();
+    this->create_file( testfile );
+    auto table = this->create_table( "/Scalars", { { "Times", 1 }, { "Center", 3 } } );
+    auto empty = this->create_table( "/Empty", {} );
+    if ( !table.valid() || empty.valid() )
+    {
+        clean_nodes();
+        remove( testfile.c_str() );
+        CHECK_RETURN( false );
+    }
+
+    int    append_failure = 0;
+    double rows[ 3 ][ 4 ];
+    for ( int i = 0; i < 3; ++i )
+    {
+        for ( int j = 0; j < 4; ++j )
+            rows[ i ][ j ] = i * 4 + j;
+        append_failure += table.append( rows[ i ] );
+    }
+
+    // read back the columns one by one, with the compound types of a single member
+    hid_t   time_type   = H5Tcreate( H5T_COMPOUND, sizeof( double ) );
+    hid_t   center_type = H5Tcreate( H5T_COMPOUND, 3 * sizeof( double ) );
+    hsize_t dim         = 3;
+    hid_t   array_type  = H5Tarray_create2( H5T_NATIVE_DOUBLE, 1, &dim );
+    H5Tinsert( time_type, "Times", 0, H5T_NATIVE_DOUBLE );
+    H5Tinsert( center_type, "Center", 0, array_type );
+    double times[ 3 ], centers[ 3 ][ 3 ];
+    hid_t  dataset_id = this->nodes.at( "/Scalars" )->get_hid();
+    herr_t status     = H5Dread( dataset_id, time_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, times );
+    status += H5Dread( dataset_id, center_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, centers );
+    H5Tclose( array_type );
+    H5Tclose( time_type );
+    H5Tclose( center_type );
+    clean_nodes();
+    remove( testfile.c_str() );
+    if ( append_failure || status < 0 )
+        CHECK_RETURN( false );
+    for ( int i = 0; i < 3; ++i )
+        if ( times[ i ] != rows[ i ][ 0 ]
+             || !std::equal( centers[ i ], centers[ i ] + 3, rows[ i ] + 1 ) )
+            CHECK_RETURN( false );
+    CHECK_RETURN( true );
+}
+
+int writer::test_push_slab( void )
+{
+    println( "Testing writer::push_slab(T* ptr, unsigned long len, unsigned long offset, "
+             "std::string dataset_name) ..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    buffers.clear();
+    this->create_file( testfile );
+    hdf5::size_info row_info{ H5T_NATIVE_DOUBLE, 1, { 4 } };
+    if ( this->create_dataset( "/row", row_info, 1 ) != 0 )
+        CHECK_RETURN( false );
+
+    double first[]      = { 1, 2 };
+    double second[]     = { 3, 4, 5, 6 };
+    int    push_failure = this->push_slab( first, 2, 1, "/row" );
+    push_failure += this->push_slab( second, 4, 0, "/row" );
+    push_failure += this->push_slab( second, 0, 4, "/row" );  // an empty slab, the row is 0
+    println( "Try to push a slab out of the row, it should raise a warning ..." );
+    int out_failure = this->push_slab( second, 3, 2, "/row" );
+    out_failure += this->push_slab( second, 1, 0, "/no_row" );
+
+    std::vector< double > read_back( 12, -1 );
+    H5Dread( this->nodes.at( "/row" )->get_hid(), H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL,
+             H5P_DEFAULT, read_back.data() );
+    clean_nodes();
+    remove( testfile.c_str() );
+    std::vector< double > target = { 0, 1, 2, 0, 3, 4, 5, 6, 0, 0, 0, 0 };
+    CHECK_RETURN( push_failure == 0 && out_failure == 2 && read_back == target );
+}
+
+int writer::test_filters( void )
+{
+    println( "Testing the chunks and filters of writer::create_dataset ..." );
+    std::string testfile = "test.hdf5";
+    if ( access( testfile.c_str(), F_OK ) == 0 )
+        remove( testfile.c_str() );
+    nodes.clear();
+    stack_counter.clear();
+    buffers.clear();
+    this->create_file( testfile );
+    hdf5::size_info image_info{ H5T_NATIVE_DOUBLE, 2, { 201, 201 } };
+    hdf5::size_info large_info{ H5T_NATIVE_DOUBLE, 2, { 400, 400 } };
+    hdf5::size_info small_info{ H5T_NATIVE_DOUBLE, 2, { 20, 20 } };
+    hdf5::size_info id_info{ H5T_NATIVE_LLONG, 1, { 20 } };
+    hdf5::filters   lossy;
+    lossy.scale_digits = 3;
+    lossy.shuffle      = false;
+    lossy.deflate      = 0;
+    int create_failure = this->create_dataset( "/image", image_info );
+    create_failure += this->create_dataset( "/large", large_info );
+    create_failure += this->create_dataset( "/lossy", small_info, 1000, &lossy );
+    create_failure += this->create_dataset( "/ids", id_info, 1000, &lossy );  // only for floats
+    hdf5::filters raw;
+    raw.shuffle = false;
+    raw.deflate = 0;
+    this->set_filters( raw );
+    create_failure += this->create_dataset( "/raw", small_info );
+    this->set_filters( hdf5::filters() );
+
+    // the chunks are within max_chunk_bytes: fewer rows than the given ones, a few images, or a
+    // half of a large image
+    auto chunk = [ this ]( std::string name ) {
+        std::vector< hsize_t > dims( 3, 0 );
+        H5Pget_chunk( this->nodes.at( name )->get_property(), 3, dims.data() );
+        return dims;
+    };
+    auto filter_num = [ this ]( std::string name ) {
+        return H5Pget_nfilters( this->nodes.at( name )->get_property() );
+    };
+    bool chunk_ok = chunk( "/image" ) == std::vector< hsize_t >{ 3, 201, 201 }
+                    && chunk( "/large" ) == std::vector< hsize_t >{ 1, 200, 400 }
+                    && chunk( "/lossy" ) == std::vector< hsize_t >{ 327, 20, 20 };
+    unsigned int flags, config;
+    size_t       value_num = 0;
+    bool         filter_ok = filter_num( "/image" ) == 2 && filter_num( "/raw" ) == 0
+                     && filter_num( "/ids" ) == 0 && filter_num( "/lossy" ) == 1
+                     && H5Pget_filter2( this->nodes.at( "/lossy" )->get_property(), 0, &flags,
+                                        &value_num, NULL, 0, NULL, &config )
+                            == H5Z_FILTER_SCALEOFFSET;
+
+    // the values of the scale-offset filter keep the 3 decimal digits
+    std::vector< double > values( 2 * 400 );
+    for ( size_t i = 0; i < values.size(); ++i )
+        values[ i ] = 100.0 * sin( 0.1 * i );
+    int push_failure = this->push( values.data(), 400, "/lossy" );
+    push_failure += this->push( values.data() + 400, 400, "/lossy" );
+    clean_nodes();
+
+    // read back after the file is closed, so the data has passed the filters
+    std::vector< double > read_back( values.size(), 0 );
+    hid_t  file_id    = H5Fopen( testfile.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT );
+    hid_t  dataset_id = H5Dopen2( file_id, "/lossy", H5P_DEFAULT );
+    herr_t status =
+        H5Dread( dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, read_back.data() );
+    H5Dclose( dataset_id );
+    H5Fclose( file_id );
+    remove( testfile.c_str() );
+    double max_error = 0;
+    for ( size_t i = 0; i < values.size(); ++i )
+        max_error = std::max( max_error, fabs( read_back[ i ] - values[ i ] ) );
+    CHECK_RETURN( create_failure == 0 && push_failure == 0 && status >= 0 && chunk_ok
+                  && filter_ok && max_error <= 0.5e-3 + 1e-12 );
+}
 #endif
 }  // namespace galotfa
 #endif
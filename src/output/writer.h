@@ -20,6 +20,20 @@ namespace hdf5 {
         std::vector< hsize_t > dims;
     };
 
+    struct column  // a column of a table: a double, or an array of doubles if width > 1
+    {
+        std::string  name;
+        unsigned int width;
+    };
+
+    struct filters  // the filter pipeline of a dataset, applied in the order of the members
+    {
+        // the decimal digits of the floats kept by the lossy scale-offset filter, -1 to disable it
+        int  scale_digits = -1;
+        bool shuffle      = true;  // shuffle the bytes of the elements before the deflate
+        int  deflate      = 6;     // the level of the deflate (gzip) in [1, 9], 0 to disable it
+    };
+
     class node
     // basic node for hdf5: group and dataset,
     // this class is used to organize the resources: dataspace, property and attribute
@@ -116,6 +130,10 @@ namespace hdf5 {
                 ERROR( "size_info is not set, try return nullptr will cause Segmentation Fault!" );
             return info;
         }
+        inline hid_t get_property( void ) const
+        {
+            return prop;
+        }
         inline hid_t get_memspace( void ) const
         {
             return memspace;
@@ -145,28 +163,96 @@ namespace hdf5 {
     inline void swap( node& lhs, node& rhs );  // a friend function to swap the members
 }  // namespace hdf5
 
+template < typename T > class channel;
+
 class writer
 {
     // public members
 public:
     // private members
 private:
+    // the write-behind buffer of a dataset: the rows pushed but not written into the file yet
+    struct row_buffer
+    {
+        std::vector< char > bytes;
+        unsigned long       rows = 0;
+    };
+    // the buffered rows of a dataset are also written once they exceed this size
+    static const size_t max_buffer_bytes = 1 << 22;
+    // the chunks of a dataset are limited to this size, by fewer rows or the tiles of a row
+    static const size_t max_chunk_bytes = 1 << 20;
+    // the resolved state of a dataset to append rows, without any lookup by its path
+    struct dataset_ref
+    {
+        const std::string*  name       = nullptr;  // the path, only for the warnings
+        hdf5::node*         node       = nullptr;
+        row_buffer*         buffer     = nullptr;
+        unsigned long long* counter    = nullptr;  // the stack counter of the dataset
+        size_t              row_size   = 0;        // the bytes of a row
+        unsigned int        chunk_size = 1;        // the rows of a chunk along the time
+    };
+
+    // flush_rows: the number of rows of a dataset written at once
     std::string                                           filename;
     std::unordered_map< std::string, hdf5::node* >        nodes         = {};
     std::unordered_map< std::string, unsigned long long > stack_counter = {};
+    std::unordered_map< std::string, row_buffer >         buffers       = {};
+    unsigned long                                         flush_rows    = 1;
+    hdf5::filters default_filters;  // the filters of the datasets created without their own
+    std::vector< hid_t > table_types = {};  // the compound types of the tables, closed at last
+    bool shared = false;  // whether the file is shared by the MPI processes with MPI-IO
+#ifdef H5_HAVE_PARALLEL
+    MPI_Comm comm = MPI_COMM_NULL;  // the processes sharing the file
+#endif
 
     // public methods
 public:
     writer( std::string path_to_file );
+#ifdef H5_HAVE_PARALLEL
+    // a file shared by all the processes of comm with MPI-IO, they call all the methods together
+    writer( std::string path_to_file, MPI_Comm comm );
+#endif
     ~writer( void );
     int create_file( std::string path_to_file );
     int create_group( std::string group_name );
+    // chunk_size: the rows of a chunk along the time, which are fewer for the large rows, and a
+    // row is split into the tiles if it's still too large, see max_chunk_bytes
+    // filters: the filters of the dataset, nullptr for the default ones of the writer
     int create_dataset( std::string dataset_name, hdf5::size_info& info,
-                        unsigned int chunk_size = 1000 );
+                        unsigned int chunk_size = 1000, const hdf5::filters* filters = nullptr );
     int add_attribute( std::string node_name, std::string attr_name, hdf5::size_info& info );
     // TODO: to be implemented
+    template < typename T > int push( T* ptr, unsigned long len, std::string dataset_name );
+    // append rows of the dataset in one write, e.g. a list whose length varies over the steps,
+    // each row has the shape of the dataset except its first dimension
+    template < typename T > int push_rows( T* ptr, unsigned long rows, std::string dataset_name );
+    // append a row of which this process writes the len elements from offset along the second
+    // dimension, e.g. its particles after those of the lower ranks, in a collective write if the
+    // file is shared, the others elements of a row not written by any process are 0
+    template < typename T >
+    int push_slab( T* ptr, unsigned long len, unsigned long offset, std::string dataset_name );
+    // buffer the pushed rows of each dataset, and write every rows of them in one hyperslab
+    inline void set_flush_rows( unsigned long rows )
+    {
+        this->flush_rows = rows > 0 ? rows : 1;
+    }
+    int flush( void );  // write all the buffered rows into the file
+    // the filters of the datasets created later without their own filters
+    inline void set_filters( const hdf5::filters& filters )
+    {
+        this->default_filters = filters;
+    }
+    // create a dataset and return its typed handle, which appends the rows without building the
+    // path or looking it up, it's invalid if the dataset can't be created
     template < typename T >
-    int push( T* ptr, unsigned long len, std::string dataset_name, unsigned int chunk_size = 1000 );
+    channel< T > create_channel( std::string dataset_name, hdf5::size_info& info,
+                                 unsigned int         chunk_size = 1000,
+                                 const hdf5::filters* filters    = nullptr );
+    // create a table of a compound type with the columns, whose row is the values of all the
+    // columns in order, so a step is appended with one write and a column is read at once
+    channel< double > create_table( std::string                         table_name,
+                                    const std::vector< hdf5::column >& columns,
+                                    unsigned int                        chunk_size = 1000 );
 #ifdef debug_output
     int test_open_file( void );
     int test_node( void );
@@ -174,14 +260,68 @@ public:
     int test_create_group( void );
     int test_create_dataset( void );
     int test_push( void );
+    int test_push_rows( void );
+    int test_buffered_push( void );
+    int test_channel( void );
+    int test_table( void );
+    int test_push_slab( void );
+    int test_filters( void );
 #endif
     // private methods
 private:
     // the nake open functions, without any check, internal use only
     inline hid_t       open_file( std::string path_to_file );
     inline hdf5::node* create_datanode( hdf5::node& parent, std::string& dataset,
-                                        hdf5::size_info& info, unsigned int chunk_size = 1000 );
+                                        hdf5::size_info& info, unsigned int chunk_size,
+                                        const hdf5::filters& filters );
     inline void        clean_nodes();
+    dataset_ref resolve( const std::string& dataset_name );
+    // create a dataset and resolve it, return 0 if success
+    int create_ref( std::string dataset_name, hdf5::size_info& info, unsigned int chunk_size,
+                    const hdf5::filters* filters, dataset_ref& ref );
+    // append rows into the buffer of the dataset, and write the buffer if it's full, or at the end
+    // of a chunk if chunk_end is true
+    int append( dataset_ref& ref, const void* ptr, unsigned long rows, bool chunk_end );
+    int write_buffer( dataset_ref& ref );  // write the buffered rows of a dataset
+    template < typename T > friend class channel;
+};
+
+// the typed handle of a dataset in the writer, valid until the writer is destroyed
+template < typename T > class channel
+{
+    // private members
+private:
+    writer*             owner = nullptr;
+    writer::dataset_ref ref;
+
+    // public methods
+public:
+    channel( void ){};
+    channel( writer* owner, const writer::dataset_ref& ref ) : owner( owner ), ref( ref ){};
+    inline bool valid( void ) const
+    {
+        return this->owner != nullptr;
+    }
+    // append a row, i.e. the analysis result of a step with the shape of the dataset
+    inline int append( const T* ptr )
+    {
+        if ( !this->valid() )
+        {
+            WARN( "Try to append data through an invalid channel." );
+            return 1;
+        }
+        return this->owner->append( this->ref, ptr, 1, true );
+    }
+    // append rows at once, e.g. a list whose length varies over the steps
+    inline int append_rows( const T* ptr, unsigned long rows )
+    {
+        if ( !this->valid() )
+        {
+            WARN( "Try to append data through an invalid channel." );
+            return 1;
+        }
+        return rows == 0 ? 0 : this->owner->append( this->ref, ptr, rows, false );
+    }
 };
 
 }  // namespace galotfa
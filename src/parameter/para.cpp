@@ -67,6 +67,11 @@ para::para( ini_parser& parser )
     update( glb, equal_threshold, Global, double );
     update( glb, sim_type, Global, str );
     update( glb, pot_tracer, Global, int );
+    update( glb, threads, Global, int );
+    update( glb, async, Global, bool );
+    update( glb, flush_rows, Global, int );
+    update( glb, deflate, Global, int );
+    update( glb, shuffle, Global, bool );
 
     // Pre section
     update( pre, recenter, Pre, bool );
@@ -75,6 +80,9 @@ para::para( ini_parser& parser )
     update( pre, axis_ratio, Pre, double );
     update( pre, region_size, Pre, double );
     update( pre, recenter_method, Pre, str );
+    update( pre, subpixel, Pre, bool );
+    update( pre, shrink_factor, Pre, double );
+    update( pre, shrink_limit, Pre, double );
 
     // Model section
     update( md, switch_on, Model, bool );
@@ -103,6 +111,10 @@ para::para( ini_parser& parser )
     update( md, an, Model, ints );
     update( md, inertia_tensor, Model, bool );
     update( md, dispersion_tensor, Model, bool );
+    update( md, sparse_tensor, Model, bool );
+    update( md, scalar_table, Model, bool );
+    update( md, image_digits, Model, int );
+    update( md, tensor_digits, Model, int );
 
     // Particle section
     update( ptc, switch_on, Particle, bool );
@@ -113,12 +125,15 @@ para::para( ini_parser& parser )
     update( ptc, circularity_3d, Particle, bool );
     update( ptc, rg, Particle, bool );
     update( ptc, freq, Particle, bool );
+    update( ptc, sort_by_id, Particle, bool );
 
     // orbit section
     update( orb, switch_on, Orbit, bool );
     update( orb, filename, Orbit, str );
     update( orb, period, Orbit, int );
     update( orb, idfile, Orbit, str );
+    update( orb, recenter, Orbit, bool );
+    update( orb, align_bar, Orbit, bool );
 
     // Group section
     update( grp, switch_on, Group, bool );
@@ -233,6 +248,20 @@ int para::check( void )
         IF_THEN_WARN( this->glb_equal_threshold <= 0,
                       "The equal threshold is non-positive, which is not allowed." );
 
+        IF_THEN_WARN( this->glb_threads < 0,
+                      "The number of threads is negative, which is not allowed." );
+
+        IF_THEN_WARN( this->glb_flush_rows <= 0,
+                      "The number of rows to flush is non-positive, which is not allowed." );
+
+        IF_THEN_WARN( this->glb_deflate < 0 || this->glb_deflate > 9,
+                      "The level of the deflate is not in the range of [0,9], given: %d.",
+                      this->glb_deflate );
+#ifndef _OPENMP
+        if ( this->glb_threads != 1 )
+            INFO( "galotfa is built without OpenMP, the analysis will run in one thread." );
+#endif
+
         IF_THEN_WARN( this->glb_sim_type != "galaxy" && this->glb_sim_type != "cluster",
                       "The simulation type is unknown: %s."
                       "\nSupported value: galaxy, cluster, cosmology or cosmology_zoom_in.",
@@ -266,11 +295,24 @@ int para::check( void )
 
             IF_THEN_WARN( this->pre_recenter_method != "com"
                               && this->pre_recenter_method != "density"
+                              && this->pre_recenter_method != "shrink"
                               && this->pre_recenter_method != "potential",
                           "The recenter method is unknown: %s."
-                          "\nSupported value: com, density or potential",
+                          "\nSupported value: com, density, shrink or potential",
                           this->pre_recenter_method.c_str() );
 
+            if ( this->pre_recenter_method == "shrink" )
+            {
+                IF_THEN_WARN( this->pre_shrink_factor <= 0 || this->pre_shrink_factor >= 1,
+                              "The shrink factor of the recenter sphere should be in (0, 1), "
+                              "given: %lf.",
+                              this->pre_shrink_factor );
+                IF_THEN_WARN( this->pre_shrink_limit <= 0 || this->pre_shrink_limit > 1,
+                              "The shrink limit of the recenter sphere should be in (0, 1], "
+                              "given: %lf.",
+                              this->pre_shrink_limit );
+            }
+
             if ( this->pre_recenter_method == "potential" )
             {
                 WARN( "The recenter method by potential is not supported yet. Use com instead." );
@@ -392,6 +434,13 @@ int para::check( void )
             this->md_bar_major_axis = true;
             this->md_sbar           = true;
         }
+
+        IF_THEN_WARN( this->md_image_digits < -1 || this->md_tensor_digits < -1,
+                      "The digits of the scale-offset filter are less than -1, which is not "
+                      "allowed." );
+        // the NaN of the empty pixels and voxels can't be kept by the scale-offset filter
+        if ( this->md_tensor_digits >= 0 && this->md_dispersion_tensor && !this->md_sparse_tensor )
+            INFO( "The dense dispersion tensor is written without the scale-offset filter." );
     }
 
     // check the particle section
@@ -414,6 +463,14 @@ int para::check( void )
                   "\nThis is not wrong, but make sure you know what you are doing.",
                   this->ptc_period );
         }
+
+        if ( this->ptc_rg || this->ptc_freq )
+        {
+            WARN( "The guiding radius and the orbital frequency are not supported yet, so they are "
+                  "turned off." );
+            this->ptc_rg   = false;
+            this->ptc_freq = false;
+        }
     }
     // check the orbit section
     if ( this->orb_switch_on )
@@ -425,6 +482,20 @@ int para::check( void )
                       "The orbit curve log option is enabled, but \"idfile\" is not given in such "
                       "section,\nwhich is a id list filename to specify the "
                       "target particles to be logged." );
+
+        IF_THEN_WARN( this->orb_recenter && !this->pre_recenter,
+                      "Try to log the recentered orbits, but the recenter is not activated." );
+
+        IF_THEN_WARN( this->orb_align_bar && !this->md_switch_on,
+                      "Try to log the orbits in the bar frame, but the model analysis is not "
+                      "activated." );
+
+        // the bar frame is determined by the latest model analysis
+        if ( this->orb_align_bar && this->md_switch_on )
+        {
+            this->md_bar_major_axis = true;
+            this->md_sbar           = true;
+        }
     }
 
     // check the group section
@@ -497,6 +568,11 @@ int para::test_print()
     printd( glb, equal_threshold );
     prints( glb, sim_type );
     printi( glb, pot_tracer );
+    printi( glb, threads );
+    printi( glb, async );
+    printi( glb, flush_rows );
+    printi( glb, deflate );
+    printi( glb, shuffle );
 
     // Pre section
     printi( pre, recenter );
@@ -505,6 +581,9 @@ int para::test_print()
     printd( pre, axis_ratio );
     printd( pre, region_size );
     prints( pre, recenter_method );
+    printi( pre, subpixel );
+    printd( pre, shrink_factor );
+    printd( pre, shrink_limit );
 
     // Model section
     printi( md, switch_on );
@@ -533,6 +612,10 @@ int para::test_print()
     printis( md, an );
     printi( md, inertia_tensor );
     printi( md, dispersion_tensor );
+    printi( md, sparse_tensor );
+    printi( md, scalar_table );
+    printi( md, image_digits );
+    printi( md, tensor_digits );
 
     // Particle section
     printi( ptc, switch_on );
@@ -543,12 +626,15 @@ int para::test_print()
     printi( ptc, circularity_3d );
     printi( ptc, rg );
     printi( ptc, freq );
+    printi( ptc, sort_by_id );
 
     // orbit section
     printi( orb, switch_on );
     prints( orb, filename );
     printi( orb, period );
     prints( orb, idfile );
+    printi( orb, recenter );
+    printi( orb, align_bar );
 
     // Group section
     printi( grp, switch_on );
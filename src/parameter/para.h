@@ -21,24 +21,32 @@ struct para
 
     // other global parameters
     std::string glb_convergence_type = "absolute", glb_sim_type = "galaxy";
-    int         glb_pot_tracer = -10086, glb_max_iter = 25;
+    int         glb_pot_tracer = -10086, glb_max_iter = 25, glb_threads = 1, glb_flush_rows = 1;
     double      glb_convergence_threshold = 0.001, glb_equal_threshold = 1e-10;
+    bool        glb_async = false;  // run the analysis in a worker thread
+    // the filters of the output datasets: the level of the deflate, and the byte shuffle
+    int  glb_deflate = 6;
+    bool glb_shuffle = true;
 
     // pre section parameters
-    bool          pre_recenter    = true;
+    bool          pre_recenter = true, pre_subpixel = false;
     double        pre_region_size = 20, pre_axis_ratio = 1;
+    double        pre_shrink_factor = 0.8, pre_shrink_limit = 0.1;
     std::string   pre_region_shape = "cylinder", pre_recenter_method = "density";
     vector< int > pre_recenter_anchors;
 
     // other model section parameters
     bool md_image = false, md_bar_major_axis = false, md_bar_radius = false, md_sbar = false,
          md_sbuckle = false, md_inertia_tensor = false, md_align_bar = true,
-         md_dispersion_tensor           = false;
+         md_dispersion_tensor = false, md_sparse_tensor = false, md_scalar_table = false;
     bool                    md_multiple = false;
     vector< int >           md_particle_types;
     vector< std::string >   md_classification;
     vector< vector< int > > md_target_sets;
     int                     md_image_bins = 100, md_rbins = 20;
+    // the decimal digits kept by the lossy scale-offset filter of the images and tensors, -1 for
+    // the lossless output
+    int md_image_digits = -1, md_tensor_digits = -1;
     double md_region_size = 20, md_axis_ratio = 1, md_bar_threshold = 0.15, md_rmin = 0.0,
            md_rmax = 0.0, md_deg = 3, md_percentage = 70;
     std::string           md_region_shape = "cylinder";
@@ -46,11 +54,13 @@ struct para
     vector< std::string > md_colors;
 
     // other particle section parameters
-    bool ptc_circularity = false, ptc_circularity_3d = false, ptc_rg = false, ptc_freq = false;
+    bool ptc_circularity = false, ptc_circularity_3d = false, ptc_rg = false, ptc_freq = false,
+         ptc_sort_by_id = false;
     vector< int > ptc_particle_types;
 
     // other orbit section parameters
     std::string orb_idfile;
+    bool        orb_recenter = false, orb_align_bar = false;
 
     // other group section parameters
     bool                  grp_vmg = false, grp_rmg = false, grp_ellipticity = false;
@@ -0,0 +1,88 @@
+#ifndef GALOTFA_ARENA_CPP
+#define GALOTFA_ARENA_CPP
+#include "./arena.h"
+#include "../tools/prompt.h"
+#include <stdint.h>
+#include <stdlib.h>
+namespace galotfa {
+arena::~arena()
+{
+    for ( auto& buffer : this->buffers )
+        if ( buffer != nullptr )
+        {
+            free( buffer );
+            buffer = nullptr;
+        }
+}
+
+void* arena::reserve( size_t slot, size_t bytes )
+{
+    if ( slot >= this->buffers.size() )
+    {
+        this->buffers.resize( slot + 1, nullptr );
+        this->capacities.resize( slot + 1, 0 );
+    }
+    if ( bytes <= this->capacities[ slot ] && this->buffers[ slot ] != nullptr )
+        return this->buffers[ slot ];
+
+    // grow with 1/4 headroom, so a slowly increasing particle number doesn't reallocate every step
+    size_t capacity = bytes + bytes / 4;
+    capacity        = ( capacity + alignment - 1 ) / alignment * alignment;
+    if ( capacity == 0 )
+        capacity = alignment;
+    if ( this->buffers[ slot ] != nullptr )
+        free( this->buffers[ slot ] );
+    this->buffers[ slot ] = nullptr;
+    if ( posix_memalign( &this->buffers[ slot ], alignment, capacity ) != 0 )
+    {
+        this->capacities[ slot ] = 0;
+        ERROR( "Failed to allocate %lu bytes for the scratch arena.", capacity );
+    }
+    this->capacities[ slot ] = capacity;
+    return this->buffers[ slot ];
+}
+
+size_t arena::total_bytes( void ) const
+{
+    size_t total = 0;
+    for ( auto& capacity : this->capacities )
+        total += capacity;
+    return total;
+}
+
+#ifdef debug_arena
+int arena::test_reuse( void )
+{
+    println( "Testing the reuse of the scratch arena ..." );
+    double* first = this->get< double >( 3, 1000 );
+    first[ 999 ]  = 1.0;
+    // a smaller or equal request should return the same buffer
+    if ( this->get< double >( 3, 10 ) != first || this->get< double >( 3, 1000 ) != first )
+        CHECK_RETURN( false );
+    // the headroom should absorb a slight growth
+    if ( this->get< double >( 3, 1100 ) != first )
+        CHECK_RETURN( false );
+    size_t bytes = this->total_bytes();
+    this->get< int >( 0, 100 );  // a new slot
+    if ( this->total_bytes() <= bytes )
+        CHECK_RETURN( false );
+    // a much larger request should grow the slot
+    double* second  = this->get< double >( 3, 100000 );
+    second[ 99999 ] = 1.0;
+    CHECK_RETURN( this->total_bytes() >= 100000 * sizeof( double ) + 100 * sizeof( int ) );
+}
+
+int arena::test_alignment( void )
+{
+    println( "Testing the alignment of the scratch arena ..." );
+    for ( size_t slot = 0; slot < 8; ++slot )
+    {
+        char* buffer = this->get< char >( slot, 3 + slot * 7 );
+        if ( ( uintptr_t )buffer % alignment != 0 )
+            CHECK_RETURN( false );
+    }
+    CHECK_RETURN( true );
+}
+#endif
+}  // namespace galotfa
+#endif
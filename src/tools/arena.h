@@ -0,0 +1,39 @@
+// This file define a growth-only scratch arena: the buffers are reused across the analysis steps,
+// and only reallocated when a larger size is requested, so the steady state is allocation free.
+#ifndef GALOTFA_ARENA_H
+#define GALOTFA_ARENA_H
+#include <stddef.h>
+#include <vector>
+namespace galotfa {
+class arena
+{
+    // private members
+private:
+    std::vector< void* >  buffers;     // the buffer of each slot
+    std::vector< size_t > capacities;  // the capacity of each slot in bytes
+
+    // private methods
+private:
+    void* reserve( size_t slot, size_t bytes );
+
+    // public methods
+public:
+    static const size_t alignment = 64;  // the alignment of the buffers in bytes, for SIMD
+    arena( void ){};
+    ~arena();
+    arena( const arena& )            = delete;
+    arena& operator=( const arena& ) = delete;
+    // get the buffer of the slot with at least len elements, the content is NOT initialized
+    // NOTE: the buffer is valid until the next call with the same slot
+    template < typename T > inline T* get( size_t slot, size_t len )
+    {
+        return ( T* )this->reserve( slot, len * sizeof( T ) );
+    }
+    size_t total_bytes( void ) const;  // the total size of all the slots, i.e. the high-water mark
+#ifdef debug_arena
+    int test_reuse( void );
+    int test_alignment( void );
+#endif
+};
+}  // namespace galotfa
+#endif
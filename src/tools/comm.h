@@ -0,0 +1,30 @@
+// This file define the MPI communicator of the analysis: MPI_COMM_WORLD by default, or a duplicate
+// of it in the asynchronous mode, so the collectives of the analysis thread never match those
+// issued by the simulation at the same time.
+#ifndef GALOTFA_COMM_H
+#define GALOTFA_COMM_H
+#include <mpi.h>
+#include <stddef.h>
+namespace galotfa {
+namespace comm {
+    inline MPI_Comm& current( void )
+    {
+        static MPI_Comm comm = MPI_COMM_WORLD;  // the communicator of all the analysis collectives
+        return comm;
+    }
+
+    inline void set( MPI_Comm comm )
+    {
+        current() = comm;
+    }
+
+    // the process that owns the index-th output, e.g. the file of a model set, in round-robin
+    inline int owner( size_t index )
+    {
+        int size = 1;
+        MPI_Comm_size( current(), &size );
+        return ( int )( index % size );
+    }
+}  // namespace comm
+}  // namespace galotfa
+#endif
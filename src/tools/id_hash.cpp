@@ -0,0 +1,102 @@
+#ifndef GALOTFA_ID_HASH_CPP
+#define GALOTFA_ID_HASH_CPP
+#include "./id_hash.h"
+#include "../tools/prompt.h"
+#include <algorithm>
+namespace galotfa {
+void id_hash::rehash( size_t capacity )
+{
+    // the capacity is a power of 2, and the load factor is kept below 1/2
+    size_t new_capacity = 16;
+    while ( new_capacity < 2 * capacity )
+        new_capacity <<= 1;
+
+    std::vector< long long > old_keys   = std::move( this->keys );
+    std::vector< int >       old_values = std::move( this->values );
+    this->keys.assign( new_capacity, 0 );
+    this->values.assign( new_capacity, -1 );
+    this->mask = new_capacity - 1;
+    this->num  = 0;
+    for ( size_t i = 0; i < old_values.size(); ++i )
+        if ( old_values[ i ] >= 0 )
+            this->insert( old_keys[ i ], old_values[ i ] );
+}
+
+void id_hash::build( const long long ids[], size_t len )
+{
+    this->keys.clear();
+    this->values.clear();
+    this->num = 0;
+    this->rehash( len );
+    for ( size_t i = 0; i < len; ++i )
+        this->insert( ids[ i ], ( int )i );
+}
+
+void id_hash::clear( void )
+{
+    std::fill( this->values.begin(), this->values.end(), -1 );
+    this->num = 0;
+}
+
+bool id_hash::insert( long long id, int value )
+{
+    if ( 2 * ( this->num + 1 ) > this->values.size() )
+        this->rehash( 2 * ( this->num + 1 ) );
+    size_t slot = hash( id ) & this->mask;
+    for ( ; this->values[ slot ] >= 0; slot = ( slot + 1 ) & this->mask )
+        if ( this->keys[ slot ] == id )
+            return false;
+    this->keys[ slot ]   = id;
+    this->values[ slot ] = value;
+    ++this->num;
+    return true;
+}
+
+#ifdef debug_id_hash
+int id_hash::test_build_find( void )
+{
+    println( "Testing the build and find of the ID hash table ..." );
+    std::vector< long long > ids;
+    for ( long long i = 0; i < 5000; ++i )
+        ids.push_back( i * 3 + ( 1LL << 40 ) );  // some 64-bit IDs with a stride
+    this->build( ids.data(), ids.size() );
+    if ( this->size() != ids.size() )
+        CHECK_RETURN( false );
+    for ( size_t i = 0; i < ids.size(); ++i )
+        if ( this->find( ids[ i ] ) != ( int )i || this->find( ids[ i ] + 1 ) != -1 )
+            CHECK_RETURN( false );
+    CHECK_RETURN( this->find( 0 ) == -1 && this->find( -1 ) == -1 );
+}
+
+int id_hash::test_duplicate( void )
+{
+    println( "Testing the duplicated IDs in the ID hash table ..." );
+    if ( this->find( 42 ) != -1 )  // an empty table
+        CHECK_RETURN( false );
+    long long ids[] = { 7, 42, 7, 3, 42 };
+    this->build( ids, 5 );
+    // the first index of the duplicated IDs wins
+    CHECK_RETURN( this->size() == 3 && this->find( 7 ) == 0 && this->find( 42 ) == 1
+                  && this->find( 3 ) == 3 && !this->insert( 3, 9 ) );
+}
+
+int id_hash::test_clear( void )
+{
+    println( "Testing the clear of the ID hash table ..." );
+    std::vector< long long > ids( 1000 );
+    for ( size_t i = 0; i < ids.size(); ++i )
+        ids[ i ] = ( long long )i * 7;
+    this->build( ids.data(), ids.size() );
+    size_t capacity = this->values.size();
+    this->clear();
+    if ( this->size() != 0 || this->find( 7 ) != -1 || this->values.size() != capacity )
+        CHECK_RETURN( false );
+    // the table is reusable without growing again
+    for ( size_t i = 0; i < ids.size(); ++i )
+        this->insert( ids[ ids.size() - 1 - i ], ( int )i );
+    CHECK_RETURN( this->size() == ids.size() && this->values.size() == capacity
+                  && this->find( 0 ) == ( int )ids.size() - 1 );
+}
+#endif
+}  // namespace galotfa
+#endif
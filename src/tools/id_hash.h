@@ -0,0 +1,67 @@
+// This file define an open-addressing hash table from the particle IDs to their indexes in a list,
+// which is used to look up the target particles, e.g. of the orbit log, in O(1) per particle.
+#ifndef GALOTFA_ID_HASH_H
+#define GALOTFA_ID_HASH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+namespace galotfa {
+class id_hash
+{
+    // private members
+private:
+    std::vector< long long > keys;    // the IDs in the slots
+    std::vector< int >       values;  // the indexes of the IDs, -1 for an empty slot
+    size_t                   mask = 0;
+    size_t                   num  = 0;  // the number of IDs in the table
+
+    // private methods
+private:
+    static inline size_t hash( long long id )
+    {
+        // the finalizer of splitmix64: the simulation IDs are usually consecutive
+        uint64_t x = ( uint64_t )id;
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return ( size_t )x;
+    }
+    void rehash( size_t capacity );
+
+    // public methods
+public:
+    id_hash( void ){};
+    ~id_hash(){};
+    // build the table from a list of IDs: the value of each ID is its first index in the list
+    void build( const long long ids[], size_t len );
+    // remove all the IDs, but keep the capacity for the next insertions
+    void clear( void );
+    // insert an ID with its value, return false if the ID exists already
+    bool insert( long long id, int value );
+    // return the value of the ID, or -1 if the ID is not in the table
+    inline int find( long long id ) const
+    {
+        if ( this->num == 0 )
+            return -1;
+        for ( size_t slot = hash( id ) & this->mask;; slot = ( slot + 1 ) & this->mask )
+        {
+            if ( this->values[ slot ] < 0 )
+                return -1;
+            if ( this->keys[ slot ] == id )
+                return this->values[ slot ];
+        }
+    }
+    inline size_t size( void ) const
+    {
+        return this->num;
+    }
+#ifdef debug_id_hash
+    int test_build_find( void );
+    int test_duplicate( void );
+    int test_clear( void );
+#endif
+};
+}  // namespace galotfa
+#endif
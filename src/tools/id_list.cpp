@@ -0,0 +1,279 @@
+#ifndef GALOTFA_ID_LIST_CPP
+#define GALOTFA_ID_LIST_CPP
+#include "./id_list.h"
+#include "../tools/prompt.h"
+#include <algorithm>
+#include <ctype.h>
+#include <hdf5.h>
+#include <string.h>
+namespace galotfa {
+// append an id range, and extend the last range if they are adjacent, so that a sorted list is
+// compact already while it is being read
+static inline void append_range( std::vector< id_list::range >& ranges, long long first,
+                                 long long last )
+{
+    if ( !ranges.empty() && first >= ranges.back().first && first <= ranges.back().last + 1 )
+        ranges.back().last = std::max( ranges.back().last, last );
+    else
+        ranges.push_back( { first, last } );
+}
+
+static inline bool ends_with( const std::string& str, const std::string& suffix )
+{
+    return str.size() >= suffix.size()
+           && str.compare( str.size() - suffix.size(), suffix.size(), suffix ) == 0;
+}
+
+int id_list::parse_text( FILE* file, std::vector< range >& ranges )
+{
+    static const size_t block_size = 1 << 20;
+    std::vector< char > block( block_size );
+
+    // the state of the parser, which is kept across the blocks
+    bool      in_number   = false;  // whether the current character is in a number
+    long long value       = 0;      // the number being parsed
+    bool      has_pending = false;  // whether there is a parsed number waiting for a "..b"
+    long long pending     = 0;
+    int       dots        = 0;  // the number of dots after the pending number
+    long long line        = 1;
+
+    // called at the end of each number
+    auto end_number = [ & ]() -> int {
+        in_number = false;
+        if ( has_pending && dots == 2 )
+        {
+            if ( value < pending )
+            {
+                WARN( "Invalid id range %lld..%lld at line %lld.", pending, value, line );
+                return 1;
+            }
+            append_range( ranges, pending, value );
+            has_pending = false;
+            dots        = 0;
+        }
+        else
+        {
+            if ( has_pending )
+                append_range( ranges, pending, pending );
+            has_pending = true;
+            pending     = value;
+        }
+        return 0;
+    };
+
+    size_t len = 0;
+    while ( ( len = fread( block.data(), 1, block_size, file ) ) > 0 )
+    {
+        for ( size_t i = 0; i < len; ++i )
+        {
+            char c = block[ i ];
+            if ( isdigit( ( unsigned char )c ) )
+            {
+                if ( !in_number )
+                {
+                    if ( has_pending && dots == 1 )
+                    {
+                        WARN( "Invalid id range at line %lld: a single dot.", line );
+                        return 1;
+                    }
+                    in_number = true;
+                    value     = 0;
+                }
+                value = value * 10 + ( c - '0' );
+                continue;
+            }
+            if ( in_number && end_number() != 0 )
+                return 1;
+            if ( c == '.' )
+            {
+                if ( !has_pending || ++dots > 2 )
+                {
+                    WARN( "Invalid id range at line %lld: unexpected dots.", line );
+                    return 1;
+                }
+            }
+            else if ( dots > 0 )
+            {
+                WARN( "Invalid id range at line %lld: the end of the range is missing.", line );
+                return 1;
+            }
+            else if ( c == '\n' )
+                ++line;
+            else if ( !isspace( ( unsigned char )c ) && strchr( ",-+:&", c ) == nullptr )
+            {
+                WARN( "Invalid character '%c' in the id list at line %lld.", c, line );
+                return 1;
+            }
+        }
+    }
+    if ( in_number && end_number() != 0 )
+        return 1;
+    if ( dots > 0 )
+    {
+        WARN( "Invalid id range at the end of the id list: the end of the range is missing." );
+        return 1;
+    }
+    if ( has_pending )
+        append_range( ranges, pending, pending );
+    return 0;
+}
+
+int id_list::read( const std::string& filename, std::vector< range >& ranges )
+{
+    ranges.clear();
+    if ( ends_with( filename, ".h5" ) || ends_with( filename, ".hdf5" ) )
+    {
+        hid_t file_id = H5Fopen( filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT );
+        if ( file_id < 0 )
+        {
+            WARN( "Failed to open the id list file %s.", filename.c_str() );
+            return 1;
+        }
+        hid_t dataset_id = H5Dopen2( file_id, "/ParticleIDs", H5P_DEFAULT );
+        if ( dataset_id < 0 )
+        {
+            WARN( "The dataset /ParticleIDs is not found in %s.", filename.c_str() );
+            H5Fclose( file_id );
+            return 1;
+        }
+        hid_t                    dataspace = H5Dget_space( dataset_id );
+        std::vector< long long > ids( ( size_t )H5Sget_simple_extent_npoints( dataspace ) );
+        herr_t                   status = H5Dread( dataset_id, H5T_NATIVE_LLONG, H5S_ALL,
+                                                   H5S_ALL, H5P_DEFAULT, ids.data() );
+        H5Sclose( dataspace );
+        H5Dclose( dataset_id );
+        H5Fclose( file_id );
+        if ( status < 0 )
+        {
+            WARN( "Failed to read the dataset /ParticleIDs in %s.", filename.c_str() );
+            return 1;
+        }
+        for ( auto& id : ids )
+            append_range( ranges, id, id );
+        normalize( ranges );
+        return 0;
+    }
+
+    FILE* file = fopen( filename.c_str(), ends_with( filename, ".bin" ) ? "rb" : "r" );
+    if ( file == nullptr )
+    {
+        WARN( "Failed to open the id list file %s.", filename.c_str() );
+        return 1;
+    }
+    int return_code = 0;
+    if ( ends_with( filename, ".bin" ) )
+    {
+        std::vector< long long > block( 1 << 16 );
+        size_t                   len = 0;
+        while ( ( len = fread( block.data(), sizeof( long long ), block.size(), file ) ) > 0 )
+            for ( size_t i = 0; i < len; ++i )
+                append_range( ranges, block[ i ], block[ i ] );
+    }
+    else
+        return_code = parse_text( file, ranges );
+    fclose( file );
+    normalize( ranges );
+    return return_code;
+}
+
+void id_list::normalize( std::vector< range >& ranges )
+{
+    std::sort( ranges.begin(), ranges.end(),
+               []( const range& a, const range& b ) { return a.first < b.first; } );
+    size_t num = 0;  // the number of the merged ranges
+    for ( size_t i = 0; i < ranges.size(); ++i )
+    {
+        if ( num > 0 && ranges[ i ].first <= ranges[ num - 1 ].last + 1 )
+            ranges[ num - 1 ].last = std::max( ranges[ num - 1 ].last, ranges[ i ].last );
+        else
+            ranges[ num++ ] = ranges[ i ];
+    }
+    ranges.resize( num );
+}
+
+long long id_list::count( const std::vector< range >& ranges )
+{
+    long long total = 0;
+    for ( auto& r : ranges )
+        total += r.last - r.first + 1;
+    return total;
+}
+}  // namespace galotfa
+
+#ifdef debug_id_list
+namespace unit_test {
+int test_parse_text( void )
+{
+    println( "Testing the parser of the text id list ..." );
+    const char* testfile = "test_idlist.txt";
+    FILE*       file     = fopen( testfile, "w" );
+    fprintf( file, "  5, 7 100..103\n9-8+3 : 6&104  \n\n20..20 2" );
+    fclose( file );
+    std::vector< galotfa::id_list::range > ranges;
+    int return_code = galotfa::id_list::read( testfile, ranges );
+    remove( testfile );
+    // the ids: 2-3, 5-9, 20, 100-104
+    if ( return_code != 0 || ranges.size() != 4 || galotfa::id_list::count( ranges ) != 13 )
+        CHECK_RETURN( false );
+    long long target[ 4 ][ 2 ] = { { 2, 3 }, { 5, 9 }, { 20, 20 }, { 100, 104 } };
+    for ( int i = 0; i < 4; ++i )
+        if ( ranges[ i ].first != target[ i ][ 0 ] || ranges[ i ].last != target[ i ][ 1 ] )
+            CHECK_RETURN( false );
+
+    // some invalid lists
+    const char* invalid[] = { "1 2 x", "5..3", "1.2", "3..", "..4", "1...4" };
+    for ( auto& content : invalid )
+    {
+        file = fopen( testfile, "w" );
+        fprintf( file, "%s", content );
+        fclose( file );
+        return_code = galotfa::id_list::read( testfile, ranges );
+        remove( testfile );
+        if ( return_code == 0 )
+        {
+            WARN( "The invalid id list \"%s\" is accepted.", content );
+            CHECK_RETURN( false );
+        }
+    }
+    CHECK_RETURN( true );
+}
+
+int test_read_binary( void )
+{
+    println( "Testing the reader of the binary id list ..." );
+    const char*              testfile = "test_idlist.bin";
+    std::vector< long long > ids;
+    for ( long long i = 0; i < 100000; ++i )
+        ids.push_back( ( 1LL << 40 ) + i * ( i % 2 == 0 ? 1 : 3 ) );  // part of them are adjacent
+    FILE* file = fopen( testfile, "wb" );
+    fwrite( ids.data(), sizeof( long long ), ids.size(), file );
+    fclose( file );
+    std::vector< galotfa::id_list::range > ranges;
+    int return_code = galotfa::id_list::read( testfile, ranges );
+    remove( testfile );
+    std::sort( ids.begin(), ids.end() );
+    ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+    if ( return_code != 0 || galotfa::id_list::count( ranges ) != ( long long )ids.size() )
+        CHECK_RETURN( false );
+    size_t index = 0;
+    for ( auto& r : ranges )
+        for ( long long id = r.first; id <= r.last; ++id )
+            if ( ids[ index++ ] != id )
+                CHECK_RETURN( false );
+    CHECK_RETURN( true );
+}
+
+int test_normalize( void )
+{
+    println( "Testing the normalization of the id ranges ..." );
+    std::vector< galotfa::id_list::range > ranges = {
+        { 10, 12 }, { 1, 3 }, { 4, 4 }, { 11, 20 }, { 30, 30 }, { 2, 2 }
+    };
+    galotfa::id_list::normalize( ranges );
+    CHECK_RETURN( ranges.size() == 3 && ranges[ 0 ].first == 1 && ranges[ 0 ].last == 4
+                  && ranges[ 1 ].first == 10 && ranges[ 1 ].last == 20 && ranges[ 2 ].first == 30
+                  && ranges[ 2 ].last == 30 && galotfa::id_list::count( ranges ) == 16 );
+}
+}  // namespace unit_test
+#endif
+#endif
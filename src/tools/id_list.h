@@ -0,0 +1,37 @@
+// This file define the reader of the particle id lists, e.g. the idfile of the orbit log. The ids
+// are streamed into the runs of consecutive ids, so a long list is kept (and broadcast) compactly.
+#ifndef GALOTFA_ID_LIST_H
+#define GALOTFA_ID_LIST_H
+#include <stdio.h>
+#include <string>
+#include <vector>
+namespace galotfa {
+namespace id_list {
+    struct range
+    {
+        long long first;  // the ids in [first, last]
+        long long last;
+    };
+    // read the id list, the format is decided by the extension of the file:
+    // - ".bin": a raw array of 64-bit integers in the native byte order
+    // - ".h5" or ".hdf5": the integer dataset /ParticleIDs of any shape, e.g. the orbit log file
+    // - others: text, see parse_text()
+    // the ranges are sorted and merged, return 0 if success
+    int read( const std::string& filename, std::vector< range >& ranges );
+    // parse the text id list block by block: the ids are separated by any of the white spaces and
+    // ",-+:&", and "a..b" is the range of ids from a to b (included)
+    int parse_text( FILE* file, std::vector< range >& ranges );
+    // sort the ranges and merge the overlapped or adjacent ones
+    void      normalize( std::vector< range >& ranges );
+    long long count( const std::vector< range >& ranges );  // the number of ids in the ranges
+}  // namespace id_list
+}  // namespace galotfa
+
+#ifdef debug_id_list
+namespace unit_test {
+int test_parse_text( void );
+int test_read_binary( void );
+int test_normalize( void );
+}  // namespace unit_test
+#endif
+#endif
@@ -0,0 +1,189 @@
+#ifndef GALOTFA_ID_SORT_CPP
+#define GALOTFA_ID_SORT_CPP
+#include "./id_sort.h"
+#include "../tools/prompt.h"
+#include <algorithm>
+#include <string.h>
+namespace galotfa {
+void id_sort::plan( const long long ids[], size_t len, MPI_Comm comm )
+{
+    this->comm = comm;
+    int size   = 1;
+    MPI_Comm_size( comm, &size );
+
+    // sort the local IDs, the duplicated IDs are kept in their original order
+    this->send_order.resize( len );
+    for ( size_t i = 0; i < len; ++i )
+        this->send_order[ i ] = i;
+    std::stable_sort( this->send_order.begin(), this->send_order.end(),
+                      [ ids ]( size_t a, size_t b ) { return ids[ a ] < ids[ b ]; } );
+
+    // the regular samples: size - 1 evenly spaced IDs of each non-empty process
+    std::vector< long long > samples;
+    if ( len > 0 )
+        for ( int k = 1; k < size; ++k )
+            samples.push_back( ids[ this->send_order[ len * k / size ] ] );
+    int                sample_num = ( int )samples.size();
+    std::vector< int > sample_counts( size ), sample_displs( size, 0 );
+    MPI_Allgather( &sample_num, 1, MPI_INT, sample_counts.data(), 1, MPI_INT, comm );
+    for ( int r = 1; r < size; ++r )
+        sample_displs[ r ] = sample_displs[ r - 1 ] + sample_counts[ r - 1 ];
+    std::vector< long long > all_samples( sample_displs.back() + sample_counts.back() );
+    MPI_Allgatherv( samples.data(), sample_num, MPI_LONG_LONG, all_samples.data(),
+                    sample_counts.data(), sample_displs.data(), MPI_LONG_LONG, comm );
+    std::sort( all_samples.begin(), all_samples.end() );
+
+    // process r gets the IDs in [ splitters[ r - 1 ], splitters[ r ] ), so the same IDs always
+    // go to the same process
+    std::vector< long long > splitters;
+    if ( !all_samples.empty() )
+        for ( int k = 1; k < size; ++k )
+            splitters.push_back( all_samples[ all_samples.size() * k / size ] );
+
+    // the sorted local IDs are sent in consecutive pieces
+    this->send_counts.assign( size, 0 );
+    this->send_displs.assign( size, 0 );
+    for ( size_t i = 0, r = 0; i < len; ++i )
+    {
+        while ( r < splitters.size() && splitters[ r ] <= ids[ this->send_order[ i ] ] )
+            ++r;
+        ++this->send_counts[ r ];
+    }
+    this->recv_counts.resize( size );
+    this->recv_displs.assign( size, 0 );
+    MPI_Alltoall( this->send_counts.data(), 1, MPI_INT, this->recv_counts.data(), 1, MPI_INT,
+                  comm );
+    for ( int r = 1; r < size; ++r )
+    {
+        this->send_displs[ r ] = this->send_displs[ r - 1 ] + this->send_counts[ r - 1 ];
+        this->recv_displs[ r ] = this->recv_displs[ r - 1 ] + this->recv_counts[ r - 1 ];
+    }
+
+    // the received IDs are sorted pieces in the rank order of the senders, which are merged
+    this->exchange( ids, sizeof( long long ) );
+    const long long* received = ( const long long* )this->recv_buffer.data();
+    size_t           recv_num = this->recv_displs.back() + this->recv_counts.back();
+    this->recv_order.resize( recv_num );
+    for ( size_t i = 0; i < recv_num; ++i )
+        this->recv_order[ i ] = i;
+    auto by_id = [ received ]( size_t a, size_t b ) { return received[ a ] < received[ b ]; };
+    std::stable_sort( this->recv_order.begin(), this->recv_order.end(), by_id );
+    this->sorted.resize( recv_num );
+    for ( size_t i = 0; i < recv_num; ++i )
+        this->sorted[ i ] = received[ this->recv_order[ i ] ];
+}
+
+void id_sort::exchange( const void* in, size_t element_size ) const
+{
+    if ( this->comm == MPI_COMM_NULL )
+        ERROR( "Exchange the elements before the plan of the sort." );
+    size_t send_num = this->send_order.size();
+    size_t recv_num = this->recv_displs.back() + this->recv_counts.back();
+    this->send_buffer.resize( send_num * element_size );
+    this->recv_buffer.resize( recv_num * element_size );
+    for ( size_t i = 0; i < send_num; ++i )
+        memcpy( &this->send_buffer[ i * element_size ],
+                ( const char* )in + this->send_order[ i ] * element_size, element_size );
+
+    MPI_Datatype element;
+    MPI_Type_contiguous( ( int )element_size, MPI_BYTE, &element );
+    MPI_Type_commit( &element );
+    MPI_Alltoallv( this->send_buffer.data(), this->send_counts.data(), this->send_displs.data(),
+                   element, this->recv_buffer.data(), this->recv_counts.data(),
+                   this->recv_displs.data(), element, this->comm );
+    MPI_Type_free( &element );
+}
+
+#ifdef debug_id_sort
+// whether the IDs of all the processes are sorted globally, and the total number is expected
+static bool sorted_globally( const galotfa::id_sort& sorter, unsigned long expected_num )
+{
+    int rank, size;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &size );
+    bool ok = std::is_sorted( sorter.ids(), sorter.ids() + sorter.size() );
+    // the first and last IDs of the non-empty processes
+    long long                bounds[ 3 ] = { ( long long )sorter.size(), 0, 0 };
+    std::vector< long long > all_bounds( 3 * size );
+    if ( sorter.size() > 0 )
+    {
+        bounds[ 1 ] = sorter.ids()[ 0 ];
+        bounds[ 2 ] = sorter.ids()[ sorter.size() - 1 ];
+    }
+    MPI_Allgather( bounds, 3, MPI_LONG_LONG, all_bounds.data(), 3, MPI_LONG_LONG, MPI_COMM_WORLD );
+    unsigned long total = 0;
+    long long     last  = 0;
+    for ( int r = 0; r < size; ++r )
+    {
+        if ( all_bounds[ 3 * r ] == 0 )
+            continue;
+        if ( total > 0 && all_bounds[ 3 * r + 1 ] < last )
+            ok = false;
+        total += all_bounds[ 3 * r ];
+        last = all_bounds[ 3 * r + 2 ];
+    }
+    return ok && total == expected_num;
+}
+
+int id_sort::test_sort( void )
+{
+    println( "Testing the parallel sort of the IDs ..." );
+    int rank, size;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &size );
+    // a shuffled permutation of some 64-bit IDs, dealt to the processes in turn
+    const long long          num = 10007;
+    std::vector< long long > ids;
+    long long                sum = 0, local_sum = 0;
+    for ( long long i = rank; i < num; i += size )
+        ids.push_back( ( i * 7919 ) % num + ( 1LL << 40 ) );
+    this->plan( ids.data(), ids.size(), MPI_COMM_WORLD );
+    for ( size_t i = 0; i < this->size(); ++i )
+        local_sum += this->ids()[ i ] - ( 1LL << 40 );
+    MPI_Allreduce( &local_sum, &sum, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD );
+    int ok = sorted_globally( *this, num ) && sum == num * ( num - 1 ) / 2
+              && this->size() < 2 * ( size_t )num / size + size;
+    MPI_Allreduce( MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD );
+    CHECK_RETURN( ok );
+}
+
+int id_sort::test_apply( void )
+{
+    println( "Testing the exchange of the fields with the sorted IDs ..." );
+    int rank, size;
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    MPI_Comm_size( MPI_COMM_WORLD, &size );
+    // the root has no particles, and each ID appears twice on one of the other processes
+    std::vector< long long > ids;
+    std::vector< double >    values;
+    std::vector< int >       copies;
+    if ( rank > 0 || size == 1 )
+        for ( int i = 0; i < 500; ++i )
+            for ( int copy = 0; copy < 2; ++copy )
+            {
+                ids.push_back( ( i * 37 ) % 500 * size + rank );
+                values.push_back( ids.back() * 0.5 );
+                copies.push_back( copy );
+            }
+    unsigned long num = ids.size();
+    MPI_Allreduce( MPI_IN_PLACE, &num, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD );
+    this->plan( ids.data(), ids.size(), MPI_COMM_WORLD );
+    std::vector< double > sorted_values;
+    std::vector< int >    sorted_copies;
+    this->apply( values.data(), sorted_values );
+    this->apply( copies.data(), sorted_copies );
+    int ok = sorted_globally( *this, num ) && sorted_values.size() == this->size();
+    for ( size_t i = 0; ok && i < this->size(); ++i )
+        if ( sorted_values[ i ] != this->ids()[ i ] * 0.5 )
+            ok = false;
+    // the duplicated IDs keep their original order
+    for ( size_t i = 0; ok && i < this->size(); ++i )
+        if ( sorted_copies[ i ] != ( int )( i % 2 )
+             || ( i % 2 == 1 && this->ids()[ i ] != this->ids()[ i - 1 ] ) )
+            ok = false;
+    MPI_Allreduce( MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD );
+    CHECK_RETURN( ok );
+}
+#endif
+}  // namespace galotfa
+#endif
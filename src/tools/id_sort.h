@@ -0,0 +1,62 @@
+// This file define a parallel sample sort of the particle IDs over the MPI processes: after it, the
+// IDs of each process are sorted, and smaller than those of the higher ranks, so a row written in
+// the rank order is sorted by the IDs globally. The same exchange is then applied to the results
+// of the particles, field by field.
+#ifndef GALOTFA_ID_SORT_H
+#define GALOTFA_ID_SORT_H
+#include <mpi.h>
+#include <stddef.h>
+#include <vector>
+namespace galotfa {
+class id_sort
+{
+    // private members
+private:
+    MPI_Comm                 comm = MPI_COMM_NULL;
+    std::vector< long long > sorted;       // the IDs of this process after the sort
+    std::vector< size_t >    send_order;   // the local index of each element to send
+    std::vector< size_t >    recv_order;   // the received index of each sorted element
+    std::vector< int >       send_counts;  // the number of elements to send to each process
+    std::vector< int >       send_displs;
+    std::vector< int >       recv_counts;  // the number of elements from each process
+    std::vector< int >       recv_displs;
+    mutable std::vector< char > send_buffer;  // the buffers of the exchange in apply()
+    mutable std::vector< char > recv_buffer;
+
+    // private methods
+private:
+    void exchange( const void* in, size_t element_size ) const;
+
+    // public methods
+public:
+    id_sort( void ){};
+    ~id_sort(){};
+    // sort the IDs of all the processes in comm, which is collective
+    // NOTE: the number of elements of each process changes, but less than twice of the average
+    void plan( const long long ids[], size_t len, MPI_Comm comm );
+    // move the elements of a field, in the same order of the IDs given to plan(), to their sorted
+    // positions, which is collective as well
+    template < typename T > void apply( const T in[], std::vector< T >& out ) const
+    {
+        this->exchange( in, sizeof( T ) );
+        out.resize( this->recv_order.size() );
+        const T* received = ( const T* )this->recv_buffer.data();
+        for ( size_t i = 0; i < out.size(); ++i )
+            out[ i ] = received[ this->recv_order[ i ] ];
+    }
+    // the sorted IDs of this process
+    inline const long long* ids( void ) const
+    {
+        return this->sorted.data();
+    }
+    inline size_t size( void ) const
+    {
+        return this->sorted.size();
+    }
+#ifdef debug_id_sort
+    int test_sort( void );
+    int test_apply( void );
+#endif
+};
+}  // namespace galotfa
+#endif
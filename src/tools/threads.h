@@ -0,0 +1,97 @@
+// This file define the OpenMP back-end of the analysis kernels: the particles are split into a fixed
+// number of contiguous chunks, each chunk is accumulated into its own private buffer, and the buffers
+// are merged in the chunk order before any MPI reduction. So the results only depend on the number
+// of threads, not on the scheduling. Without OpenMP (-fopenmp), everything runs in one chunk.
+#ifndef GALOTFA_THREADS_H
+#define GALOTFA_THREADS_H
+#include <algorithm>
+#include <stddef.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#define GALOTFA_OMP( directive ) _Pragma( #directive )
+#else
+#define GALOTFA_OMP( directive )
+#endif
+namespace galotfa {
+namespace threads {
+    // the minimal number of particles of a chunk, to not pay the fork-join for small arrays
+    const long min_chunk = 4096;
+    // the maximal number of doubles of all the private accumulators of chunked_sum(), 512 MB
+    const size_t max_private_len = ( size_t )1 << 26;
+
+    inline int& count( void )
+    {
+        static int num = 1;  // the number of threads of the analysis kernels
+        return num;
+    }
+
+    // set the number of threads, 0 for the default of the OpenMP runtime, e.g. OMP_NUM_THREADS
+    inline void set( int num )
+    {
+#ifdef _OPENMP
+        count() = num > 0 ? num : omp_get_max_threads();
+#else
+        ( void )num;
+        count() = 1;
+#endif
+    }
+
+    // the number of chunks to split len particles, which only depends on len and the thread number
+    inline int chunks( long len )
+    {
+        long num = std::min( ( long )count(), len / min_chunk );
+        return num > 1 ? ( int )num : 1;
+    }
+
+    // call kernel( chunk, begin, end ) for each chunk of [0, len) in parallel
+    template < typename Kernel > inline void for_chunks( long len, int chunk_num, Kernel kernel )
+    {
+        if ( chunk_num <= 1 )
+        {
+            kernel( 0, 0L, len );
+            return;
+        }
+        GALOTFA_OMP( omp parallel for schedule( static, 1 ) num_threads( chunk_num ) )
+        for ( int c = 0; c < chunk_num; ++c )
+            kernel( c, len * c / chunk_num, len * ( c + 1 ) / chunk_num );
+    }
+
+    // call body( i ) for each i in [0, len) in parallel, for the element-wise loops
+    template < typename Body > inline void for_each( long len, Body body )
+    {
+        auto kernel = [ & ]( int, long begin, long end ) {
+            for ( long i = begin; i < end; ++i )
+                body( i );
+        };
+        for_chunks( len, chunks( len ), kernel );
+    }
+
+    // kernel( begin, end, acc ) adds the particles in [begin, end) into acc of acc_len doubles,
+    // result is the sum of the accumulators of all the chunks, added up in the chunk order
+    template < typename Kernel >
+    inline void chunked_sum( long len, size_t acc_len, double result[], Kernel kernel )
+    {
+        // fewer chunks for the large accumulators, which is still only decided by len and acc_len
+        int chunk_num = chunks( len );
+        if ( acc_len > 0 )
+            chunk_num = ( int )std::min( ( size_t )chunk_num, max_private_len / acc_len + 1 );
+        std::fill( result, result + acc_len, 0.0 );
+        if ( chunk_num == 1 )
+        {
+            kernel( 0L, len, result );
+            return;
+        }
+        // the first chunk accumulates into the result directly
+        std::vector< double > private_acc( ( chunk_num - 1 ) * acc_len, 0.0 );
+        for_chunks( len, chunk_num, [ & ]( int c, long begin, long end ) {
+            kernel( begin, end, c == 0 ? result : &private_acc[ ( c - 1 ) * acc_len ] );
+        } );
+        GALOTFA_OMP( omp parallel for schedule( static ) num_threads( chunk_num ) )
+        for ( long j = 0; j < ( long )acc_len; ++j )
+            for ( int c = 1; c < chunk_num; ++c )
+                result[ j ] += private_acc[ ( c - 1 ) * acc_len + j ];
+    }
+}  // namespace threads
+}  // namespace galotfa
+#endif
@@ -49,6 +49,18 @@ static void operator+=( std::vector< int >& vec1, std::vector< int > vec2 )
 #ifdef debug_utils
 #include "test_utils.cpp"
 #endif
+#ifdef debug_arena
+#include "test_arena.cpp"
+#endif
+#ifdef debug_id_hash
+#include "test_id_hash.cpp"
+#endif
+#ifdef debug_id_list
+#include "test_id_list.cpp"
+#endif
+#ifdef debug_id_sort
+#include "test_id_sort.cpp"
+#endif
 
 #ifdef MPI_TEST
 int main( int argc, char* argv[] )
@@ -80,6 +92,22 @@ int main()
         result += test_prompt();
         println( "--------------------------------------------------------------------" );
 #endif
+#ifdef debug_arena
+        result += test_arena();
+        println( "--------------------------------------------------------------------" );
+#endif
+#ifdef debug_id_hash
+        result += test_id_hash();
+        println( "--------------------------------------------------------------------" );
+#endif
+#ifdef debug_id_list
+        result += test_id_list();
+        println( "--------------------------------------------------------------------" );
+#endif
+#ifdef debug_id_sort
+        result += test_id_sort();
+        println( "--------------------------------------------------------------------" );
+#endif
 #ifdef debug_parameter
         result += test_parameter();
         println( "--------------------------------------------------------------------" );
@@ -0,0 +1,27 @@
+// Call the unit test functions for the scratch arena.
+#ifndef ARENA_TEST
+#define ARENA_TEST
+#include "../tools/arena.cpp"
+#include "../tools/arena.h"
+#include "../tools/prompt.h"
+#include <vector>
+
+static std::vector< int > test_arena( void )
+{
+    println( "Testing the scratch arena ..." );
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    // each test case uses its own arena
+    galotfa::arena reuse, alignment;
+    COUNT( reuse.test_reuse() );
+    COUNT( alignment.test_alignment() );
+    SUMMARY( "arena" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
+}
+#endif
@@ -0,0 +1,28 @@
+// Call the unit test functions for the ID hash table.
+#ifndef ID_HASH_TEST
+#define ID_HASH_TEST
+#include "../tools/id_hash.cpp"
+#include "../tools/id_hash.h"
+#include "../tools/prompt.h"
+#include <vector>
+
+static std::vector< int > test_id_hash( void )
+{
+    println( "Testing the ID hash table ..." );
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    // each test case uses its own table
+    galotfa::id_hash build_find, duplicate, clear;
+    COUNT( build_find.test_build_find() );
+    COUNT( duplicate.test_duplicate() );
+    COUNT( clear.test_clear() );
+    SUMMARY( "ID hash table" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
+}
+#endif
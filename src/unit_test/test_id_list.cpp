@@ -0,0 +1,26 @@
+// Call the unit test functions for the reader of the ID lists.
+#ifndef ID_LIST_TEST
+#define ID_LIST_TEST
+#include "../tools/id_list.cpp"
+#include "../tools/id_list.h"
+#include "../tools/prompt.h"
+#include <vector>
+
+static std::vector< int > test_id_list( void )
+{
+    println( "Testing the reader of the ID lists ..." );
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    COUNT( unit_test::test_parse_text() );
+    COUNT( unit_test::test_read_binary() );
+    COUNT( unit_test::test_normalize() );
+    SUMMARY( "ID list reader" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
+}
+#endif
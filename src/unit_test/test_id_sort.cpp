@@ -0,0 +1,27 @@
+// Call the unit test functions for the parallel sort of the IDs.
+#ifndef ID_SORT_TEST
+#define ID_SORT_TEST
+#include "../tools/id_sort.cpp"
+#include "../tools/id_sort.h"
+#include "../tools/prompt.h"
+#include <vector>
+
+static std::vector< int > test_id_sort( void )
+{
+    println( "Testing the parallel sort of the IDs ..." );
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    // each test case uses its own sorter
+    galotfa::id_sort sort, apply;
+    COUNT( sort.test_sort() );
+    COUNT( apply.test_apply() );
+    SUMMARY( "ID sort" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
+}
+#endif
@@ -1,14 +1,31 @@
 // Call the unit test functions for model analysis part.
 #ifndef MODEL_TEST
 #define MODEL_TEST
+// include the head file of the model analysis part.
+#include "../analysis/model.cpp"
+#include "../analysis/model.h"
+#include "../tools/arena.cpp"
+#include "../tools/id_hash.cpp"
 #include "../tools/prompt.h"
 #include <stdio.h>
+#include <vector>
 
-// include the head file of the model analysis part.
-static void test_model( void )
+static std::vector< int > test_model( void )
 {
     println( "Test the model analysis part.\n" );
-    // call the unit test functions for the model analysis part.
-    return;
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    COUNT( unit_test::test_fused_moments() );
+    COUNT( unit_test::test_fourier_modes() );
+    COUNT( unit_test::test_image_moments() );
+    COUNT( unit_test::test_dispersion_moments() );
+    SUMMARY( "model analysis" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
 }
 #endif
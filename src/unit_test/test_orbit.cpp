@@ -1,14 +1,24 @@
 // Call the unit test functions for orbit analysis part.
 #ifndef ORBIT_TEST
 #define ORBIT_TEST
+#include "../analysis/orbit_curve.cpp"
+#include "../analysis/orbit_curve.h"
 #include "../tools/prompt.h"
 #include <stdio.h>
 
-// include the head file of the orbit analysis part.
-static void test_orbit( void )
+static std::vector< int > test_orbit()
 {
     println( "Test the orbit analysis part.\n" );
-    // call the unit test functions for the orbit analysis part.
-    return;
+    int success = 0;
+    int fail    = 0;
+    int unknown = 0;
+    COUNT( unit_test::test_gather_orbits() );
+    SUMMARY( "orbit analysis" );
+
+    std::vector< int > result = { 0, 0, 0 };
+    result[ 0 ]               = success;
+    result[ 1 ]               = fail;
+    result[ 2 ]               = unknown;
+    return result;
 }
 #endif
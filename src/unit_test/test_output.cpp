@@ -22,6 +22,12 @@ static std::vector< int > test_output( void )
     COUNT( writer.test_create_group() );
     COUNT( writer.test_create_dataset() );
     COUNT( writer.test_push() );
+    COUNT( writer.test_push_rows() );
+    COUNT( writer.test_buffered_push() );
+    COUNT( writer.test_channel() );
+    COUNT( writer.test_table() );
+    COUNT( writer.test_push_slab() );
+    COUNT( writer.test_filters() );
     SUMMARY( "output" );
 
     std::vector< int > result = { 0, 0, 0 };
@@ -16,6 +16,8 @@ static std::vector< int > test_pre()
     int unknown = 0;
     COUNT( unit_test::test_center_of_mass() );
     COUNT( unit_test::test_most_dense_pixel() );
+    COUNT( unit_test::test_density_peak_refine() );
+    COUNT( unit_test::test_shrink_sphere() );
     SUMMARY( "pre-processing" );
 
     std::vector< int > result = { 0, 0, 0 };
@@ -21,6 +21,9 @@ static std::vector< int > test_utils()
     COUNT( unit_test::test_mat() );
     COUNT( unit_test::test_bin1d() );
     COUNT( unit_test::test_bin2d() );
+    COUNT( unit_test::test_streaming_stats() );
+    COUNT( unit_test::test_histogram() );
+    COUNT( unit_test::test_threaded_binning() );
     SUMMARY( "analysis utils" );
 
     std::vector< int > result = { 0, 0, 0 };